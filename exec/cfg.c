@@ -99,6 +99,33 @@ static int shutdown_yes;
 static int shutdown_no;
 static int shutdown_expected;
 
+/*
+ * Keys with these prefixes are removed from the live map when they are
+ * deleted from the config file
+ */
+static const char *reload_delete_prefixes[] = {
+	"logging.",
+	"totem.",
+	"nodelist.",
+	"quorum.",
+	"uidgid.config.",
+	"nozzle.",
+};
+
+/*
+ * Config as applied by the last successful reload (NULL before the first
+ * one) and keys whose live value may differ from it. Next reload diffs the
+ * new file against reload_applied_map and touches the live map only for
+ * changed keys.
+ */
+#define RELOAD_TRACKED_SECTIONS_MAX	32
+
+static icmap_map_t reload_applied_map;
+static icmap_map_t reload_dirty_map;
+static int reload_dirty_map_incomplete;
+static icmap_track_t reload_tracks[RELOAD_TRACKED_SECTIONS_MAX];
+static int reload_tracks_entries;
+
 struct cfg_info
 {
 	struct qb_list_head list;
@@ -634,6 +661,7 @@ static void remove_ro_entries(icmap_map_t temp_map)
 	delete_and_notify_if_changed(temp_map, "totem.ip_version");
 	delete_and_notify_if_changed(temp_map, "totem.ip_dscp");
 	delete_and_notify_if_changed(temp_map, "totem.netmtu");
+	delete_and_notify_if_changed(temp_map, "totem.udp_recv_batch");
 	delete_and_notify_if_changed(temp_map, "totem.interface.bindnetaddr");
 	delete_and_notify_if_changed(temp_map, "totem.interface.mcastaddr");
 	delete_and_notify_if_changed(temp_map, "totem.interface.broadcast");
@@ -707,6 +735,293 @@ static void remove_deleted_entries(icmap_map_t temp_map, const char *prefix)
 	icmap_iter_finalize(old_iter);
 }
 
+static int reload_key_deletable(const char *key_name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(reload_delete_prefixes) / sizeof(reload_delete_prefixes[0]); i++) {
+		if (strncmp(key_name, reload_delete_prefixes[i], strlen(reload_delete_prefixes[i])) == 0) {
+			return (1);
+		}
+	}
+
+	return (0);
+}
+
+static int reload_key_exists(icmap_map_t map, const char *key_name)
+{
+
+	return (icmap_get_r(map, key_name, NULL, NULL, NULL) == CS_OK);
+}
+
+static void reload_dirty_key_notify_fn(
+	int32_t event,
+	const char *key_name,
+	struct icmap_notify_value new_val,
+	struct icmap_notify_value old_val,
+	void *user_data)
+{
+
+	if (icmap_set_uint8_r(reload_dirty_map, key_name, 1) != CS_OK) {
+		reload_dirty_map_incomplete = 1;
+	}
+}
+
+static void reload_tracks_drop(void)
+{
+	int i;
+
+	for (i = 0; i < reload_tracks_entries; i++) {
+		icmap_track_delete(reload_tracks[i]);
+	}
+	reload_tracks_entries = 0;
+}
+
+static void reload_applied_map_drop(void)
+{
+
+	reload_tracks_drop();
+
+	if (reload_applied_map != NULL) {
+		icmap_fini_r(reload_applied_map);
+		reload_applied_map = NULL;
+	}
+
+	if (reload_dirty_map != NULL) {
+		icmap_fini_r(reload_dirty_map);
+		reload_dirty_map = NULL;
+	}
+
+	reload_dirty_map_incomplete = 0;
+}
+
+static int reload_track_section(const char *section)
+{
+
+	if (reload_tracks_entries == RELOAD_TRACKED_SECTIONS_MAX) {
+		return (-1);
+	}
+
+	if (icmap_track_add(section,
+	    ICMAP_TRACK_ADD | ICMAP_TRACK_DELETE | ICMAP_TRACK_MODIFY | ICMAP_TRACK_PREFIX,
+	    reload_dirty_key_notify_fn, NULL, &reload_tracks[reload_tracks_entries]) != CS_OK) {
+		return (-1);
+	}
+	reload_tracks_entries++;
+
+	return (0);
+}
+
+/*
+ * Start recording changes of the live map against the config in map, before
+ * the reload applies it. Every write is recorded, the reload's own included,
+ * so nothing written by modules reacting to the reload is lost.
+ * reload_dirty_map_prune later drops keys which ended up equal to map.
+ * If tracking is not possible, next reload does the full work.
+ */
+static void reload_track_start(icmap_map_t map)
+{
+	icmap_iter_t iter;
+	const char *key_name;
+	const char *dot;
+	char section[ICMAP_KEYNAME_MAXLEN + 1];
+	size_t len;
+	size_t i;
+
+	reload_tracks_drop();
+	reload_dirty_map_incomplete = 0;
+
+	if (icmap_init_r(&reload_dirty_map) != CS_OK) {
+		reload_dirty_map = NULL;
+		goto error_drop;
+	}
+
+	for (i = 0; i < sizeof(reload_delete_prefixes) / sizeof(reload_delete_prefixes[0]); i++) {
+		if (reload_track_section(reload_delete_prefixes[i]) != 0) {
+			goto error_drop;
+		}
+	}
+
+	iter = icmap_iter_init_r(map, NULL);
+	if (iter == NULL) {
+		goto error_drop;
+	}
+
+	/*
+	 * Keys are sorted, so keys of one section follow each other
+	 */
+	section[0] = '\0';
+	while ((key_name = icmap_iter_next(iter, NULL, NULL)) != NULL) {
+		dot = strchr(key_name, '.');
+		len = (dot != NULL ? (size_t)(dot - key_name) + 1 : strlen(key_name));
+
+		if (strlen(section) == len && strncmp(section, key_name, len) == 0) {
+			continue;
+		}
+
+		memcpy(section, key_name, len);
+		section[len] = '\0';
+
+		if (reload_track_section(section) != 0) {
+			icmap_iter_finalize(iter);
+			goto error_drop;
+		}
+	}
+	icmap_iter_finalize(iter);
+
+	return ;
+
+error_drop:
+	log_printf(LOGSYS_LEVEL_DEBUG, "Can't track config changes, next reload will compare all keys");
+	reload_tracks_drop();
+	reload_dirty_map_incomplete = 1;
+}
+
+/*
+ * Keep only keys whose live value differs from map. Runs once the reload
+ * is done, when nothing writes the live map.
+ */
+static void reload_dirty_map_prune(icmap_map_t map)
+{
+	icmap_map_t pruned_map;
+	icmap_map_t live_map = icmap_get_global_map();
+	icmap_iter_t iter;
+	const char *key_name;
+
+	if (icmap_init_r(&pruned_map) != CS_OK) {
+		return ;
+	}
+
+	iter = icmap_iter_init_r(reload_dirty_map, NULL);
+	if (iter == NULL) {
+		icmap_fini_r(pruned_map);
+		return ;
+	}
+
+	while ((key_name = icmap_iter_next(iter, NULL, NULL)) != NULL) {
+		if (!reload_key_exists(live_map, key_name) && !reload_key_exists(map, key_name)) {
+			continue;
+		}
+		if (icmap_key_value_eq(live_map, key_name, map, key_name)) {
+			continue;
+		}
+		if (icmap_set_uint8_r(pruned_map, key_name, 1) != CS_OK) {
+			icmap_iter_finalize(iter);
+			icmap_fini_r(pruned_map);
+			return ;
+		}
+	}
+	icmap_iter_finalize(iter);
+
+	icmap_fini_r(reload_dirty_map);
+	reload_dirty_map = pruned_map;
+}
+
+/*
+ * Keep map with applied config for the next reload
+ */
+static void reload_applied_map_set(icmap_map_t map)
+{
+
+	if (reload_applied_map != NULL) {
+		icmap_fini_r(reload_applied_map);
+	}
+	reload_applied_map = map;
+
+	if (reload_dirty_map == NULL || reload_dirty_map_incomplete) {
+		reload_applied_map_drop();
+		return ;
+	}
+
+	reload_dirty_map_prune(map);
+}
+
+static void reload_delete_diff_fn(int32_t event, const char *key_name, void *user_data)
+{
+
+	if (event == ICMAP_TRACK_DELETE && reload_key_deletable(key_name)) {
+		icmap_delete(key_name);
+	}
+}
+
+/*
+ * Incremental remove_deleted_entries: delete keys which were in the applied
+ * config or were changed since (changed_map), but are not in temp_map
+ */
+static void remove_deleted_entries_incremental(icmap_map_t temp_map, icmap_map_t changed_map)
+{
+	icmap_iter_t iter;
+	const char *key_name;
+
+	icmap_diff_r(reload_applied_map, temp_map, reload_delete_diff_fn, NULL);
+
+	iter = icmap_iter_init_r(changed_map, NULL);
+	if (iter != NULL) {
+		while ((key_name = icmap_iter_next(iter, NULL, NULL)) != NULL) {
+			if (reload_key_deletable(key_name) && !reload_key_exists(temp_map, key_name)) {
+				icmap_delete(key_name);
+			}
+		}
+		icmap_iter_finalize(iter);
+	}
+}
+
+struct reload_copy_data {
+	icmap_map_t temp_map;
+	cs_error_t err;
+};
+
+static void reload_copy_diff_fn(int32_t event, const char *key_name, void *user_data)
+{
+	struct reload_copy_data *copy_data = (struct reload_copy_data *)user_data;
+	cs_error_t err;
+
+	if (event != ICMAP_TRACK_ADD && event != ICMAP_TRACK_MODIFY) {
+		return ;
+	}
+
+	err = icmap_copy_key(icmap_get_global_map(), copy_data->temp_map, key_name);
+	if (err != CS_OK) {
+		copy_data->err = err;
+	}
+}
+
+/*
+ * Incremental icmap_copy_map: copy keys added or changed against the
+ * applied config, and keys changed in the live map since it was applied
+ * (changed_map)
+ */
+static cs_error_t copy_changed_entries(icmap_map_t temp_map, icmap_map_t changed_map)
+{
+	struct reload_copy_data copy_data;
+	icmap_iter_t iter;
+	const char *key_name;
+	cs_error_t err;
+
+	copy_data.temp_map = temp_map;
+	copy_data.err = CS_OK;
+
+	err = icmap_diff_r(reload_applied_map, temp_map, reload_copy_diff_fn, &copy_data);
+	if (err == CS_OK) {
+		err = copy_data.err;
+	}
+
+	iter = icmap_iter_init_r(changed_map, NULL);
+	if (iter == NULL && err == CS_OK) {
+		err = CS_ERR_NO_MEMORY;
+	}
+	if (iter != NULL) {
+		while (err == CS_OK && (key_name = icmap_iter_next(iter, NULL, NULL)) != NULL) {
+			if (reload_key_exists(temp_map, key_name)) {
+				err = icmap_copy_key(icmap_get_global_map(), temp_map, key_name);
+			}
+		}
+		icmap_iter_finalize(iter);
+	}
+
+	return (err);
+}
+
 /*
  * Reload configuration file
  */
@@ -718,8 +1033,11 @@ static void message_handler_req_exec_cfg_reload_config (
 	struct res_lib_cfg_reload_config res_lib_cfg_reload_config;
 	struct totem_config new_config;
 	icmap_map_t temp_map;
+	icmap_map_t changed_map = NULL;
 	const char *error_string;
 	int res = CS_OK;
+	int incremental;
+	size_t i;
 
 	ENTER();
 
@@ -750,16 +1068,32 @@ static void message_handler_req_exec_cfg_reload_config (
 		goto reload_fini_nofree;
 	}
 
+	/*
+	 * With config applied by the previous reload only keys which differ
+	 * from it (or were changed since) are looked at in the live map
+	 */
+	incremental = (reload_applied_map != NULL && reload_dirty_map != NULL &&
+	    !reload_dirty_map_incomplete);
+
+	/*
+	 * From now on changes are recorded against the new config, including
+	 * writes of modules reacting to config.reload_in_progress
+	 */
+	changed_map = reload_dirty_map;
+	reload_dirty_map = NULL;
+	reload_track_start(temp_map);
+
 	/* Signal start of the reload process */
 	icmap_set_uint8("config.reload_in_progress", 1);
 
 	/* Detect deleted entries and remove them from the main icmap hashtable */
-	remove_deleted_entries(temp_map, "logging.");
-	remove_deleted_entries(temp_map, "totem.");
-	remove_deleted_entries(temp_map, "nodelist.");
-	remove_deleted_entries(temp_map, "quorum.");
-	remove_deleted_entries(temp_map, "uidgid.config.");
-	remove_deleted_entries(temp_map, "nozzle.");
+	if (incremental) {
+		remove_deleted_entries_incremental(temp_map, changed_map);
+	} else {
+		for (i = 0; i < sizeof(reload_delete_prefixes) / sizeof(reload_delete_prefixes[0]); i++) {
+			remove_deleted_entries(temp_map, reload_delete_prefixes[i]);
+		}
+	}
 
 	/* Remove entries that cannot be changed */
 	remove_ro_entries(temp_map);
@@ -824,7 +1158,12 @@ static void message_handler_req_exec_cfg_reload_config (
 	/*
 	 * Copy new keys into live config.
 	 */
-	if ( (res = icmap_copy_map(icmap_get_global_map(), temp_map)) != CS_OK) {
+	if (incremental) {
+		res = copy_changed_entries(temp_map, changed_map);
+	} else {
+		res = icmap_copy_map(icmap_get_global_map(), temp_map);
+	}
+	if (res != CS_OK) {
 		log_printf (LOGSYS_LEVEL_ERROR, "Error making new config live. cmap database may be inconsistent\n");
 		/* Return res from icmap */
 		goto reload_fini;
@@ -843,6 +1182,22 @@ reload_fini:
 	/* Finished with the temporary storage */
 	free(new_config.interfaces);
 	free(new_config.orig_interfaces);
+	if (changed_map != NULL) {
+		icmap_fini_r(changed_map);
+	}
+
+	if (res == CS_OK) {
+		/*
+		 * temp_map is now the applied config, keep it for next reload
+		 */
+		reload_applied_map_set(temp_map);
+		goto reload_fini_nomap;
+	}
+
+	/*
+	 * Live map may be partly changed, applied config no longer describes it
+	 */
+	reload_applied_map_drop();
 
 reload_fini_nofree:
 	icmap_fini_r(temp_map);
@@ -54,6 +54,7 @@
 #include <corosync/logsys.h>
 #include <corosync/coroapi.h>
 #include <corosync/icmap.h>
+#include <corosync/cmap.h>
 
 #include "service.h"
 #include "ipcs_stats.h"
@@ -62,7 +63,9 @@
 LOGSYS_DECLARE_SUBSYS ("CMAP");
 
 #define MAX_REQ_EXEC_CMAP_MCAST_ITEMS		32
+#define CMAP_SNAPSHOT_MAX_SIZE			(8192*128)
 #define ICMAP_VALUETYPE_NOT_EXIST		0
+#define CMAP_NOTIFY_BATCH_SIZE			(64*1024)
 
 struct cmap_map {
 	cs_error_t (*map_get)(const char *key_name,
@@ -93,6 +96,13 @@ struct cmap_map {
 
 	cs_error_t (*map_track_delete)(icmap_track_t icmap_track);
 	void * (*map_track_get_user_data)(icmap_track_t icmap_track);
+
+	/*
+	 * Optional. Called around building of snapshot so map can reuse
+	 * data shared by multiple keys.
+	 */
+	void (*map_snapshot_begin)(void);
+	void (*map_snapshot_end)(void);
 };
 
 struct cmap_map icmap_map = {
@@ -121,12 +131,41 @@ struct cmap_map stats_map = {
 	.map_track_add = stats_map_track_add,
 	.map_track_delete = stats_map_track_delete,
 	.map_track_get_user_data = stats_map_track_get_user_data,
+	.map_snapshot_begin = stats_map_snapshot_begin,
+	.map_snapshot_end = stats_map_snapshot_end,
+};
+
+/*
+ * Instance stored in iter_db. pending_key is key already returned by
+ * map_iter_next which didn't fit into previous batch response.
+ */
+struct cmap_iter_inst {
+	icmap_iter_t iter;
+	int pending;
+	char pending_key[ICMAP_KEYNAME_MAXLEN + 1];
 };
 
 struct cmap_conn_info {
 	struct hdb_handle_database iter_db;
 	struct hdb_handle_database track_db;
 	struct cmap_map map_fns;
+	void *conn;
+	/*
+	 * Notifications of CMAP_TRACK_COALESCE trackers waiting for the end
+	 * of main loop iteration
+	 */
+	char *notify_batch_buf;
+	size_t notify_batch_len;
+	uint32_t notify_batch_items;
+	struct qb_list_head notify_batch_list;
+	/*
+	 * Position after the last snapshot page which had more set. Next page
+	 * for the same prefix starting after snapshot_last_key continues here
+	 * instead of walking the prefix again. iter is NULL when not set.
+	 */
+	struct cmap_iter_inst snapshot_iter_inst;
+	char snapshot_prefix[ICMAP_KEYNAME_MAXLEN + 1];
+	char snapshot_last_key[ICMAP_KEYNAME_MAXLEN + 1];
 };
 
 typedef uint64_t cmap_iter_handle_t;
@@ -136,6 +175,7 @@ struct cmap_track_user_data {
 	void *conn;
 	cmap_track_handle_t track_handle;
 	uint64_t track_inst_handle;
+	int coalesce;
 };
 
 enum cmap_message_req_types {
@@ -149,6 +189,13 @@ enum cmap_mcast_reason {
 
 static struct corosync_api_v1 *api;
 
+/*
+ * Connections with pending notify batch, flushed by cmap_notify_batch_timer
+ */
+QB_LIST_DECLARE (cmap_notify_batch_pending_list_head);
+
+static corosync_timer_handle_t cmap_notify_batch_timer;
+
 static char *cmap_exec_init_fn (struct corosync_api_v1 *corosync_api);
 static int cmap_exec_exit_fn(void);
 
@@ -165,6 +212,8 @@ static void message_handler_req_lib_cmap_iter_finalize(void *conn, const void *m
 static void message_handler_req_lib_cmap_track_add(void *conn, const void *message);
 static void message_handler_req_lib_cmap_track_delete(void *conn, const void *message);
 static void message_handler_req_lib_cmap_set_current_map(void *conn, const void *message);
+static void message_handler_req_lib_cmap_snapshot(void *conn, const void *message);
+static void message_handler_req_lib_cmap_iter_next_batch(void *conn, const void *message);
 
 static void cmap_notify_fn(int32_t event,
 		const char *key_name,
@@ -250,6 +299,14 @@ static struct corosync_lib_handler cmap_lib_engine[] =
 		.lib_handler_fn				= message_handler_req_lib_cmap_set_current_map,
 		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
 	},
+	{ /* 10 */
+		.lib_handler_fn				= message_handler_req_lib_cmap_snapshot,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
+	},
+	{ /* 11 */
+		.lib_handler_fn				= message_handler_req_lib_cmap_iter_next_batch,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
+	},
 };
 
 static struct corosync_exec_handler cmap_exec_engine[] =
@@ -376,17 +433,29 @@ static int cmap_lib_init_fn (void *conn)
 
 	memset(conn_info, 0, sizeof(*conn_info));
 	conn_info->map_fns = icmap_map;
+	conn_info->conn = conn;
+	qb_list_init(&conn_info->notify_batch_list);
 	hdb_create(&conn_info->iter_db);
 	hdb_create(&conn_info->track_db);
 
 	return (0);
 }
 
+static void cmap_snapshot_position_drop(struct cmap_conn_info *conn_info)
+{
+
+	if (conn_info->snapshot_iter_inst.iter != NULL) {
+		conn_info->map_fns.map_iter_finalize(conn_info->snapshot_iter_inst.iter);
+		conn_info->snapshot_iter_inst.iter = NULL;
+	}
+	conn_info->snapshot_iter_inst.pending = 0;
+}
+
 static int cmap_lib_exit_fn (void *conn)
 {
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 	hdb_handle_t iter_handle = 0;
-	icmap_iter_t *iter;
+	struct cmap_iter_inst *iter_inst;
 	hdb_handle_t track_handle = 0;
 	icmap_track_t *track;
 
@@ -394,15 +463,17 @@ static int cmap_lib_exit_fn (void *conn)
 
 	hdb_iterator_reset(&conn_info->iter_db);
         while (hdb_iterator_next(&conn_info->iter_db,
-                (void*)&iter, &iter_handle) == 0) {
+                (void*)&iter_inst, &iter_handle) == 0) {
 
-		conn_info->map_fns.map_iter_finalize(*iter);
+		conn_info->map_fns.map_iter_finalize(iter_inst->iter);
 
 		(void)hdb_handle_put (&conn_info->iter_db, iter_handle);
         }
 
 	hdb_destroy(&conn_info->iter_db);
 
+	cmap_snapshot_position_drop(conn_info);
+
 	hdb_iterator_reset(&conn_info->track_db);
         while (hdb_iterator_next(&conn_info->track_db,
                 (void*)&track, &track_handle) == 0) {
@@ -415,6 +486,19 @@ static int cmap_lib_exit_fn (void *conn)
         }
 	hdb_destroy(&conn_info->track_db);
 
+	/*
+	 * Client is gone, pending notifications are dropped
+	 */
+	qb_list_del(&conn_info->notify_batch_list);
+	qb_list_init(&conn_info->notify_batch_list);
+	free(conn_info->notify_batch_buf);
+	conn_info->notify_batch_buf = NULL;
+
+	if (qb_list_empty(&cmap_notify_batch_pending_list_head) && cmap_notify_batch_timer != 0) {
+		api->timer_delete(cmap_notify_batch_timer);
+		cmap_notify_batch_timer = 0;
+	}
+
 	api->ipc_refcnt_dec(conn);
 
 	return (0);
@@ -611,13 +695,88 @@ static void message_handler_req_lib_cmap_adjust_int(void *conn, const void *mess
 	api->ipc_response_send(conn, &res_lib_cmap_adjust_int, sizeof(res_lib_cmap_adjust_int));
 }
 
+/*
+ * Return next key of iterator. Key which didn't fit into previous batch
+ * is returned first (if it still exists).
+ */
+static const char *cmap_iter_inst_next(
+	struct cmap_conn_info *conn_info,
+	struct cmap_iter_inst *iter_inst,
+	size_t *value_len,
+	icmap_value_types_t *type)
+{
+
+	if (iter_inst->pending) {
+		iter_inst->pending = 0;
+
+		if (conn_info->map_fns.map_get(iter_inst->pending_key, NULL, value_len, type) == CS_OK) {
+			return (iter_inst->pending_key);
+		}
+	}
+
+	return (conn_info->map_fns.map_iter_next(iter_inst->iter, value_len, type));
+}
+
+/*
+ * Store key with its value as res_lib_cmap_snapshot_item into buf. value_len and type
+ * are values returned by map_iter_next. Returns CS_ERR_TOO_BIG if item doesn't fit
+ * into buf_size bytes, other error if key can't be read (usually because it was
+ * deleted in the meantime) or CS_OK and size of stored item in item_size.
+ */
+static cs_error_t cmap_pack_item(
+	struct cmap_conn_info *conn_info,
+	const char *key_name,
+	size_t value_len,
+	icmap_value_types_t type,
+	char *buf,
+	size_t buf_size,
+	size_t *item_size)
+{
+	struct res_lib_cmap_snapshot_item *item;
+	size_t key_len;
+	cs_error_t ret;
+
+	/*
+	 * Length of string and binary values reported by iterator may be
+	 * unknown (stats map) so ask for it explicitly
+	 */
+	if (value_len == 0 || type == ICMAP_VALUETYPE_STRING || type == ICMAP_VALUETYPE_BINARY) {
+		ret = conn_info->map_fns.map_get(key_name, NULL, &value_len, &type);
+		if (ret != CS_OK) {
+			return (ret);
+		}
+	}
+
+	key_len = strlen(key_name);
+	*item_size = CMAP_SNAPSHOT_ITEM_SIZE(key_len, value_len);
+	if (*item_size > buf_size) {
+		return (CS_ERR_TOO_BIG);
+	}
+
+	item = (struct res_lib_cmap_snapshot_item *)buf;
+	memset(item, 0, *item_size);
+
+	ret = conn_info->map_fns.map_get(key_name, item->data + CMAP_SNAPSHOT_VALUE_OFFSET(key_len),
+	    &value_len, &type);
+	if (ret != CS_OK) {
+		return (ret);
+	}
+
+	item->key_len = key_len;
+	item->type = type;
+	item->value_len = value_len;
+	memcpy(item->data, key_name, key_len);
+
+	return (CS_OK);
+}
+
 static void message_handler_req_lib_cmap_iter_init(void *conn, const void *message)
 {
 	const struct req_lib_cmap_iter_init *req_lib_cmap_iter_init = message;
 	struct res_lib_cmap_iter_init res_lib_cmap_iter_init;
 	cs_error_t ret;
 	icmap_iter_t iter;
-	icmap_iter_t *hdb_iter;
+	struct cmap_iter_inst *iter_inst;
 	cmap_iter_handle_t handle = 0ULL;
 	const char *prefix;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
@@ -634,17 +793,18 @@ static void message_handler_req_lib_cmap_iter_init(void *conn, const void *messa
 		goto reply_send;
 	}
 
-	ret = hdb_error_to_cs(hdb_handle_create(&conn_info->iter_db, sizeof(iter), &handle));
+	ret = hdb_error_to_cs(hdb_handle_create(&conn_info->iter_db, sizeof(*iter_inst), &handle));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db, handle, (void *)&hdb_iter));
+	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db, handle, (void *)&iter_inst));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	*hdb_iter = iter;
+	memset(iter_inst, 0, sizeof(*iter_inst));
+	iter_inst->iter = iter;
 
 	(void)hdb_handle_put (&conn_info->iter_db, handle);
 
@@ -663,19 +823,19 @@ static void message_handler_req_lib_cmap_iter_next(void *conn, const void *messa
 	const struct req_lib_cmap_iter_next *req_lib_cmap_iter_next = message;
 	struct res_lib_cmap_iter_next res_lib_cmap_iter_next;
 	cs_error_t ret;
-	icmap_iter_t *iter;
+	struct cmap_iter_inst *iter_inst;
 	size_t value_len = 0;
 	icmap_value_types_t type = 0;
 	const char *res = NULL;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 
 	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
-				req_lib_cmap_iter_next->iter_handle, (void *)&iter));
+				req_lib_cmap_iter_next->iter_handle, (void *)&iter_inst));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	res = conn_info->map_fns.map_iter_next(*iter, &value_len, &type);
+	res = cmap_iter_inst_next(conn_info, iter_inst, &value_len, &type);
 	if (res == NULL) {
 		ret = CS_ERR_NO_SECTIONS;
 	}
@@ -706,16 +866,16 @@ static void message_handler_req_lib_cmap_iter_finalize(void *conn, const void *m
 	const struct req_lib_cmap_iter_finalize *req_lib_cmap_iter_finalize = message;
 	struct res_lib_cmap_iter_finalize res_lib_cmap_iter_finalize;
 	cs_error_t ret;
-	icmap_iter_t *iter;
+	struct cmap_iter_inst *iter_inst;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 
 	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
-				req_lib_cmap_iter_finalize->iter_handle, (void *)&iter));
+				req_lib_cmap_iter_finalize->iter_handle, (void *)&iter_inst));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	conn_info->map_fns.map_iter_finalize(*iter);
+	conn_info->map_fns.map_iter_finalize(iter_inst->iter);
 
 	(void)hdb_handle_destroy(&conn_info->iter_db, req_lib_cmap_iter_finalize->iter_handle);
 
@@ -730,6 +890,105 @@ reply_send:
 	api->ipc_response_send(conn, &res_lib_cmap_iter_finalize, sizeof(res_lib_cmap_iter_finalize));
 }
 
+/*
+ * Send notifications collected for conn_info as one dispatch event
+ */
+static void cmap_notify_batch_flush(struct cmap_conn_info *conn_info)
+{
+	struct res_lib_cmap_notify_batch_callback *res;
+
+	qb_list_del(&conn_info->notify_batch_list);
+	qb_list_init(&conn_info->notify_batch_list);
+
+	if (conn_info->notify_batch_items == 0) {
+		return ;
+	}
+
+	res = (struct res_lib_cmap_notify_batch_callback *)conn_info->notify_batch_buf;
+	res->header.id = MESSAGE_RES_CMAP_NOTIFY_BATCH_CALLBACK;
+	res->header.size = conn_info->notify_batch_len;
+	res->header.error = CS_OK;
+	res->items = conn_info->notify_batch_items;
+
+	api->ipc_dispatch_send(conn_info->conn, conn_info->notify_batch_buf, conn_info->notify_batch_len);
+
+	conn_info->notify_batch_len = sizeof(struct res_lib_cmap_notify_batch_callback);
+	conn_info->notify_batch_items = 0;
+}
+
+static void cmap_notify_batch_timer_fn(void *data)
+{
+	struct qb_list_head *iter, *tmp_iter;
+	struct cmap_conn_info *conn_info;
+
+	cmap_notify_batch_timer = 0;
+
+	qb_list_for_each_safe(iter, tmp_iter, &cmap_notify_batch_pending_list_head) {
+		conn_info = qb_list_entry(iter, struct cmap_conn_info, notify_batch_list);
+
+		cmap_notify_batch_flush(conn_info);
+	}
+}
+
+/*
+ * Queue MESSAGE_RES_CMAP_NOTIFY_CALLBACK for connection. Notifications are
+ * packed into one MESSAGE_RES_CMAP_NOTIFY_BATCH_CALLBACK sent by zero
+ * duration timer, so all changes made in current main loop iteration
+ * (like membership change rewriting runtime.members.*) wake up client once.
+ */
+static void cmap_notify_batch_add(struct cmap_conn_info *conn_info, const struct iovec *iov, unsigned int iov_len)
+{
+	size_t size = 0;
+	unsigned int i;
+	char *dst;
+
+	for (i = 0; i < iov_len; i++) {
+		size += iov[i].iov_len;
+	}
+
+	if (conn_info->notify_batch_buf == NULL) {
+		conn_info->notify_batch_buf = malloc(CMAP_NOTIFY_BATCH_SIZE);
+		conn_info->notify_batch_len = sizeof(struct res_lib_cmap_notify_batch_callback);
+		conn_info->notify_batch_items = 0;
+	}
+
+	if (conn_info->notify_batch_len + CMAP_NOTIFY_BATCH_ALIGN(size) > CMAP_NOTIFY_BATCH_SIZE) {
+		cmap_notify_batch_flush(conn_info);
+	}
+
+	if (conn_info->notify_batch_buf == NULL ||
+	    conn_info->notify_batch_len + CMAP_NOTIFY_BATCH_ALIGN(size) > CMAP_NOTIFY_BATCH_SIZE) {
+		/*
+		 * No memory for the batch or notification too big to ever fit
+		 * in one, send it on its own
+		 */
+		api->ipc_dispatch_iov_send(conn_info->conn, iov, iov_len);
+		return ;
+	}
+
+	dst = conn_info->notify_batch_buf + conn_info->notify_batch_len;
+	for (i = 0; i < iov_len; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	memset(dst, 0, CMAP_NOTIFY_BATCH_ALIGN(size) - size);
+	conn_info->notify_batch_len += CMAP_NOTIFY_BATCH_ALIGN(size);
+	conn_info->notify_batch_items++;
+
+	if (qb_list_empty(&conn_info->notify_batch_list)) {
+		qb_list_add_tail(&conn_info->notify_batch_list, &cmap_notify_batch_pending_list_head);
+	}
+
+	if (cmap_notify_batch_timer == 0 &&
+	    api->timer_add_duration(0, NULL, cmap_notify_batch_timer_fn, &cmap_notify_batch_timer) != 0) {
+		/*
+		 * Without timer nobody would send the batch
+		 */
+		cmap_notify_batch_timer = 0;
+		cmap_notify_batch_flush(conn_info);
+	}
+}
+
 static void cmap_notify_fn(int32_t event,
 		const char *key_name,
 		struct icmap_notify_value new_val,
@@ -738,6 +997,7 @@ static void cmap_notify_fn(int32_t event,
 {
 	struct cmap_track_user_data *cmap_track_user_data = (struct cmap_track_user_data *)user_data;
 	struct res_lib_cmap_notify_callback res_lib_cmap_notify_callback;
+	struct cmap_conn_info *conn_info;
 	struct iovec iov[3];
 
 	memset(&res_lib_cmap_notify_callback, 0, sizeof(res_lib_cmap_notify_callback));
@@ -765,7 +1025,17 @@ static void cmap_notify_fn(int32_t event,
 	iov[2].iov_base = (char *)old_val.data;
 	iov[2].iov_len = old_val.len;
 
-	api->ipc_dispatch_iov_send(cmap_track_user_data->conn, iov, 3);
+	conn_info = (struct cmap_conn_info *)api->ipc_private_data_get(cmap_track_user_data->conn);
+
+	if (cmap_track_user_data->coalesce) {
+		cmap_notify_batch_add(conn_info, iov, 3);
+	} else {
+		/*
+		 * Don't overtake notifications already waiting in batch
+		 */
+		cmap_notify_batch_flush(conn_info);
+		api->ipc_dispatch_iov_send(cmap_track_user_data->conn, iov, 3);
+	}
 }
 
 static void message_handler_req_lib_cmap_track_add(void *conn, const void *message)
@@ -795,8 +1065,11 @@ static void message_handler_req_lib_cmap_track_add(void *conn, const void *messa
 		key_name = NULL;
 	}
 
+	/*
+	 * CMAP_TRACK_COALESCE is handled here, map doesn't know it
+	 */
 	ret = conn_info->map_fns.map_track_add(key_name,
-					       req_lib_cmap_track_add->track_type,
+					       req_lib_cmap_track_add->track_type & ~CMAP_TRACK_COALESCE,
 					       cmap_notify_fn,
 					       cmap_track_user_data,
 					       &track);
@@ -824,6 +1097,7 @@ static void message_handler_req_lib_cmap_track_add(void *conn, const void *messa
 	cmap_track_user_data->conn = conn;
 	cmap_track_user_data->track_handle = handle;
 	cmap_track_user_data->track_inst_handle = req_lib_cmap_track_add->track_inst_handle;
+	cmap_track_user_data->coalesce = (req_lib_cmap_track_add->track_type & CMAP_TRACK_COALESCE) ? 1 : 0;
 
 	(void)hdb_handle_put (&conn_info->track_db, handle);
 
@@ -903,6 +1177,8 @@ static void message_handler_req_lib_cmap_set_current_map(void *conn, const void
 		goto reply_send;
 	}
 
+	cmap_snapshot_position_drop(conn_info);
+
 	switch (req_lib_cmap_set_current_map->map) {
 		case CMAP_SETMAP_DEFAULT:
 			conn_info->map_fns = icmap_map;
@@ -923,6 +1199,257 @@ reply_send:
 	api->ipc_response_send(conn, &res, sizeof(res));
 }
 
+static void message_handler_req_lib_cmap_snapshot(void *conn, const void *message)
+{
+	const struct req_lib_cmap_snapshot *req_lib_cmap_snapshot = message;
+	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
+	struct res_lib_cmap_snapshot *res_lib_cmap_snapshot = NULL;
+	struct res_lib_cmap_snapshot error_res_lib_cmap_snapshot;
+	char prefix[ICMAP_KEYNAME_MAXLEN + 1];
+	char start_after[ICMAP_KEYNAME_MAXLEN + 1];
+	struct cmap_iter_inst *iter_inst = &conn_info->snapshot_iter_inst;
+	int resumed;
+	const char *key_name;
+	size_t max_size;
+	size_t res_size;
+	size_t value_len;
+	size_t item_size;
+	const struct res_lib_cmap_snapshot_item *last_item = NULL;
+	icmap_value_types_t type;
+	cs_error_t ret;
+
+	max_size = req_lib_cmap_snapshot->max_size;
+	if (max_size > CMAP_SNAPSHOT_MAX_SIZE) {
+		max_size = CMAP_SNAPSHOT_MAX_SIZE;
+	}
+
+	if (max_size < sizeof(*res_lib_cmap_snapshot) ||
+	    req_lib_cmap_snapshot->prefix.length > ICMAP_KEYNAME_MAXLEN ||
+	    req_lib_cmap_snapshot->start_after.length > ICMAP_KEYNAME_MAXLEN) {
+		ret = CS_ERR_INVALID_PARAM;
+		goto error_exit;
+	}
+
+	memcpy(prefix, req_lib_cmap_snapshot->prefix.value, req_lib_cmap_snapshot->prefix.length);
+	prefix[req_lib_cmap_snapshot->prefix.length] = '\0';
+	memcpy(start_after, req_lib_cmap_snapshot->start_after.value,
+	    req_lib_cmap_snapshot->start_after.length);
+	start_after[req_lib_cmap_snapshot->start_after.length] = '\0';
+
+	res_lib_cmap_snapshot = malloc(max_size);
+	if (res_lib_cmap_snapshot == NULL) {
+		ret = CS_ERR_NO_MEMORY;
+		goto error_exit;
+	}
+	memset(res_lib_cmap_snapshot, 0, sizeof(*res_lib_cmap_snapshot));
+	res_size = sizeof(*res_lib_cmap_snapshot);
+
+	/*
+	 * Continue where the previous page stopped if this is its next page,
+	 * otherwise start a new walk of the prefix
+	 */
+	resumed = (iter_inst->iter != NULL && start_after[0] != '\0' &&
+	    strcmp(prefix, conn_info->snapshot_prefix) == 0 &&
+	    strcmp(start_after, conn_info->snapshot_last_key) == 0);
+
+	if (!resumed) {
+		cmap_snapshot_position_drop(conn_info);
+
+		iter_inst->iter = conn_info->map_fns.map_iter_init(prefix[0] != '\0' ? prefix : NULL);
+		if (iter_inst->iter == NULL) {
+			ret = CS_ERR_NO_SECTIONS;
+			goto error_exit;
+		}
+		strcpy(conn_info->snapshot_prefix, prefix);
+	}
+
+	if (conn_info->map_fns.map_snapshot_begin != NULL) {
+		conn_info->map_fns.map_snapshot_begin();
+	}
+
+	ret = CS_OK;
+	while ((key_name = cmap_iter_inst_next(conn_info, iter_inst, &value_len, &type)) != NULL) {
+		if (!resumed && start_after[0] != '\0' && strcmp(key_name, start_after) <= 0) {
+			continue;
+		}
+
+		ret = cmap_pack_item(conn_info, key_name, value_len, type,
+		    (char *)res_lib_cmap_snapshot + res_size, max_size - res_size, &item_size);
+		if (ret == CS_ERR_TOO_BIG) {
+			if (res_lib_cmap_snapshot->items == 0) {
+				break;
+			}
+
+			/*
+			 * Return key in next page
+			 */
+			if (key_name != iter_inst->pending_key) {
+				strcpy(iter_inst->pending_key, key_name);
+			}
+			iter_inst->pending = 1;
+
+			res_lib_cmap_snapshot->more = 1;
+			ret = CS_OK;
+			break;
+		}
+
+		if (ret != CS_OK) {
+			/*
+			 * Key was deleted (or value changed size) in the meantime
+			 */
+			ret = CS_OK;
+			continue;
+		}
+
+		res_lib_cmap_snapshot->items++;
+		res_size += item_size;
+
+		last_item = (const struct res_lib_cmap_snapshot_item *)
+		    ((char *)res_lib_cmap_snapshot + res_size - item_size);
+	}
+
+	if (conn_info->map_fns.map_snapshot_end != NULL) {
+		conn_info->map_fns.map_snapshot_end();
+	}
+
+	if (ret == CS_OK && res_lib_cmap_snapshot->more) {
+		memcpy(conn_info->snapshot_last_key, last_item->data, last_item->key_len);
+		conn_info->snapshot_last_key[last_item->key_len] = '\0';
+	} else {
+		cmap_snapshot_position_drop(conn_info);
+	}
+
+	if (ret != CS_OK) {
+		goto error_exit;
+	}
+
+	res_lib_cmap_snapshot->header.size = res_size;
+	res_lib_cmap_snapshot->header.id = MESSAGE_RES_CMAP_SNAPSHOT;
+	res_lib_cmap_snapshot->header.error = CS_OK;
+
+	api->ipc_response_send(conn, res_lib_cmap_snapshot, res_size);
+	free(res_lib_cmap_snapshot);
+
+	return ;
+
+error_exit:
+	free(res_lib_cmap_snapshot);
+
+	memset(&error_res_lib_cmap_snapshot, 0, sizeof(error_res_lib_cmap_snapshot));
+	error_res_lib_cmap_snapshot.header.size = sizeof(error_res_lib_cmap_snapshot);
+	error_res_lib_cmap_snapshot.header.id = MESSAGE_RES_CMAP_SNAPSHOT;
+	error_res_lib_cmap_snapshot.header.error = ret;
+
+	api->ipc_response_send(conn, &error_res_lib_cmap_snapshot, sizeof(error_res_lib_cmap_snapshot));
+}
+
+static void message_handler_req_lib_cmap_iter_next_batch(void *conn, const void *message)
+{
+	const struct req_lib_cmap_iter_next_batch *req_lib_cmap_iter_next_batch = message;
+	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
+	struct res_lib_cmap_iter_next_batch *res_lib_cmap_iter_next_batch = NULL;
+	struct res_lib_cmap_iter_next_batch error_res_lib_cmap_iter_next_batch;
+	struct cmap_iter_inst *iter_inst;
+	const char *key_name;
+	size_t max_size;
+	size_t res_size;
+	size_t value_len;
+	size_t item_size;
+	icmap_value_types_t type;
+	cs_error_t ret;
+
+	max_size = req_lib_cmap_iter_next_batch->max_size;
+	if (max_size > CMAP_SNAPSHOT_MAX_SIZE) {
+		max_size = CMAP_SNAPSHOT_MAX_SIZE;
+	}
+
+	if (max_size < sizeof(*res_lib_cmap_iter_next_batch)) {
+		ret = CS_ERR_INVALID_PARAM;
+		goto error_exit;
+	}
+
+	res_lib_cmap_iter_next_batch = malloc(max_size);
+	if (res_lib_cmap_iter_next_batch == NULL) {
+		ret = CS_ERR_NO_MEMORY;
+		goto error_exit;
+	}
+	memset(res_lib_cmap_iter_next_batch, 0, sizeof(*res_lib_cmap_iter_next_batch));
+	res_size = sizeof(*res_lib_cmap_iter_next_batch);
+
+	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
+				req_lib_cmap_iter_next_batch->iter_handle, (void *)&iter_inst));
+	if (ret != CS_OK) {
+		goto error_exit;
+	}
+
+	if (conn_info->map_fns.map_snapshot_begin != NULL) {
+		conn_info->map_fns.map_snapshot_begin();
+	}
+
+	while (1) {
+		key_name = cmap_iter_inst_next(conn_info, iter_inst, &value_len, &type);
+		if (key_name == NULL) {
+			res_lib_cmap_iter_next_batch->end = 1;
+			break;
+		}
+
+		ret = cmap_pack_item(conn_info, key_name, value_len, type,
+		    (char *)res_lib_cmap_iter_next_batch + res_size, max_size - res_size, &item_size);
+		if (ret == CS_ERR_TOO_BIG) {
+			/*
+			 * Return key in next batch
+			 */
+			if (key_name != iter_inst->pending_key) {
+				strcpy(iter_inst->pending_key, key_name);
+			}
+			iter_inst->pending = 1;
+
+			if (res_lib_cmap_iter_next_batch->items > 0) {
+				ret = CS_OK;
+			}
+			break;
+		}
+
+		if (ret != CS_OK) {
+			ret = CS_OK;
+			continue;
+		}
+
+		res_lib_cmap_iter_next_batch->items++;
+		res_size += item_size;
+	}
+
+	if (conn_info->map_fns.map_snapshot_end != NULL) {
+		conn_info->map_fns.map_snapshot_end();
+	}
+
+	(void)hdb_handle_put (&conn_info->iter_db, req_lib_cmap_iter_next_batch->iter_handle);
+
+	if (ret != CS_OK) {
+		goto error_exit;
+	}
+
+	res_lib_cmap_iter_next_batch->header.size = res_size;
+	res_lib_cmap_iter_next_batch->header.id = MESSAGE_RES_CMAP_ITER_NEXT_BATCH;
+	res_lib_cmap_iter_next_batch->header.error = CS_OK;
+
+	api->ipc_response_send(conn, res_lib_cmap_iter_next_batch, res_size);
+	free(res_lib_cmap_iter_next_batch);
+
+	return ;
+
+error_exit:
+	free(res_lib_cmap_iter_next_batch);
+
+	memset(&error_res_lib_cmap_iter_next_batch, 0, sizeof(error_res_lib_cmap_iter_next_batch));
+	error_res_lib_cmap_iter_next_batch.header.size = sizeof(error_res_lib_cmap_iter_next_batch);
+	error_res_lib_cmap_iter_next_batch.header.id = MESSAGE_RES_CMAP_ITER_NEXT_BATCH;
+	error_res_lib_cmap_iter_next_batch.header.error = ret;
+
+	api->ipc_response_send(conn, &error_res_lib_cmap_iter_next_batch,
+	    sizeof(error_res_lib_cmap_iter_next_batch));
+}
+
 static cs_error_t cmap_mcast_send(enum cmap_mcast_reason reason, int argc, char *argv[])
 {
 	int i;
@@ -800,7 +800,8 @@ static int main_config_parser_cb(const char *path,
 			    (strcmp(path, "totem.knet_pmtud_interval") == 0) ||
 			    (strcmp(path, "totem.knet_mtu") == 0) ||
 			    (strcmp(path, "totem.knet_compression_threshold") == 0) ||
-			    (strcmp(path, "totem.netmtu") == 0)) {
+			    (strcmp(path, "totem.netmtu") == 0) ||
+			    (strcmp(path, "totem.udp_recv_batch") == 0)) {
 				val_type = ICMAP_VALUETYPE_UINT32;
 				if (safe_atoq(value, &val, val_type) != 0) {
 					goto safe_atoq_error;
@@ -915,6 +916,30 @@ static int main_config_parser_cb(const char *path,
 					return (0);
 				}
 			}
+			if (strcmp(path, "system.ipc_outq_policy") == 0) {
+				if ((strcmp(value, "backpressure") != 0) &&
+				    (strcmp(value, "drop") != 0) &&
+				    (strcmp(value, "disconnect") != 0)) {
+					*error_string = "Invalid system.ipc_outq_policy";
+
+					return (0);
+				}
+			}
+			if (strcmp(path, "system.ipc_outq_size") == 0) {
+				val_type = ICMAP_VALUETYPE_UINT32;
+				if (safe_atoq(value, &val, val_type) != 0) {
+					goto safe_atoq_error;
+				}
+				if (val < CS_IPCS_OUTQ_SIZE_MIN) {
+					*error_string = "system.ipc_outq_size is smaller than the minimum of 1048576";
+
+					return (0);
+				}
+				if ((cs_err = icmap_set_uint32_r(config_map, path, val)) != CS_OK) {
+					goto icmap_set_error;
+				}
+				add_as_string = 0;
+			}
 			if (strcmp(path, "system.allow_knet_handle_fallback") == 0) {
 				if ((strcmp(value, "yes") != 0) &&
 				    (strcmp(value, "no") != 0)) {
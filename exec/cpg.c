@@ -75,6 +75,13 @@
 LOGSYS_DECLARE_SUBSYS ("CPG");
 
 #define GROUP_HASH_SIZE 32
+#define PROCESS_INFO_HASH_SIZE 1024
+
+/*
+ * Largest MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK sent to a connection,
+ * fits the dispatch buffer of libcpg built with small memory footprint
+ */
+#define DELIVER_BATCH_SIZE (64 * 1024)
 
 enum cpg_message_req_types {
 	MESSAGE_REQ_EXEC_CPG_PROCJOIN = 0,
@@ -152,8 +159,18 @@ struct cpg_pd {
 	uint64_t transition_counter; /* These two are used when sending fragmented messages */
 	uint64_t initial_transition_counter;
 	struct qb_list_head list;
+	struct qb_list_head group_list; /* on the cpg_group cpd list */
+	struct cpg_group *group;
 	struct qb_list_head iteration_instance_list_head;
 	struct qb_list_head zcb_mapped_list_head;
+	uint32_t pipeline_offset; /* Next byte expected from a pipelined fragmented message */
+	cs_error_t pipeline_error;
+	unsigned int pipeline_acks_deferred;
+	struct qb_list_head pipeline_list; /* on cpg_pipeline_deferred_list_head */
+	char *batch_buf; /* deliveries waiting for the token, CPG_MODEL_V1_DELIVER_BATCHED */
+	size_t batch_len;
+	unsigned int batch_items;
+	struct qb_list_head batch_list; /* on cpg_batch_pending_list_head */
 };
 
 struct cpg_iteration_instance {
@@ -181,13 +198,74 @@ static enum cpg_sync_state my_sync_state = CPGSYNC_DOWNLIST;
 
 static mar_cpg_ring_id_t last_sync_ring_id;
 
+static int my_sync_in_progress = 0;
+
+/*
+ * Connections whose pipelined fragment acks wait for the next token, so
+ * the library only retries once totem had a chance to drain its queue
+ */
+QB_LIST_DECLARE (cpg_pipeline_deferred_list_head);
+
+static void *cpg_pipeline_token_handle = NULL;
+
+/*
+ * Connections with batched deliveries waiting for the next token
+ */
+QB_LIST_DECLARE (cpg_batch_pending_list_head);
+
+static void *cpg_batch_token_handle = NULL;
+
+/*
+ * process_info entries are indexed three ways: by (group, nodeid, pid) in
+ * process_info_hash, per node (sorted by pid) on a nodeid sorted list of
+ * cpg_node_info and per group (sorted by nodeid and pid). Walking the nodes
+ * in order and the processes of each node gives the (nodeid, pid) order
+ * synchronization relies on.
+ */
 struct process_info {
 	unsigned int nodeid;
 	uint32_t pid;
 	mar_cpg_name_t group;
-	struct qb_list_head list; /* on the group_info members list */
+	struct qb_list_head list; /* on the cpg_node_info process list */
+	struct qb_list_head group_pi_list; /* on the cpg_group process list */
+	struct qb_list_head hash_list; /* on the process_info hash chain */
+	struct cpg_node_info *node;
+	unsigned int joinlist_seen;
+};
+
+struct cpg_node_info {
+	unsigned int nodeid;
+	unsigned int process_count;
+	struct qb_list_head pi_list_head; /* process_info entries sorted by pid */
+	struct qb_list_head list; /* on cpg_node_info_list_head */
 };
-QB_LIST_DECLARE (process_info_list_head);
+
+QB_LIST_DECLARE (cpg_node_info_list_head);
+
+static struct qb_list_head process_info_hash[PROCESS_INFO_HASH_SIZE];
+
+static unsigned int joinlist_seen_generation = 0;
+
+/*
+ * Index of groups known to this node, so message delivery only has to
+ * look at the local connections joined to the group and the nodes
+ * having processes in it.
+ */
+struct cpg_group_node {
+	unsigned int nodeid;
+	unsigned int process_count; /* process_info entries of nodeid in group */
+	struct qb_list_head list;
+};
+
+struct cpg_group {
+	mar_cpg_name_t group_name;
+	struct qb_list_head cpd_list_head; /* local cpg_pd with group_name set */
+	struct qb_list_head node_list_head; /* cpg_group_node entries */
+	struct qb_list_head pi_list_head; /* process_info sorted by nodeid and pid */
+	struct qb_list_head list; /* on the group hash chain */
+};
+
+static struct qb_list_head cpg_group_hash[GROUP_HASH_SIZE];
 
 struct join_list_entry {
 	uint32_t pid;
@@ -259,6 +337,8 @@ static void message_handler_req_lib_cpg_mcast (void *conn, const void *message);
 
 static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *message);
 
+static void message_handler_req_lib_cpg_partial_mcast_pipelined (void *conn, const void *message);
+
 static void message_handler_req_lib_cpg_membership (void *conn,
 						    const void *message);
 
@@ -332,6 +412,24 @@ static int notify_lib_totem_membership (
 	int member_list_entries,
 	const unsigned int *member_list);
 
+static void cpg_pd_dispatch_send (struct cpg_pd *cpd, const void *msg, size_t mlen);
+
+static void cpg_deliver_batch_add (struct cpg_pd *cpd, const struct iovec *iov, unsigned int iov_len);
+
+static void cpg_deliver_batch_flush (struct cpg_pd *cpd);
+
+static struct cpg_group *cpg_group_find (const mar_cpg_name_t *group_name);
+
+static void cpg_group_cpd_remove (struct cpg_pd *cpd);
+
+static struct process_info *process_info_first (void);
+
+static struct process_info *process_info_next (const struct process_info *pi);
+
+static struct process_info *process_info_find (const mar_cpg_name_t *group_name, uint32_t pid, unsigned int nodeid);
+
+static void process_info_del (struct process_info *pi);
+
 static inline int zcb_all_free (
 	struct cpg_pd *cpd);
 
@@ -395,6 +493,10 @@ static struct corosync_lib_handler cpg_lib_engine[] =
 		.lib_handler_fn				= message_handler_req_lib_cpg_partial_mcast,
 		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
 	},
+	{ /* 13 - flow control is done by the handler so fragments stay ordered */
+		.lib_handler_fn				= message_handler_req_lib_cpg_partial_mcast_pipelined,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
+	},
 
 };
 
@@ -549,6 +651,7 @@ static void cpg_sync_init (
 	int found;
 
 	my_sync_state = CPGSYNC_DOWNLIST;
+	my_sync_in_progress = 1;
 
 	memcpy (my_member_list, member_list, member_list_entries *
 		sizeof (unsigned int));
@@ -599,6 +702,7 @@ static void cpg_sync_activate (void)
 	memcpy (my_old_member_list, my_member_list,
 		my_member_list_entries * sizeof (unsigned int));
 	my_old_member_list_entries = my_member_list_entries;
+	my_sync_in_progress = 0;
 
 	downlist_inform_clients ();
 
@@ -611,6 +715,7 @@ static void cpg_sync_activate (void)
 
 static void cpg_sync_abort (void)
 {
+	my_sync_in_progress = 0;
 
 	joinlist_messages_delete ();
 }
@@ -643,10 +748,10 @@ static int notify_lib_totem_membership (
 	if (conn == NULL) {
 		qb_list_for_each(iter, &cpg_pd_list_head) {
 			struct cpg_pd *cpg_pd = qb_list_entry (iter, struct cpg_pd, list);
-			api->ipc_dispatch_send (cpg_pd->conn, buf, size);
+			cpg_pd_dispatch_send (cpg_pd, buf, size);
 		}
 	} else {
-		api->ipc_dispatch_send (conn, buf, size);
+		cpg_pd_dispatch_send ((struct cpg_pd *)api->ipc_private_data_get (conn), buf, size);
 	}
 
 	return CS_OK;
@@ -654,7 +759,7 @@ static int notify_lib_totem_membership (
 
 /*
  * Helper function for notify_lib_joinlist which prepares member_list using
- * process_info_list with removed left_list items.
+ * process_info entries of the group with removed left_list items.
  * member_list_entries - When not NULL it contains number of member_list entries
  * member_list - When not NULL it is used as pointer to start of preallocated
  *               array of members. Pointer is adjusted to the end of array on
@@ -668,36 +773,39 @@ static void notify_lib_joinlist_fill_member_list(
 	mar_cpg_address_t **member_list)
 {
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 	int i;
 
 	if (member_list_entries != NULL) {
 		*member_list_entries = 0;
 	}
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
+	group = cpg_group_find (group_name);
+	if (group == NULL) {
+		return ;
+	}
 
-		if (mar_name_compare (&pi->group, group_name) == 0) {
-			int in_left_list = 0;
+	qb_list_for_each(iter, &group->pi_list_head) {
+		struct process_info *pi = qb_list_entry (iter, struct process_info, group_pi_list);
+		int in_left_list = 0;
 
-			for (i = 0; i < left_list_entries; i++) {
-				if (left_list[i].nodeid == pi->nodeid && left_list[i].pid == pi->pid) {
-					in_left_list = 1;
-					break ;
-				}
+		for (i = 0; i < left_list_entries; i++) {
+			if (left_list[i].nodeid == pi->nodeid && left_list[i].pid == pi->pid) {
+				in_left_list = 1;
+				break ;
 			}
+		}
 
-			if (!in_left_list) {
-				if (member_list_entries != NULL) {
-					(*member_list_entries)++;
-				}
+		if (!in_left_list) {
+			if (member_list_entries != NULL) {
+				(*member_list_entries)++;
+			}
 
-				if (member_list != NULL) {
-					(*member_list)->nodeid = pi->nodeid;
-					(*member_list)->pid = pi->pid;
-					(*member_list)->reason = CPG_REASON_UNDEFINED;
-					(*member_list)++;
-				}
+			if (member_list != NULL) {
+				(*member_list)->nodeid = pi->nodeid;
+				(*member_list)->pid = pi->pid;
+				(*member_list)->reason = CPG_REASON_UNDEFINED;
+				(*member_list)++;
 			}
 		}
 	}
@@ -713,10 +821,11 @@ static int notify_lib_joinlist(
 {
 	int size;
 	char *buf;
-	struct qb_list_head *iter;
+	struct qb_list_head *iter, *tmp_iter;
 	int member_list_entries;
 	struct res_lib_cpg_confchg_callback *res;
 	mar_cpg_address_t *retgi;
+	struct cpg_group *group;
 	int i;
 
 	/*
@@ -762,32 +871,33 @@ static int notify_lib_joinlist(
 		memcpy (retgi, joined_list, joined_list_entries * sizeof(mar_cpg_address_t));
 		retgi += joined_list_entries;
 
+	}
+
+	group = cpg_group_find (group_name);
+	if (group != NULL) {
 		/*
 		 * Update cpd_state for all local joined processes in group
 		 */
 		for (i = 0; i < joined_list_entries; i++) {
 			if (joined_list[i].nodeid == api->totem_nodeid_get()) {
-				qb_list_for_each(iter, &cpg_pd_list_head) {
-					struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, list);
-					if (joined_list[i].pid == cpd->pid &&
-					    mar_name_compare (&cpd->group_name, group_name) == 0) {
+				qb_list_for_each(iter, &group->cpd_list_head) {
+					struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, group_list);
+					if (joined_list[i].pid == cpd->pid) {
 						cpd->cpd_state = CPD_STATE_JOIN_COMPLETED;
 					}
 				}
 			}
 		}
-	}
 
-	/*
-	 * Send notification to all ipc clients joined in group_name
-	 */
-	qb_list_for_each(iter, &cpg_pd_list_head) {
-		struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, list);
-		if (mar_name_compare (&cpd->group_name, group_name) == 0) {
+		/*
+		 * Send notification to all ipc clients joined in group_name
+		 */
+		qb_list_for_each(iter, &group->cpd_list_head) {
+			struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, group_list);
 			if (cpd->cpd_state == CPD_STATE_JOIN_COMPLETED ||
 				cpd->cpd_state == CPD_STATE_LEAVE_STARTED) {
 
-				api->ipc_dispatch_send (cpd->conn, buf, size);
+				cpg_pd_dispatch_send (cpd, buf, size);
 				cpd->transition_counter++;
 			}
 		}
@@ -803,10 +913,11 @@ static int notify_lib_joinlist(
 		for (i = 0; i < joined_list_entries; i++) {
 			if (left_list[i].nodeid == api->totem_nodeid_get() &&
 			    left_list[i].reason == CONFCHG_CPG_REASON_LEAVE) {
-				qb_list_for_each(iter, &cpg_pd_list_head) {
+				qb_list_for_each_safe(iter, tmp_iter, &cpg_pd_list_head) {
 					struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, list);
 					if (left_list[i].pid == cpd->pid &&
 					    mar_name_compare (&cpd->group_name, group_name) == 0) {
+						cpg_group_cpd_remove (cpd);
 						cpd->pid = 0;
 						memset (&cpd->group_name, 0, sizeof(cpd->group_name));
 						cpd->cpd_state = CPD_STATE_UNJOINED;
@@ -844,6 +955,8 @@ static void downlist_log(const char *msg, struct req_exec_cpg_downlist *dl)
 static void downlist_inform_clients (void)
 {
 	struct qb_list_head *iter, *tmp_iter;
+	struct qb_list_head *pi_iter, *pi_tmp_iter;
+	struct cpg_node_info *node;
 	struct process_info *left_pi;
 	qb_map_t *group_map;
 	struct cpg_name cpg_group;
@@ -866,19 +979,30 @@ static void downlist_inform_clients (void)
 	 * confchg event, so we will collect these cpg groups and
 	 * relative left_lists here.
 	 */
-	qb_list_for_each_safe(iter, tmp_iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry(iter, struct process_info, list);
+	qb_list_for_each_safe(iter, tmp_iter, &cpg_node_info_list_head) {
+		int left = 0;
 
-		left_pi = NULL;
-		for (i = 0; i < g_req_exec_cpg_downlist.left_nodes; i++) {
+		node = qb_list_entry(iter, struct cpg_node_info, list);
 
-			if (pi->nodeid == g_req_exec_cpg_downlist.nodeids[i]) {
-				left_pi = pi;
+		for (i = 0; i < g_req_exec_cpg_downlist.left_nodes; i++) {
+			if (node->nodeid == g_req_exec_cpg_downlist.nodeids[i]) {
+				left = 1;
 				break;
 			}
 		}
 
-		if (left_pi) {
+		if (!left) {
+			continue ;
+		}
+
+		/*
+		 * Deleting the last process frees node, so stop before touching it again
+		 */
+		qb_list_for_each_safe(pi_iter, pi_tmp_iter, &node->pi_list_head) {
+			int last = (pi_tmp_iter == &node->pi_list_head);
+
+			left_pi = qb_list_entry(pi_iter, struct process_info, list);
+
 			marshall_from_mar_cpg_name_t(&cpg_group, &left_pi->group);
 			cpg_group.value[cpg_group.length] = 0;
 
@@ -893,8 +1017,11 @@ static void downlist_inform_clients (void)
 			pcd->left_list[size].pid = left_pi->pid;
 			pcd->left_list[size].reason = CONFCHG_CPG_REASON_NODEDOWN;
 			pcd->left_list_entries++;
-			qb_list_del (&left_pi->list);
-			free (left_pi);
+			process_info_del (left_pi);
+
+			if (last) {
+				break;
+			}
 		}
 	}
 
@@ -929,42 +1056,39 @@ static void downlist_inform_clients (void)
  */
 static void joinlist_remove_zombie_pi_entries (void)
 {
-	struct qb_list_head *pi_iter, *tmp_iter;
 	struct qb_list_head *jl_iter;
-	struct process_info *pi;
+	struct process_info *pi, *pi_next;
 	struct joinlist_msg *stored_msg;
-	int found;
 
-	qb_list_for_each_safe(pi_iter, tmp_iter, &process_info_list_head) {
-		pi = qb_list_entry (pi_iter, struct process_info, list);
+	/*
+	 * Mark processes found in joinlist messages
+	 */
+	joinlist_seen_generation++;
+	qb_list_for_each(jl_iter, &joinlist_messages_head) {
+		stored_msg = qb_list_entry(jl_iter, struct joinlist_msg, list);
 
-		/*
-		 * Ignore local node
-		 */
-		if (pi->nodeid == api->totem_nodeid_get()) {
+		if (stored_msg->sender_nodeid == api->totem_nodeid_get()) {
 			continue ;
 		}
 
-		/*
-		 * Try to find message in joinlist messages
-		 */
-		found = 0;
-		qb_list_for_each(jl_iter, &joinlist_messages_head) {
-			stored_msg = qb_list_entry(jl_iter, struct joinlist_msg, list);
+		pi = process_info_find (&stored_msg->group_name, stored_msg->pid,
+		    stored_msg->sender_nodeid);
+		if (pi != NULL) {
+			pi->joinlist_seen = joinlist_seen_generation;
+		}
+	}
 
-			if (stored_msg->sender_nodeid == api->totem_nodeid_get()) {
-				continue ;
-			}
+	for (pi = process_info_first (); pi != NULL; pi = pi_next) {
+		pi_next = process_info_next (pi);
 
-			if (pi->nodeid == stored_msg->sender_nodeid &&
-			    pi->pid == stored_msg->pid &&
-			    mar_name_compare (&pi->group, &stored_msg->group_name) == 0) {
-				found = 1;
-				break ;
-			}
+		/*
+		 * Ignore local node
+		 */
+		if (pi->nodeid == api->totem_nodeid_get()) {
+			continue ;
 		}
 
-		if (!found) {
+		if (pi->joinlist_seen != joinlist_seen_generation) {
 			do_proc_leave(&pi->group, pi->pid, pi->nodeid, CONFCHG_CPG_REASON_PROCDOWN);
 		}
 	}
@@ -1028,6 +1152,16 @@ static void joinlist_messages_delete (void)
 
 static char *cpg_exec_init_fn (struct corosync_api_v1 *corosync_api)
 {
+	int i;
+
+	for (i = 0; i < GROUP_HASH_SIZE; i++) {
+		qb_list_init (&cpg_group_hash[i]);
+	}
+
+	for (i = 0; i < PROCESS_INFO_HASH_SIZE; i++) {
+		qb_list_init (&process_info_hash[i]);
+	}
+
 	qb_list_init (&joinlist_messages_head);
 	api = corosync_api;
 	return (NULL);
@@ -1060,6 +1194,11 @@ static void cpg_pd_finalize (struct cpg_pd *cpd)
 		cpg_iteration_instance_finalize (cpii);
 	}
 
+	cpg_group_cpd_remove (cpd);
+	qb_list_del (&cpd->pipeline_list);
+	qb_list_del (&cpd->batch_list);
+	free (cpd->batch_buf);
+	cpd->batch_buf = NULL;
 	qb_list_del (&cpd->list);
 }
 
@@ -1170,11 +1309,193 @@ static void exec_cpg_partial_mcast_endian_convert (void *msg)
 	swab_mar_message_source_t (&req_exec_cpg_mcast->source);
 }
 
-static struct process_info *process_info_find(const mar_cpg_name_t *group_name, uint32_t pid, unsigned int nodeid) {
+static uint32_t cpg_name_hash (const mar_cpg_name_t *group_name)
+{
+	uint32_t length = group_name->length;
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+
+	if (length > CPG_MAX_NAME_LENGTH) {
+		length = CPG_MAX_NAME_LENGTH;
+	}
+
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)group_name->value[i]) * 16777619U;
+	}
+
+	return (hash);
+}
+
+static unsigned int cpg_group_hash_index (const mar_cpg_name_t *group_name)
+{
+	return (cpg_name_hash (group_name) % GROUP_HASH_SIZE);
+}
+
+static struct cpg_group *cpg_group_find (const mar_cpg_name_t *group_name)
+{
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
+	qb_list_for_each(iter, &cpg_group_hash[cpg_group_hash_index (group_name)]) {
+		group = qb_list_entry (iter, struct cpg_group, list);
+
+		if (mar_name_compare (&group->group_name, group_name) == 0) {
+			return (group);
+		}
+	}
+
+	return (NULL);
+}
+
+static struct cpg_group *cpg_group_get (const mar_cpg_name_t *group_name)
+{
+	struct cpg_group *group;
+
+	group = cpg_group_find (group_name);
+	if (group != NULL) {
+		return (group);
+	}
+
+	group = malloc (sizeof (struct cpg_group));
+	if (group == NULL) {
+		log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate cpg_group struct");
+		return (NULL);
+	}
+	memcpy (&group->group_name, group_name, sizeof (mar_cpg_name_t));
+	qb_list_init (&group->cpd_list_head);
+	qb_list_init (&group->node_list_head);
+	qb_list_init (&group->pi_list_head);
+	qb_list_init (&group->list);
+	qb_list_add (&group->list, &cpg_group_hash[cpg_group_hash_index (group_name)]);
+
+	return (group);
+}
+
+static void cpg_group_put (struct cpg_group *group)
+{
+	if (qb_list_empty (&group->cpd_list_head) && qb_list_empty (&group->node_list_head) &&
+	    qb_list_empty (&group->pi_list_head)) {
+		qb_list_del (&group->list);
+		free (group);
+	}
+}
+
+/*
+ * Add cpd to the index of the group in cpd->group_name
+ */
+static int cpg_group_cpd_add (struct cpg_pd *cpd)
+{
+	struct cpg_group *group;
+
+	group = cpg_group_get (&cpd->group_name);
+	if (group == NULL) {
+		return (-1);
+	}
+
+	cpd->group = group;
+	qb_list_add_tail (&cpd->group_list, &group->cpd_list_head);
+
+	return (0);
+}
+
+static void cpg_group_cpd_remove (struct cpg_pd *cpd)
+{
+	if (cpd->group == NULL) {
+		return ;
+	}
+
+	qb_list_del (&cpd->group_list);
+	qb_list_init (&cpd->group_list);
+	cpg_group_put (cpd->group);
+	cpd->group = NULL;
+}
+
+static struct cpg_group_node *cpg_group_node_find (const struct cpg_group *group, unsigned int nodeid)
+{
+	struct qb_list_head *iter;
+	struct cpg_group_node *group_node;
+
+	qb_list_for_each(iter, &group->node_list_head) {
+		group_node = qb_list_entry (iter, struct cpg_group_node, list);
+
+		if (group_node->nodeid == nodeid) {
+			return (group_node);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Account process_info entry of nodeid in group (called when it is added)
+ */
+static int cpg_group_node_ref (const mar_cpg_name_t *group_name, unsigned int nodeid)
+{
+	struct cpg_group *group;
+	struct cpg_group_node *group_node;
+
+	group = cpg_group_get (group_name);
+	if (group == NULL) {
+		return (-1);
+	}
+
+	group_node = cpg_group_node_find (group, nodeid);
+	if (group_node == NULL) {
+		group_node = malloc (sizeof (struct cpg_group_node));
+		if (group_node == NULL) {
+			log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate cpg_group_node struct");
+			cpg_group_put (group);
+			return (-1);
+		}
+		group_node->nodeid = nodeid;
+		group_node->process_count = 0;
+		qb_list_init (&group_node->list);
+		qb_list_add (&group_node->list, &group->node_list_head);
+	}
+	group_node->process_count++;
+
+	return (0);
+}
+
+static void cpg_group_node_unref (const mar_cpg_name_t *group_name, unsigned int nodeid)
+{
+	struct cpg_group *group;
+	struct cpg_group_node *group_node;
+
+	group = cpg_group_find (group_name);
+	if (group == NULL) {
+		return ;
+	}
+
+	group_node = cpg_group_node_find (group, nodeid);
+	if (group_node == NULL) {
+		return ;
+	}
+
+	group_node->process_count--;
+	if (group_node->process_count == 0) {
+		qb_list_del (&group_node->list);
+		free (group_node);
+		cpg_group_put (group);
+	}
+}
+
+static unsigned int process_info_hash_index (const mar_cpg_name_t *group_name, uint32_t pid, unsigned int nodeid)
+{
+	uint32_t hash = cpg_name_hash (group_name);
+
+	hash = (hash ^ nodeid) * 16777619U;
+	hash = (hash ^ pid) * 16777619U;
+
+	return (hash % PROCESS_INFO_HASH_SIZE);
+}
+
+static struct process_info *process_info_find (const mar_cpg_name_t *group_name, uint32_t pid, unsigned int nodeid)
+{
+	struct qb_list_head *iter;
+
+	qb_list_for_each(iter, &process_info_hash[process_info_hash_index (group_name, pid, nodeid)]) {
+		struct process_info *pi = qb_list_entry (iter, struct process_info, hash_list);
 
 		if (pi->pid == pid && pi->nodeid == nodeid &&
 			mar_name_compare (&pi->group, group_name) == 0) {
@@ -1185,6 +1506,165 @@ static struct process_info *process_info_find(const mar_cpg_name_t *group_name,
 	return NULL;
 }
 
+static struct cpg_node_info *cpg_node_info_find (unsigned int nodeid)
+{
+	struct qb_list_head *iter;
+
+	qb_list_for_each(iter, &cpg_node_info_list_head) {
+		struct cpg_node_info *node = qb_list_entry (iter, struct cpg_node_info, list);
+
+		if (node->nodeid == nodeid) {
+			return (node);
+		}
+		if (node->nodeid > nodeid) {
+			break;
+		}
+	}
+
+	return (NULL);
+}
+
+static struct cpg_node_info *cpg_node_info_get (unsigned int nodeid)
+{
+	struct qb_list_head *iter;
+	struct qb_list_head *list_to_add;
+	struct cpg_node_info *node;
+
+	list_to_add = &cpg_node_info_list_head;
+	qb_list_for_each(iter, &cpg_node_info_list_head) {
+		node = qb_list_entry (iter, struct cpg_node_info, list);
+
+		if (node->nodeid == nodeid) {
+			return (node);
+		}
+		if (node->nodeid > nodeid) {
+			break;
+		}
+		list_to_add = iter;
+	}
+
+	node = malloc (sizeof (struct cpg_node_info));
+	if (node == NULL) {
+		log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate cpg_node_info struct");
+		return (NULL);
+	}
+	node->nodeid = nodeid;
+	node->process_count = 0;
+	qb_list_init (&node->pi_list_head);
+	qb_list_init (&node->list);
+	qb_list_add (&node->list, list_to_add);
+
+	return (node);
+}
+
+/*
+ * Iterate all process_info entries sorted by nodeid and pid. Nodes without
+ * processes are freed, so the first entry of the next node is always there.
+ */
+static struct process_info *process_info_first (void)
+{
+	struct cpg_node_info *node;
+
+	if (qb_list_empty (&cpg_node_info_list_head)) {
+		return (NULL);
+	}
+
+	node = qb_list_first_entry (&cpg_node_info_list_head, struct cpg_node_info, list);
+
+	return (qb_list_first_entry (&node->pi_list_head, struct process_info, list));
+}
+
+static struct process_info *process_info_next (const struct process_info *pi)
+{
+	struct cpg_node_info *node = pi->node;
+
+	if (pi->list.next != &node->pi_list_head) {
+		return (qb_list_entry (pi->list.next, struct process_info, list));
+	}
+
+	if (node->list.next == &cpg_node_info_list_head) {
+		return (NULL);
+	}
+
+	node = qb_list_entry (node->list.next, struct cpg_node_info, list);
+
+	return (qb_list_first_entry (&node->pi_list_head, struct process_info, list));
+}
+
+/*
+ * Link pi into all indexes. Group accounting (cpg_group_node_ref) must be
+ * already done, so the group exists.
+ */
+static int process_info_add (struct process_info *pi)
+{
+	struct cpg_node_info *node;
+	struct cpg_group *group;
+	struct qb_list_head *iter;
+	struct qb_list_head *list_to_add;
+
+	node = cpg_node_info_get (pi->nodeid);
+	if (node == NULL) {
+		return (-1);
+	}
+
+	group = cpg_group_find (&pi->group);
+	assert (group != NULL);
+
+	/*
+	 * Pids mostly grow, so look for the place from the end
+	 */
+	list_to_add = &node->pi_list_head;
+	for (iter = node->pi_list_head.prev; iter != &node->pi_list_head; iter = iter->prev) {
+		struct process_info *pi_entry = qb_list_entry (iter, struct process_info, list);
+
+		if (pi_entry->pid <= pi->pid) {
+			list_to_add = iter;
+			break;
+		}
+	}
+	qb_list_add (&pi->list, list_to_add);
+	pi->node = node;
+	node->process_count++;
+
+	list_to_add = &group->pi_list_head;
+	for (iter = group->pi_list_head.prev; iter != &group->pi_list_head; iter = iter->prev) {
+		struct process_info *pi_entry = qb_list_entry (iter, struct process_info, group_pi_list);
+
+		if (pi_entry->nodeid < pi->nodeid ||
+		    (pi_entry->nodeid == pi->nodeid && pi_entry->pid <= pi->pid)) {
+			list_to_add = iter;
+			break;
+		}
+	}
+	qb_list_add (&pi->group_pi_list, list_to_add);
+
+	qb_list_add (&pi->hash_list,
+	    &process_info_hash[process_info_hash_index (&pi->group, pi->pid, pi->nodeid)]);
+
+	return (0);
+}
+
+/*
+ * Unlink pi from all indexes, drop its group accounting and free it
+ */
+static void process_info_del (struct process_info *pi)
+{
+	struct cpg_node_info *node = pi->node;
+
+	qb_list_del (&pi->hash_list);
+	qb_list_del (&pi->group_pi_list);
+	qb_list_del (&pi->list);
+	cpg_group_node_unref (&pi->group, pi->nodeid);
+
+	node->process_count--;
+	if (node->process_count == 0) {
+		qb_list_del (&node->list);
+		free (node);
+	}
+
+	free (pi);
+}
+
 static void do_proc_join(
 	const mar_cpg_name_t *name,
 	uint32_t pid,
@@ -1193,10 +1673,7 @@ static void do_proc_join(
 	qb_map_t *group_notify_map)
 {
 	struct process_info *pi;
-	struct process_info *pi_entry;
 	mar_cpg_address_t notify_info;
-	struct qb_list_head *list;
-	struct qb_list_head *list_to_add = NULL;
 	int size;
 
 	if (process_info_find (name, pid, nodeid) != NULL) {
@@ -1210,22 +1687,24 @@ static void do_proc_join(
 	pi->nodeid = nodeid;
 	pi->pid = pid;
 	memcpy(&pi->group, name, sizeof(*name));
+	pi->joinlist_seen = 0;
 	qb_list_init(&pi->list);
+	qb_list_init(&pi->group_pi_list);
+	qb_list_init(&pi->hash_list);
+
+	if (cpg_group_node_ref (name, nodeid) != 0) {
+		free (pi);
+		return;
+	}
 
 	/*
-	 * Insert new process in sorted order so synchronization works properly
+	 * Indexes keep the process in sorted order so synchronization works properly
 	 */
-	list_to_add = &process_info_list_head;
-	qb_list_for_each(list, &process_info_list_head) {
-		pi_entry = qb_list_entry(list, struct process_info, list);
-		if (pi_entry->nodeid > pi->nodeid ||
-			(pi_entry->nodeid == pi->nodeid && pi_entry->pid > pi->pid)) {
-
-			break;
-		}
-		list_to_add = list;
+	if (process_info_add (pi) != 0) {
+		cpg_group_node_unref (name, nodeid);
+		free (pi);
+		return;
 	}
-	qb_list_add (&pi->list, list_to_add);
 
 	notify_info.pid = pi->pid;
 	notify_info.nodeid = nodeid;
@@ -1258,7 +1737,6 @@ static void do_proc_leave(
 	int reason)
 {
 	struct process_info *pi;
-	struct qb_list_head *iter, *tmp_iter;
 	mar_cpg_address_t notify_info;
 
 	notify_info.pid = pid;
@@ -1270,14 +1748,9 @@ static void do_proc_leave(
 		1, &notify_info,
 		MESSAGE_RES_CPG_CONFCHG_CALLBACK);
 
-	qb_list_for_each_safe(iter, tmp_iter, &process_info_list_head) {
-		pi = qb_list_entry(iter, struct process_info, list);
-
-		if (pi->pid == pid && pi->nodeid == nodeid &&
-			mar_name_compare (&pi->group, name)==0) {
-			qb_list_del (&pi->list);
-			free (pi);
-		}
+	pi = process_info_find (name, pid, nodeid);
+	if (pi != NULL) {
+		process_info_del (pi);
 	}
 }
 
@@ -1365,8 +1838,9 @@ static void message_handler_req_exec_cpg_mcast (
 	const struct req_exec_cpg_mcast *req_exec_cpg_mcast = message;
 	struct res_lib_cpg_deliver_callback res_lib_cpg_mcast;
 	int msglen = req_exec_cpg_mcast->msglen;
-	struct qb_list_head *iter, *pi_iter, *tmp_iter;
+	struct qb_list_head *iter, *tmp_iter;
 	struct cpg_pd *cpd;
+	struct cpg_group *group;
 	struct iovec iovec[2];
 	int known_node = 0;
 
@@ -1384,21 +1858,19 @@ static void message_handler_req_exec_cpg_mcast (
 	iovec[1].iov_base = (char*)message+sizeof(*req_exec_cpg_mcast);
 	iovec[1].iov_len = msglen;
 
-	qb_list_for_each_safe(iter, tmp_iter, &cpg_pd_list_head) {
-		cpd = qb_list_entry(iter, struct cpg_pd, list);
-		if ((cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED)
-			&& (mar_name_compare (&cpd->group_name, &req_exec_cpg_mcast->group_name) == 0)) {
+	group = cpg_group_find (&req_exec_cpg_mcast->group_name);
+	if (group == NULL) {
+		return ;
+	}
+
+	qb_list_for_each_safe(iter, tmp_iter, &group->cpd_list_head) {
+		cpd = qb_list_entry(iter, struct cpg_pd, group_list);
+		if (cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED) {
 
 			if (!known_node) {
 				/* Try to find, if we know the node */
-				qb_list_for_each(pi_iter, &process_info_list_head) {
-					struct process_info *pi = qb_list_entry (pi_iter, struct process_info, list);
-
-					if (pi->nodeid == nodeid &&
-						mar_name_compare (&pi->group, &req_exec_cpg_mcast->group_name) == 0) {
-						known_node = 1;
-						break;
-					}
+				if (cpg_group_node_find (group, nodeid) != NULL) {
+					known_node = 1;
 				}
 			}
 
@@ -1407,7 +1879,11 @@ static void message_handler_req_exec_cpg_mcast (
 				return ;
 			}
 
-			api->ipc_dispatch_iov_send (cpd->conn, iovec, 2);
+			if (cpd->flags & CPG_MODEL_V1_DELIVER_BATCHED) {
+				cpg_deliver_batch_add (cpd, iovec, 2);
+			} else {
+				api->ipc_dispatch_iov_send (cpd->conn, iovec, 2);
+			}
 		}
 	}
 }
@@ -1419,8 +1895,9 @@ static void message_handler_req_exec_cpg_partial_mcast (
 	const struct req_exec_cpg_partial_mcast *req_exec_cpg_mcast = message;
 	struct res_lib_cpg_partial_deliver_callback res_lib_cpg_mcast;
 	int msglen = req_exec_cpg_mcast->fraglen;
-	struct qb_list_head *iter, *pi_iter, *tmp_iter;
+	struct qb_list_head *iter, *tmp_iter;
 	struct cpg_pd *cpd;
+	struct cpg_group *group;
 	struct iovec iovec[2];
 	int known_node = 0;
 
@@ -1442,22 +1919,19 @@ static void message_handler_req_exec_cpg_partial_mcast (
 	iovec[1].iov_base = (char*)message+sizeof(*req_exec_cpg_mcast);
 	iovec[1].iov_len = msglen;
 
-	qb_list_for_each_safe(iter, tmp_iter, &cpg_pd_list_head) {
-		cpd = qb_list_entry(iter, struct cpg_pd, list);
+	group = cpg_group_find (&req_exec_cpg_mcast->group_name);
+	if (group == NULL) {
+		return ;
+	}
 
-		if ((cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED)
-		    && (mar_name_compare (&cpd->group_name, &req_exec_cpg_mcast->group_name) == 0)) {
+	qb_list_for_each_safe(iter, tmp_iter, &group->cpd_list_head) {
+		cpd = qb_list_entry(iter, struct cpg_pd, group_list);
+		if (cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED) {
 
 			if (!known_node) {
 				/* Try to find, if we know the node */
-				qb_list_for_each(pi_iter, &process_info_list_head) {
-					struct process_info *pi = qb_list_entry (pi_iter, struct process_info, list);
-
-					if (pi->nodeid == nodeid &&
-					    mar_name_compare (&pi->group, &req_exec_cpg_mcast->group_name) == 0) {
-						known_node = 1;
-						break;
-					}
+				if (cpg_group_node_find (group, nodeid) != NULL) {
+					known_node = 1;
 				}
 			}
 
@@ -1466,6 +1940,7 @@ static void message_handler_req_exec_cpg_partial_mcast (
 				return ;
 			}
 
+			cpg_deliver_batch_flush (cpd);
 			api->ipc_dispatch_iov_send (cpd->conn, iovec, 2);
 		}
 	}
@@ -1491,18 +1966,16 @@ static int cpg_exec_send_joinlist(void)
 {
 	int count = 0;
 	struct qb_list_head *iter;
+	struct cpg_node_info *node;
 	struct qb_ipc_response_header *res;
 	char *buf;
 	size_t buf_size;
 	struct join_list_entry *jle;
 	struct iovec req_exec_cpg_iovec;
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
-
- 		if (pi->nodeid == api->totem_nodeid_get ()) {
- 			count++;
-		}
+	node = cpg_node_info_find (api->totem_nodeid_get ());
+	if (node != NULL) {
+		count = node->process_count;
 	}
 
 	/* Nothing to send */
@@ -1520,14 +1993,12 @@ static int cpg_exec_send_joinlist(void)
 	jle = (struct join_list_entry *)(buf + sizeof(struct qb_ipc_response_header));
 	res = (struct qb_ipc_response_header *)buf;
 
-	qb_list_for_each(iter, &process_info_list_head) {
+	qb_list_for_each(iter, &node->pi_list_head) {
 		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
 
-		if (pi->nodeid == api->totem_nodeid_get ()) {
-			memcpy (&jle->group_name, &pi->group, sizeof (mar_cpg_name_t));
-			jle->pid = pi->pid;
-			jle++;
-		}
+		memcpy (&jle->group_name, &pi->group, sizeof (mar_cpg_name_t));
+		jle->pid = pi->pid;
+		jle++;
 	}
 
 	res->id = SERVICE_ID_MAKE(CPG_SERVICE, MESSAGE_REQ_EXEC_CPG_JOINLIST);
@@ -1545,6 +2016,9 @@ static int cpg_lib_init_fn (void *conn)
 	memset (cpd, 0, sizeof(struct cpg_pd));
 	cpd->conn = conn;
 	qb_list_add (&cpd->list, &cpg_pd_list_head);
+	qb_list_init (&cpd->group_list);
+	qb_list_init (&cpd->pipeline_list);
+	qb_list_init (&cpd->batch_list);
 
 	qb_list_init (&cpd->iteration_instance_list_head);
 	qb_list_init (&cpd->zcb_mapped_list_head);
@@ -1580,15 +2054,11 @@ static void message_handler_req_lib_cpg_join (void *conn, const void *message)
 	 * Same check must be done in process info list, because there may be not yet delivered
 	 * leave of client.
 	 */
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
-
-		if (pi->nodeid == api->totem_nodeid_get () && pi->pid == req_lib_cpg_join->pid &&
-		    mar_name_compare(&req_lib_cpg_join->group_name, &pi->group) == 0) {
-			/* We have same pid and group name joined -> return error */
-			error = CS_ERR_TRY_AGAIN;
-			goto response_send;
-		}
+	if (process_info_find (&req_lib_cpg_join->group_name, req_lib_cpg_join->pid,
+	    api->totem_nodeid_get ()) != NULL) {
+		/* We have same pid and group name joined -> return error */
+		error = CS_ERR_TRY_AGAIN;
+		goto response_send;
 	}
 
 	if (req_lib_cpg_join->group_name.length > CPG_MAX_NAME_LENGTH) {
@@ -1598,12 +2068,17 @@ static void message_handler_req_lib_cpg_join (void *conn, const void *message)
 
 	switch (cpd->cpd_state) {
 	case CPD_STATE_UNJOINED:
+		memcpy (&cpd->group_name, &req_lib_cpg_join->group_name,
+			sizeof (cpd->group_name));
+		if (cpg_group_cpd_add (cpd) != 0) {
+			memset (&cpd->group_name, 0, sizeof(cpd->group_name));
+			error = CS_ERR_NO_MEMORY;
+			break;
+		}
 		error = CS_OK;
 		cpd->cpd_state = CPD_STATE_JOIN_STARTED;
 		cpd->pid = req_lib_cpg_join->pid;
 		cpd->flags = req_lib_cpg_join->flags;
-		memcpy (&cpd->group_name, &req_lib_cpg_join->group_name,
-			sizeof (cpd->group_name));
 
 		cpg_node_joinleave_send (req_lib_cpg_join->pid,
 			&req_lib_cpg_join->group_name,
@@ -1681,6 +2156,7 @@ static void message_handler_req_lib_cpg_finalize (
 	 */
 	qb_list_del (&cpd->list);
 	qb_list_init (&cpd->list);
+	cpg_group_cpd_remove (cpd);
 
 	res_lib_cpg_finalize.header.size = sizeof (res_lib_cpg_finalize);
 	res_lib_cpg_finalize.header.id = MESSAGE_RES_CPG_FINALIZE;
@@ -1951,6 +2427,250 @@ static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *m
 				sizeof (res_lib_cpg_partial_send));
 }
 
+static void cpg_pipeline_ack_send (struct cpg_pd *cpd)
+{
+	struct res_lib_cpg_partial_send_ack res_lib_cpg_partial_send_ack;
+
+	res_lib_cpg_partial_send_ack.header.size = sizeof(res_lib_cpg_partial_send_ack);
+	res_lib_cpg_partial_send_ack.header.id = MESSAGE_RES_CPG_PARTIAL_SEND_ACK;
+	res_lib_cpg_partial_send_ack.header.error = cpd->pipeline_error;
+	res_lib_cpg_partial_send_ack.acked = cpd->pipeline_offset;
+
+	api->ipc_response_send (cpd->conn, &res_lib_cpg_partial_send_ack,
+				sizeof (res_lib_cpg_partial_send_ack));
+}
+
+/*
+ * Send the deliveries collected for cpd as one dispatch event
+ */
+static void cpg_deliver_batch_flush (struct cpg_pd *cpd)
+{
+	struct res_lib_cpg_deliver_batch_callback *res;
+
+	qb_list_del (&cpd->batch_list);
+	qb_list_init (&cpd->batch_list);
+
+	if (cpd->batch_items == 0) {
+		return;
+	}
+
+	res = (struct res_lib_cpg_deliver_batch_callback *)cpd->batch_buf;
+	res->header.id = MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK;
+	res->header.size = cpd->batch_len;
+	res->header.error = CS_OK;
+	res->items = cpd->batch_items;
+
+	api->ipc_dispatch_send (cpd->conn, cpd->batch_buf, cpd->batch_len);
+
+	cpd->batch_len = sizeof (struct res_lib_cpg_deliver_batch_callback);
+	cpd->batch_items = 0;
+}
+
+static int cpg_deliver_batch_token_fn (enum totem_callback_token_type type, const void *data)
+{
+	struct qb_list_head *iter, *tmp_iter;
+	struct cpg_pd *cpd;
+
+	/*
+	 * Callback was created with delete set, so totem frees the handle
+	 */
+	cpg_batch_token_handle = NULL;
+
+	qb_list_for_each_safe(iter, tmp_iter, &cpg_batch_pending_list_head) {
+		cpd = qb_list_entry (iter, struct cpg_pd, batch_list);
+
+		cpg_deliver_batch_flush (cpd);
+	}
+
+	return (0);
+}
+
+/*
+ * Queue a MESSAGE_RES_CPG_DELIVER_CALLBACK for cpd. Deliveries are packed
+ * into one MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK sent once the token
+ * leaves this node, so the client wakes up once per token rotation
+ * instead of once per message.
+ */
+static void cpg_deliver_batch_add (struct cpg_pd *cpd, const struct iovec *iov, unsigned int iov_len)
+{
+	size_t size = 0;
+	unsigned int i;
+	char *dst;
+
+	for (i = 0; i < iov_len; i++) {
+		size += iov[i].iov_len;
+	}
+
+	if (cpd->batch_buf == NULL) {
+		cpd->batch_buf = malloc (DELIVER_BATCH_SIZE);
+		cpd->batch_len = sizeof (struct res_lib_cpg_deliver_batch_callback);
+		cpd->batch_items = 0;
+	}
+
+	if (cpd->batch_len + CPG_DELIVER_BATCH_ALIGN (size) > DELIVER_BATCH_SIZE) {
+		cpg_deliver_batch_flush (cpd);
+	}
+
+	if (cpd->batch_buf == NULL ||
+	    cpd->batch_len + CPG_DELIVER_BATCH_ALIGN (size) > DELIVER_BATCH_SIZE) {
+		/*
+		 * No memory for the batch or message too big to ever fit in
+		 * one, send it on its own
+		 */
+		api->ipc_dispatch_iov_send (cpd->conn, iov, iov_len);
+		return;
+	}
+
+	dst = cpd->batch_buf + cpd->batch_len;
+	for (i = 0; i < iov_len; i++) {
+		memcpy (dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	memset (dst, 0, CPG_DELIVER_BATCH_ALIGN (size) - size);
+	cpd->batch_len += CPG_DELIVER_BATCH_ALIGN (size);
+	cpd->batch_items++;
+
+	if (qb_list_empty (&cpd->batch_list)) {
+		qb_list_add_tail (&cpd->batch_list, &cpg_batch_pending_list_head);
+	}
+	if (cpg_batch_token_handle == NULL) {
+		api->totem_callback_token_create (&cpg_batch_token_handle,
+			TOTEM_CALLBACK_TOKEN_SENT, 1, cpg_deliver_batch_token_fn, NULL);
+	}
+}
+
+/*
+ * Dispatch events other than deliveries must not overtake batched ones
+ */
+static void cpg_pd_dispatch_send (struct cpg_pd *cpd, const void *msg, size_t mlen)
+{
+	cpg_deliver_batch_flush (cpd);
+	api->ipc_dispatch_send (cpd->conn, msg, mlen);
+}
+
+static int cpg_pipeline_token_fn (enum totem_callback_token_type type, const void *data)
+{
+	struct qb_list_head *iter, *tmp_iter;
+	struct cpg_pd *cpd;
+
+	/*
+	 * Callback was created with delete set, so totem frees the handle
+	 */
+	cpg_pipeline_token_handle = NULL;
+
+	qb_list_for_each_safe(iter, tmp_iter, &cpg_pipeline_deferred_list_head) {
+		cpd = qb_list_entry (iter, struct cpg_pd, pipeline_list);
+
+		qb_list_del (&cpd->pipeline_list);
+		qb_list_init (&cpd->pipeline_list);
+
+		for (; cpd->pipeline_acks_deferred > 0; cpd->pipeline_acks_deferred--) {
+			cpg_pipeline_ack_send (cpd);
+		}
+	}
+
+	return (0);
+}
+
+static void cpg_pipeline_ack (struct cpg_pd *cpd)
+{
+	/*
+	 * A CS_ERR_TRY_AGAIN ack makes the library resend at once, so hold it
+	 * back until a token was sent and the totem queue had a chance to
+	 * drain. Acks queued behind it are held too to keep them in order.
+	 */
+	if (cpd->pipeline_error == CS_ERR_TRY_AGAIN || cpd->pipeline_acks_deferred > 0) {
+		cpd->pipeline_acks_deferred++;
+		if (qb_list_empty (&cpd->pipeline_list)) {
+			qb_list_add_tail (&cpd->pipeline_list, &cpg_pipeline_deferred_list_head);
+		}
+		if (cpg_pipeline_token_handle == NULL) {
+			api->totem_callback_token_create (&cpg_pipeline_token_handle,
+				TOTEM_CALLBACK_TOKEN_SENT, 1, cpg_pipeline_token_fn, NULL);
+		}
+		return;
+	}
+
+	cpg_pipeline_ack_send (cpd);
+}
+
+/*
+ * Fragments of a pipelined message arrive without the library waiting
+ * for a response to each of them. Every fragment carries its byte offset
+ * and only the one at pipeline_offset is sent, anything else was queued
+ * behind a dropped fragment and is discarded. Responses are sent only
+ * for fragments with ack_request set, so the library knows exactly how
+ * many to read.
+ */
+static void message_handler_req_lib_cpg_partial_mcast_pipelined (void *conn, const void *message)
+{
+	const struct req_lib_cpg_partial_mcast_pipelined *req_lib_cpg_mcast = message;
+	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
+	mar_cpg_name_t group_name = cpd->group_name;
+
+	struct iovec req_exec_cpg_iovec[2];
+	struct req_exec_cpg_partial_mcast req_exec_cpg_mcast;
+	int msglen = req_lib_cpg_mcast->fraglen;
+
+	log_printf(LOGSYS_LEVEL_TRACE, "got pipelined fragment on %p offset %u len %d",
+		conn, req_lib_cpg_mcast->offset, msglen);
+
+	if (req_lib_cpg_mcast->type == LIBCPG_PARTIAL_FIRST && req_lib_cpg_mcast->offset == 0) {
+		cpd->initial_transition_counter = cpd->transition_counter;
+		cpd->pipeline_offset = 0;
+		cpd->pipeline_error = CS_OK;
+	}
+
+	/*
+	 * Only CS_ERR_TRY_AGAIN is recoverable within a message, any other
+	 * error sticks until the library starts the next one
+	 */
+	if (cpd->pipeline_error != CS_OK && cpd->pipeline_error != CS_ERR_TRY_AGAIN) {
+		goto ack;
+	}
+
+	if (cpd->cpd_state == CPD_STATE_UNJOINED || cpd->cpd_state == CPD_STATE_LEAVE_STARTED) {
+		cpd->pipeline_error = CS_ERR_NOT_EXIST;
+	} else if (cpd->transition_counter != cpd->initial_transition_counter) {
+		cpd->pipeline_error = CS_ERR_INTERRUPT;
+	} else if (req_lib_cpg_mcast->offset != cpd->pipeline_offset || my_sync_in_progress) {
+		cpd->pipeline_error = CS_ERR_TRY_AGAIN;
+	} else {
+		req_exec_cpg_mcast.header.size = sizeof(req_exec_cpg_mcast) + msglen;
+		req_exec_cpg_mcast.header.id = SERVICE_ID_MAKE(CPG_SERVICE,
+							       MESSAGE_REQ_EXEC_CPG_PARTIAL_MCAST);
+		req_exec_cpg_mcast.pid = cpd->pid;
+		req_exec_cpg_mcast.msglen = req_lib_cpg_mcast->msglen;
+		req_exec_cpg_mcast.type = req_lib_cpg_mcast->type;
+		req_exec_cpg_mcast.fraglen = req_lib_cpg_mcast->fraglen;
+		api->ipc_source_set (&req_exec_cpg_mcast.source, conn);
+		memcpy(&req_exec_cpg_mcast.group_name, &group_name,
+		       sizeof(mar_cpg_name_t));
+
+		req_exec_cpg_iovec[0].iov_base = (char *)&req_exec_cpg_mcast;
+		req_exec_cpg_iovec[0].iov_len = sizeof(req_exec_cpg_mcast);
+		req_exec_cpg_iovec[1].iov_base = (char *)&req_lib_cpg_mcast->message;
+		req_exec_cpg_iovec[1].iov_len = msglen;
+
+		if (api->totem_mcast (req_exec_cpg_iovec, 2, TOTEM_AGREED) == 0) {
+			cpd->pipeline_offset += msglen;
+			cpd->pipeline_error = CS_OK;
+		} else {
+			cpd->pipeline_error = CS_ERR_TRY_AGAIN;
+		}
+	}
+
+	if (cpd->pipeline_error != CS_OK && cpd->pipeline_error != CS_ERR_TRY_AGAIN) {
+		log_printf(LOGSYS_LEVEL_ERROR, "*** %p can't mcast to group %s state:%d, error:%d",
+			   conn, group_name.value, cpd->cpd_state, cpd->pipeline_error);
+	}
+
+ack:
+	if (req_lib_cpg_mcast->ack_request) {
+		cpg_pipeline_ack (cpd);
+	}
+}
+
 /* Mcast message from the library */
 static void message_handler_req_lib_cpg_mcast (void *conn, const void *message)
 {
@@ -2079,6 +2799,7 @@ static void message_handler_req_lib_cpg_membership (void *conn,
 		(struct req_lib_cpg_membership_get *)message;
 	struct res_lib_cpg_membership_get res_lib_cpg_membership_get;
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 	int member_count = 0;
 
 	res_lib_cpg_membership_get.header.id = MESSAGE_RES_CPG_MEMBERSHIP;
@@ -2086,9 +2807,14 @@ static void message_handler_req_lib_cpg_membership (void *conn,
 	res_lib_cpg_membership_get.header.size =
 		sizeof (struct res_lib_cpg_membership_get);
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
-		if (mar_name_compare (&pi->group, &req_lib_cpg_membership_get->group_name) == 0) {
+	group = cpg_group_find (&req_lib_cpg_membership_get->group_name);
+	if (group != NULL) {
+		qb_list_for_each(iter, &group->pi_list_head) {
+			struct process_info *pi = qb_list_entry (iter, struct process_info, group_pi_list);
+
+			if (member_count >= PROCESSOR_COUNT_MAX) {
+				break;
+			}
 			res_lib_cpg_membership_get.member_list[member_count].nodeid = pi->nodeid;
 			res_lib_cpg_membership_get.member_list[member_count].pid = pi->pid;
 			member_count += 1;
@@ -2122,8 +2848,10 @@ static void message_handler_req_lib_cpg_iteration_initialize (
 	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
 	hdb_handle_t cpg_iteration_handle = 0;
 	struct res_lib_cpg_iterationinitialize res_lib_cpg_iterationinitialize;
-	struct qb_list_head *iter, *iter2;
+	struct qb_list_head *iter2;
 	struct cpg_iteration_instance *cpg_iteration_instance;
+	struct cpg_group *group = NULL;
+	struct process_info *pi, *pi_next;
 	cs_error_t error = CS_OK;
 	int res;
 
@@ -2155,12 +2883,31 @@ static void message_handler_req_lib_cpg_iteration_initialize (
 	cpg_iteration_instance->handle = cpg_iteration_handle;
 
 	/*
-	 * Create copy of process_info list "grouped by" group name
+	 * Create copy of process_info list "grouped by" group name. Single group
+	 * is taken from the group index.
 	 */
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
+	if (req_lib_cpg_iterationinitialize->iteration_type == CPG_ITERATION_ONE_GROUP) {
+		pi = NULL;
+		group = cpg_group_find (&req_lib_cpg_iterationinitialize->group_name);
+		if (group != NULL && !qb_list_empty (&group->pi_list_head)) {
+			pi = qb_list_first_entry (&group->pi_list_head, struct process_info, group_pi_list);
+		}
+	} else {
+		pi = process_info_first ();
+	}
+
+	for (; pi != NULL; pi = pi_next) {
 		struct process_info *new_pi;
 
+		if (group != NULL) {
+			pi_next = NULL;
+			if (pi->group_pi_list.next != &group->pi_list_head) {
+				pi_next = qb_list_entry (pi->group_pi_list.next, struct process_info, group_pi_list);
+			}
+		} else {
+			pi_next = process_info_next (pi);
+		}
+
 		if (req_lib_cpg_iterationinitialize->iteration_type == CPG_ITERATION_NAME_ONLY) {
 			/*
 			 * Try to find processed group name in our list new list
@@ -2182,15 +2929,6 @@ static void message_handler_req_lib_cpg_iteration_initialize (
 				 */
 				continue ;
 			}
-		} else if (req_lib_cpg_iterationinitialize->iteration_type == CPG_ITERATION_ONE_GROUP) {
-			/*
-			 * Test pi group name with request
-			 */
-			if (mar_name_compare (&pi->group, &req_lib_cpg_iterationinitialize->group_name) != 0)
-				/*
-				 * Not same -> don't add
-				 */
-				continue ;
 		}
 
 		new_pi = malloc (sizeof (struct process_info));
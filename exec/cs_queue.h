@@ -41,6 +41,16 @@
 #include <errno.h>
 #include "assert.h"
 
+/*
+ * Queue created by cs_queue_init_mpsc is lock-free queue for multiple producers
+ * (cs_queue_is_full, cs_queue_item_add and cs_queue_avail can be called from any
+ * thread) and single consumer (all other functions must be called from one thread).
+ *
+ * Ring has power of two slots (so free running positions can wrap) and every
+ * slot has sequence number. Slot is free for position pos when its sequence
+ * number is pos and item at pos is ready for consumer when it is pos + 1.
+ * Producers reserve space by incrementing used, so add never waits for free slot.
+ */
 struct cs_queue {
 	int head;
 	int tail;
@@ -52,8 +62,76 @@ struct cs_queue {
 	int iterator;
 	pthread_mutex_t mutex;
 	int threaded_mode_enabled;
+	int mpsc;
+	unsigned int mpsc_mask;
+	unsigned int mpsc_head;
+	unsigned int mpsc_tail;
+	unsigned int mpsc_iterator;
+	unsigned int *mpsc_seq;
 };
 
+static inline void cs_queue_mpsc_reset (struct cs_queue *cs_queue)
+{
+	unsigned int i;
+
+	cs_queue->mpsc_head = 0;
+	cs_queue->mpsc_tail = 0;
+	cs_queue->mpsc_iterator = 0;
+	cs_queue->used = 0;
+	cs_queue->usedhw = 0;
+
+	for (i = 0; i <= cs_queue->mpsc_mask; i++) {
+		cs_queue->mpsc_seq[i] = i;
+	}
+	memset (cs_queue->items, 0, (cs_queue->mpsc_mask + 1) * cs_queue->size_per_item);
+}
+
+static inline void *cs_queue_mpsc_slot (struct cs_queue *cs_queue, unsigned int pos)
+{
+	char *cs_queue_item;
+
+	cs_queue_item = cs_queue->items;
+	cs_queue_item += (pos & cs_queue->mpsc_mask) * cs_queue->size_per_item;
+
+	return ((void *)cs_queue_item);
+}
+
+static inline int cs_queue_mpsc_ready (struct cs_queue *cs_queue, unsigned int pos)
+{
+
+	return (__atomic_load_n (&cs_queue->mpsc_seq[pos & cs_queue->mpsc_mask], __ATOMIC_ACQUIRE) ==
+	    pos + 1);
+}
+
+static inline int cs_queue_init_mpsc (struct cs_queue *cs_queue, size_t cs_queue_items, size_t size_per_item)
+{
+	unsigned int slots;
+
+	memset (cs_queue, 0, sizeof (*cs_queue));
+	cs_queue->size = cs_queue_items;
+	cs_queue->size_per_item = size_per_item;
+	cs_queue->mpsc = 1;
+
+	for (slots = 1; slots < cs_queue_items; slots <<= 1)
+		;
+	cs_queue->mpsc_mask = slots - 1;
+
+	cs_queue->items = malloc (slots * size_per_item);
+	if (cs_queue->items == 0) {
+		return (-ENOMEM);
+	}
+
+	cs_queue->mpsc_seq = malloc (slots * sizeof (*cs_queue->mpsc_seq));
+	if (cs_queue->mpsc_seq == 0) {
+		free (cs_queue->items);
+		return (-ENOMEM);
+	}
+
+	cs_queue_mpsc_reset (cs_queue);
+
+	return (0);
+}
+
 static inline int cs_queue_init (struct cs_queue *cs_queue, size_t cs_queue_items, size_t size_per_item, int threaded_mode_enabled) {
 	cs_queue->head = 0;
 	cs_queue->tail = cs_queue_items - 1;
@@ -62,6 +140,8 @@ static inline int cs_queue_init (struct cs_queue *cs_queue, size_t cs_queue_item
 	cs_queue->size = cs_queue_items;
 	cs_queue->size_per_item = size_per_item;
 	cs_queue->threaded_mode_enabled = threaded_mode_enabled;
+	cs_queue->mpsc = 0;
+	cs_queue->mpsc_seq = NULL;
 
 	cs_queue->items = malloc (cs_queue_items * size_per_item);
 	if (cs_queue->items == 0) {
@@ -76,6 +156,11 @@ static inline int cs_queue_init (struct cs_queue *cs_queue, size_t cs_queue_item
 
 static inline int cs_queue_reinit (struct cs_queue *cs_queue)
 {
+	if (cs_queue->mpsc) {
+		cs_queue_mpsc_reset (cs_queue);
+		return (0);
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -95,12 +180,17 @@ static inline void cs_queue_free (struct cs_queue *cs_queue) {
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_destroy (&cs_queue->mutex);
 	}
+	free (cs_queue->mpsc_seq);
 	free (cs_queue->items);
 }
 
 static inline int cs_queue_is_full (struct cs_queue *cs_queue) {
 	int full;
 
+	if (cs_queue->mpsc) {
+		return (__atomic_load_n (&cs_queue->used, __ATOMIC_RELAXED) >= (int)(cs_queue->size - 1));
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -114,6 +204,10 @@ static inline int cs_queue_is_full (struct cs_queue *cs_queue) {
 static inline int cs_queue_is_empty (struct cs_queue *cs_queue) {
 	int empty;
 
+	if (cs_queue->mpsc) {
+		return (!cs_queue_mpsc_ready (cs_queue, cs_queue->mpsc_tail));
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -124,10 +218,40 @@ static inline int cs_queue_is_empty (struct cs_queue *cs_queue) {
 	return (empty);
 }
 
-static inline void cs_queue_item_add (struct cs_queue *cs_queue, void *item)
+/*
+ * Returns 0 on success or -1 if queue is full. Full queue can happen only for
+ * mpsc queue, where other producer may fill queue after cs_queue_is_full check.
+ */
+static inline int cs_queue_item_add (struct cs_queue *cs_queue, void *item)
 {
 	char *cs_queue_item;
 	int cs_queue_position;
+	unsigned int pos;
+	int used;
+
+	if (cs_queue->mpsc) {
+		used = __atomic_add_fetch (&cs_queue->used, 1, __ATOMIC_ACQUIRE);
+		if (used > (int)(cs_queue->size - 1)) {
+			__atomic_sub_fetch (&cs_queue->used, 1, __ATOMIC_RELAXED);
+			return (-1);
+		}
+		if (used > __atomic_load_n (&cs_queue->usedhw, __ATOMIC_RELAXED)) {
+			__atomic_store_n (&cs_queue->usedhw, used, __ATOMIC_RELAXED);
+		}
+
+		pos = __atomic_fetch_add (&cs_queue->mpsc_head, 1, __ATOMIC_RELAXED);
+
+		/*
+		 * Space is reserved so slot was already released by consumer
+		 */
+		assert (__atomic_load_n (&cs_queue->mpsc_seq[pos & cs_queue->mpsc_mask],
+		    __ATOMIC_ACQUIRE) == pos);
+
+		memcpy (cs_queue_mpsc_slot (cs_queue, pos), item, cs_queue->size_per_item);
+		__atomic_store_n (&cs_queue->mpsc_seq[pos & cs_queue->mpsc_mask], pos + 1, __ATOMIC_RELEASE);
+
+		return (0);
+	}
 
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
@@ -147,6 +271,8 @@ static inline void cs_queue_item_add (struct cs_queue *cs_queue, void *item)
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_unlock (&cs_queue->mutex);
 	}
+
+	return (0);
 }
 
 static inline void *cs_queue_item_get (struct cs_queue *cs_queue)
@@ -154,6 +280,10 @@ static inline void *cs_queue_item_get (struct cs_queue *cs_queue)
 	char *cs_queue_item;
 	int cs_queue_position;
 
+	if (cs_queue->mpsc) {
+		return (cs_queue_mpsc_slot (cs_queue, cs_queue->mpsc_tail));
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -167,6 +297,22 @@ static inline void *cs_queue_item_get (struct cs_queue *cs_queue)
 }
 
 static inline void cs_queue_item_remove (struct cs_queue *cs_queue) {
+	unsigned int pos;
+
+	if (cs_queue->mpsc) {
+		pos = cs_queue->mpsc_tail;
+		assert (cs_queue_mpsc_ready (cs_queue, pos));
+
+		/*
+		 * Release slot for position one lap later
+		 */
+		__atomic_store_n (&cs_queue->mpsc_seq[pos & cs_queue->mpsc_mask],
+		    pos + cs_queue->mpsc_mask + 1, __ATOMIC_RELEASE);
+		cs_queue->mpsc_tail = pos + 1;
+		__atomic_sub_fetch (&cs_queue->used, 1, __ATOMIC_RELEASE);
+		return ;
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -183,6 +329,13 @@ static inline void cs_queue_item_remove (struct cs_queue *cs_queue) {
 
 static inline void cs_queue_items_remove (struct cs_queue *cs_queue, int rel_count)
 {
+	if (cs_queue->mpsc) {
+		while (rel_count-- > 0) {
+			cs_queue_item_remove (cs_queue);
+		}
+		return ;
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -199,6 +352,11 @@ static inline void cs_queue_items_remove (struct cs_queue *cs_queue, int rel_cou
 
 static inline void cs_queue_item_iterator_init (struct cs_queue *cs_queue)
 {
+	if (cs_queue->mpsc) {
+		cs_queue->mpsc_iterator = cs_queue->mpsc_tail;
+		return ;
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -213,6 +371,13 @@ static inline void *cs_queue_item_iterator_get (struct cs_queue *cs_queue)
 	char *cs_queue_item;
 	int cs_queue_position;
 
+	if (cs_queue->mpsc) {
+		if (!cs_queue_mpsc_ready (cs_queue, cs_queue->mpsc_iterator)) {
+			return (0);
+		}
+		return (cs_queue_mpsc_slot (cs_queue, cs_queue->mpsc_iterator));
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -235,6 +400,11 @@ static inline int cs_queue_item_iterator_next (struct cs_queue *cs_queue)
 {
 	int next_res;
 
+	if (cs_queue->mpsc) {
+		cs_queue->mpsc_iterator++;
+		return (!cs_queue_mpsc_ready (cs_queue, cs_queue->mpsc_iterator));
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -249,6 +419,14 @@ static inline int cs_queue_item_iterator_next (struct cs_queue *cs_queue)
 
 static inline void cs_queue_avail (struct cs_queue *cs_queue, int *avail)
 {
+	if (cs_queue->mpsc) {
+		*avail = cs_queue->size - __atomic_load_n (&cs_queue->used, __ATOMIC_RELAXED) - 2;
+		if (*avail < 0) {
+			*avail = 0;
+		}
+		return ;
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -262,6 +440,10 @@ static inline void cs_queue_avail (struct cs_queue *cs_queue, int *avail)
 static inline int cs_queue_used (struct cs_queue *cs_queue) {
 	int used;
 
+	if (cs_queue->mpsc) {
+		return (__atomic_load_n (&cs_queue->used, __ATOMIC_RELAXED));
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -276,6 +458,10 @@ static inline int cs_queue_used (struct cs_queue *cs_queue) {
 static inline int cs_queue_usedhw (struct cs_queue *cs_queue) {
 	int usedhw;
 
+	if (cs_queue->mpsc) {
+		return (__atomic_load_n (&cs_queue->usedhw, __ATOMIC_RELAXED));
+	}
+
 	if (cs_queue->threaded_mode_enabled) {
 		pthread_mutex_lock (&cs_queue->mutex);
 	}
@@ -34,6 +34,7 @@
 
 #include <config.h>
 
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -45,9 +46,16 @@
 
 #define ICMAP_MAX_VALUE_LEN	(16*1024)
 
+/*
+ * Items are shared between maps (icmap_copy_map, icmap_copy_key) and
+ * freed when the last map drops them. Shared item is never changed in
+ * place, it's copied first.
+ */
 struct icmap_item {
 	char *key_name;
 	icmap_value_types_t type;
+	int counter; /* some icmap_counter caches pointer to this item */
+	unsigned int refcount; /* number of maps containing item */
 	size_t value_len;
 	char value[];
 };
@@ -56,6 +64,50 @@ struct icmap_map {
 	qb_map_t *qb_map;
 };
 
+/*
+ * Items are carved from arena blocks, one free list per value size class.
+ * Values bigger than the largest class are malloced. All fixed size types
+ * fit into the first class.
+ */
+#define ICMAP_ITEM_ARENA_CLASSES	3
+#define ICMAP_ITEM_ARENA_BLOCK_ITEMS	64
+
+static const size_t icmap_item_arena_class_len[ICMAP_ITEM_ARENA_CLASSES] = {
+	sizeof(uint64_t), 64, 256
+};
+
+struct icmap_item_arena_free {
+	struct icmap_item_arena_free *next;
+};
+
+static struct icmap_item_arena_free *icmap_item_arena_free_list[ICMAP_ITEM_ARENA_CLASSES];
+
+/*
+ * Interned key name. Item key_name points to name, so all items with the
+ * same key (in any map) share one copy.
+ */
+struct icmap_key_name {
+	unsigned int refcount;
+	char name[];
+};
+
+static qb_map_t *icmap_key_name_map;
+
+/*
+ * Item changed in place by icmap_set_r together with its previous value,
+ * so icmap_notify_fn can still pass old value to trackers. Chained because
+ * tracker may set other keys.
+ */
+struct icmap_inplace_update {
+	const struct icmap_item *item;
+	icmap_value_types_t type;
+	size_t value_len;
+	uint64_t old_value;
+	struct icmap_inplace_update *prev;
+};
+
+static struct icmap_inplace_update *icmap_inplace_update_head;
+
 static icmap_map_t icmap_global_map;
 
 struct icmap_track {
@@ -72,8 +124,38 @@ struct icmap_ro_access_item {
 	struct qb_list_head list;
 };
 
+struct icmap_counter {
+	icmap_map_t map;
+	char *key_name;
+	/*
+	 * Resolved item, NULL after the item was replaced or deleted
+	 */
+	struct icmap_item *item;
+	struct qb_list_head list;
+	struct qb_list_head dirty_list;
+};
+
+/*
+ * Trie of RO access rules compiled from icmap_ro_access_item_list_head,
+ * so icmap_is_key_ro costs O(key length) whatever the number of rules
+ */
+struct icmap_ro_trie_node {
+	char c;
+	int ro_key; /* non prefix rule ends here */
+	int ro_prefix; /* prefix rule ends here */
+	size_t children_entries;
+	struct icmap_ro_trie_node **children;
+};
+
+static struct icmap_ro_trie_node *icmap_ro_trie;
+
 QB_LIST_DECLARE (icmap_ro_access_item_list_head);
 QB_LIST_DECLARE (icmap_track_list_head);
+QB_LIST_DECLARE (icmap_counter_list_head);
+/*
+ * Counters changed since the last icmap_counter_notify
+ */
+QB_LIST_DECLARE (icmap_counter_dirty_list_head);
 
 /*
  * Static functions declarations
@@ -170,6 +252,184 @@ int32_t icmap_qbtt_to_tt(int32_t track_type)
 	return (res);
 }
 
+static void icmap_counter_item_invalidate(const icmap_map_t map, const struct icmap_item *item)
+{
+	struct qb_list_head *iter;
+	struct icmap_counter *counter;
+
+	qb_list_for_each(iter, &icmap_counter_list_head) {
+		counter = qb_list_entry(iter, struct icmap_counter, list);
+
+		if (counter->map == map && counter->item == item) {
+			counter->item = NULL;
+			/*
+			 * Change of the item was already notified
+			 */
+			qb_list_del(&counter->dirty_list);
+			qb_list_init(&counter->dirty_list);
+		}
+	}
+}
+
+static int icmap_item_arena_class(size_t value_len)
+{
+	int i;
+
+	for (i = 0; i < ICMAP_ITEM_ARENA_CLASSES; i++) {
+		if (value_len <= icmap_item_arena_class_len[i]) {
+			return (i);
+		}
+	}
+
+	return (-1);
+}
+
+static size_t icmap_item_arena_slot_size(int arena_class)
+{
+	size_t slot_size;
+
+	slot_size = sizeof(struct icmap_item) + icmap_item_arena_class_len[arena_class];
+
+	/*
+	 * Keep value of every slot aligned for 64-bit access
+	 */
+	return ((slot_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
+}
+
+static int icmap_item_arena_grow(int arena_class)
+{
+	struct icmap_item_arena_free *slot;
+	size_t slot_size;
+	char *block;
+	int i;
+
+	slot_size = icmap_item_arena_slot_size(arena_class);
+
+	/*
+	 * Blocks are never returned, freed items are reused by next allocations
+	 */
+	block = malloc(slot_size * ICMAP_ITEM_ARENA_BLOCK_ITEMS);
+	if (block == NULL) {
+		return (-1);
+	}
+
+	for (i = ICMAP_ITEM_ARENA_BLOCK_ITEMS - 1; i >= 0; i--) {
+		slot = (struct icmap_item_arena_free *)(block + i * slot_size);
+		slot->next = icmap_item_arena_free_list[arena_class];
+		icmap_item_arena_free_list[arena_class] = slot;
+	}
+
+	return (0);
+}
+
+/*
+ * Allocate zeroed item for value of value_len bytes
+ */
+static struct icmap_item *icmap_item_alloc(size_t value_len)
+{
+	struct icmap_item_arena_free *slot;
+	struct icmap_item *item;
+	int arena_class;
+
+	arena_class = icmap_item_arena_class(value_len);
+	if (arena_class < 0) {
+		item = malloc(sizeof(struct icmap_item) + value_len);
+	} else {
+		if (icmap_item_arena_free_list[arena_class] == NULL &&
+		    icmap_item_arena_grow(arena_class) != 0) {
+			return (NULL);
+		}
+
+		slot = icmap_item_arena_free_list[arena_class];
+		icmap_item_arena_free_list[arena_class] = slot->next;
+		item = (struct icmap_item *)slot;
+	}
+
+	if (item != NULL) {
+		memset(item, 0, sizeof(struct icmap_item) + value_len);
+	}
+
+	return (item);
+}
+
+static void icmap_item_free(struct icmap_item *item)
+{
+	struct icmap_item_arena_free *slot;
+	int arena_class;
+
+	arena_class = icmap_item_arena_class(item->value_len);
+	if (arena_class < 0) {
+		free(item);
+		return ;
+	}
+
+	slot = (struct icmap_item_arena_free *)item;
+	slot->next = icmap_item_arena_free_list[arena_class];
+	icmap_item_arena_free_list[arena_class] = slot;
+}
+
+/*
+ * Return interned copy of key_name with reference taken
+ */
+static char *icmap_key_name_get(const char *key_name)
+{
+	struct icmap_key_name *kn;
+	size_t len;
+
+	if (icmap_key_name_map == NULL) {
+		icmap_key_name_map = qb_trie_create();
+		if (icmap_key_name_map == NULL) {
+			return (NULL);
+		}
+	}
+
+	kn = qb_map_get(icmap_key_name_map, key_name);
+	if (kn != NULL) {
+		kn->refcount++;
+		return (kn->name);
+	}
+
+	len = strlen(key_name);
+	kn = malloc(sizeof(struct icmap_key_name) + len + 1);
+	if (kn == NULL) {
+		return (NULL);
+	}
+	kn->refcount = 1;
+	memcpy(kn->name, key_name, len + 1);
+
+	qb_map_put(icmap_key_name_map, kn->name, kn);
+
+	return (kn->name);
+}
+
+static char *icmap_key_name_ref(char *key_name)
+{
+	struct icmap_key_name *kn;
+
+	kn = (struct icmap_key_name *)(key_name - offsetof(struct icmap_key_name, name));
+	kn->refcount++;
+
+	return (key_name);
+}
+
+static void icmap_key_name_put(char *key_name)
+{
+	struct icmap_key_name *kn;
+
+	kn = (struct icmap_key_name *)(key_name - offsetof(struct icmap_key_name, name));
+	if (--kn->refcount > 0) {
+		return ;
+	}
+
+	qb_map_rm(icmap_key_name_map, kn->name);
+	free(kn);
+
+	if (qb_map_count_get(icmap_key_name_map) == 0) {
+		qb_map_destroy(icmap_key_name_map);
+		icmap_key_name_map = NULL;
+	}
+}
+
 static void icmap_map_free_cb(uint32_t event,
 		char* key, void* old_value,
 		void* value, void* user_data)
@@ -180,8 +440,14 @@ static void icmap_map_free_cb(uint32_t event,
 	 * value == old_value -> fast_adjust_int was used, don't free data
 	 */
 	if (item != NULL && value != old_value) {
-		free(item->key_name);
-		free(item);
+		if (item->counter) {
+			icmap_counter_item_invalidate((icmap_map_t)user_data, item);
+		}
+
+		if (--item->refcount == 0) {
+			icmap_key_name_put(item->key_name);
+			icmap_item_free(item);
+		}
 	}
 }
 
@@ -200,7 +466,7 @@ cs_error_t icmap_init_r(icmap_map_t *result)
 		return (CS_ERR_INIT);
 	}
 
-	err = qb_map_notify_add((*result)->qb_map, NULL, icmap_map_free_cb, QB_MAP_NOTIFY_FREE, NULL);
+	err = qb_map_notify_add((*result)->qb_map, NULL, icmap_map_free_cb, QB_MAP_NOTIFY_FREE, *result);
 	if (err != 0) {
 		qb_map_destroy((*result)->qb_map);
 		free(*result);
@@ -214,6 +480,109 @@ cs_error_t icmap_init(void)
 	return (icmap_init_r(&icmap_global_map));
 }
 
+static void icmap_ro_trie_free(struct icmap_ro_trie_node *node)
+{
+	size_t i;
+
+	if (node == NULL) {
+		return ;
+	}
+
+	for (i = 0; i < node->children_entries; i++) {
+		icmap_ro_trie_free(node->children[i]);
+	}
+	free(node->children);
+	free(node);
+}
+
+static struct icmap_ro_trie_node *icmap_ro_trie_child(
+	const struct icmap_ro_trie_node *node,
+	char c)
+{
+	size_t i;
+
+	for (i = 0; i < node->children_entries; i++) {
+		if (node->children[i]->c == c) {
+			return (node->children[i]);
+		}
+	}
+
+	return (NULL);
+}
+
+static int icmap_ro_trie_insert(
+	struct icmap_ro_trie_node *root,
+	const char *key_name,
+	int prefix)
+{
+	struct icmap_ro_trie_node *node;
+	struct icmap_ro_trie_node *child;
+	struct icmap_ro_trie_node **new_children;
+	const char *p;
+
+	node = root;
+	for (p = key_name; *p != '\0'; p++) {
+		child = icmap_ro_trie_child(node, *p);
+		if (child == NULL) {
+			new_children = realloc(node->children,
+			    sizeof(*new_children) * (node->children_entries + 1));
+			if (new_children == NULL) {
+				return (-1);
+			}
+			node->children = new_children;
+
+			child = malloc(sizeof(*child));
+			if (child == NULL) {
+				return (-1);
+			}
+			memset(child, 0, sizeof(*child));
+			child->c = *p;
+
+			node->children[node->children_entries++] = child;
+		}
+		node = child;
+	}
+
+	if (prefix) {
+		node->ro_prefix = 1;
+	} else {
+		node->ro_key = 1;
+	}
+
+	return (0);
+}
+
+/*
+ * Compile RO rules into icmap_ro_trie. If there is not enough memory,
+ * trie is left empty and icmap_is_key_ro walks the rule list.
+ */
+static void icmap_ro_trie_rebuild(void)
+{
+	struct qb_list_head *iter;
+	struct icmap_ro_access_item *icmap_ro_ai;
+	struct icmap_ro_trie_node *root;
+
+	icmap_ro_trie_free(icmap_ro_trie);
+	icmap_ro_trie = NULL;
+
+	root = malloc(sizeof(*root));
+	if (root == NULL) {
+		return ;
+	}
+	memset(root, 0, sizeof(*root));
+
+	qb_list_for_each(iter, &icmap_ro_access_item_list_head) {
+		icmap_ro_ai = qb_list_entry(iter, struct icmap_ro_access_item, list);
+
+		if (icmap_ro_trie_insert(root, icmap_ro_ai->key_name, icmap_ro_ai->prefix) != 0) {
+			icmap_ro_trie_free(root);
+			return ;
+		}
+	}
+
+	icmap_ro_trie = root;
+}
+
 static void icmap_set_ro_access_free(void)
 {
 	struct qb_list_head *iter, *tmp_iter;
@@ -225,6 +594,9 @@ static void icmap_set_ro_access_free(void)
 		free(icmap_ro_ai->key_name);
 		free(icmap_ro_ai);
 	}
+
+	icmap_ro_trie_free(icmap_ro_trie);
+	icmap_ro_trie = NULL;
 }
 
 static void icmap_del_all_track(void)
@@ -408,6 +780,32 @@ int icmap_key_value_eq(
 	return (icmap_item_eq(item1, item2->value, item2->value_len, item2->type));
 }
 
+/*
+ * Store fixed size value of the same type into item not shared with other
+ * map. Trackers are called with previous value as old value.
+ */
+static cs_error_t icmap_item_set_inplace(
+	const icmap_map_t map,
+	struct icmap_item *item,
+	const void *value)
+{
+	struct icmap_inplace_update update;
+
+	update.item = item;
+	update.type = item->type;
+	update.value_len = item->value_len;
+	memcpy(&update.old_value, item->value, item->value_len);
+	update.prev = icmap_inplace_update_head;
+	icmap_inplace_update_head = &update;
+
+	memcpy(item->value, value, item->value_len);
+	qb_map_put(map->qb_map, item->key_name, item);
+
+	icmap_inplace_update_head = update.prev;
+
+	return (CS_OK);
+}
+
 cs_error_t icmap_set_r(
 	const icmap_map_t map,
 	const char *key_name,
@@ -418,7 +816,6 @@ cs_error_t icmap_set_r(
 	struct icmap_item *item;
 	struct icmap_item *new_item;
 	size_t new_value_len;
-	size_t new_item_size;
 
 	if (value == NULL || key_name == NULL) {
 		return (CS_ERR_INVALID_PARAM);
@@ -456,24 +853,27 @@ cs_error_t icmap_set_r(
 		new_value_len = icmap_get_valuetype_len(type);
 	}
 
-	new_item_size = sizeof(struct icmap_item) + new_value_len;
-	new_item = malloc(new_item_size);
+	if (item != NULL && item->refcount == 1 && item->type == type &&
+	    type != ICMAP_VALUETYPE_BINARY && type != ICMAP_VALUETYPE_STRING) {
+		return (icmap_item_set_inplace(map, item, value));
+	}
+
+	new_item = icmap_item_alloc(new_value_len);
 	if (new_item == NULL) {
 		return (CS_ERR_NO_MEMORY);
 	}
-	memset(new_item, 0, new_item_size);
 
-	if (item == NULL) {
-		new_item->key_name = strdup(key_name);
+	if (item != NULL) {
+		new_item->key_name = icmap_key_name_ref(item->key_name);
+	} else {
+		new_item->key_name = icmap_key_name_get(key_name);
 		if (new_item->key_name == NULL) {
-			free(new_item);
+			icmap_item_free(new_item);
 			return (CS_ERR_NO_MEMORY);
 		}
-	} else {
-		new_item->key_name = item->key_name;
-		item->key_name = NULL;
 	}
 
+	new_item->refcount = 1;
 	new_item->type = type;
 	new_item->value_len = new_value_len;
 
@@ -988,23 +1388,13 @@ cs_error_t icmap_adjust_int(
 	return (icmap_adjust_int_r(icmap_global_map, key_name, step));
 }
 
-cs_error_t icmap_fast_adjust_int_r(
-	const icmap_map_t map,
-	const char *key_name,
-	int32_t step)
+/*
+ * Add step to value of integer item in place
+ */
+static cs_error_t icmap_item_adjust_int(struct icmap_item *item, int32_t step)
 {
-	struct icmap_item *item;
 	cs_error_t err = CS_OK;
 
-	if (key_name == NULL) {
-		return (CS_ERR_INVALID_PARAM);
-	}
-
-	item = qb_map_get(map->qb_map, key_name);
-	if (item == NULL) {
-		return (CS_ERR_NOT_EXIST);
-	}
-
 	switch (item->type) {
 	case ICMAP_VALUETYPE_INT8:
 	case ICMAP_VALUETYPE_UINT8:
@@ -1030,6 +1420,70 @@ cs_error_t icmap_fast_adjust_int_r(
 		break;
 	}
 
+	return (err);
+}
+
+/*
+ * Replace item shared with other maps by private copy with step added.
+ * Trackers are called by the replace. Copy is stored in new_item if not NULL.
+ */
+static cs_error_t icmap_item_unshare_adjust_int(
+	const icmap_map_t map,
+	const struct icmap_item *item,
+	int32_t step,
+	struct icmap_item **new_item)
+{
+	struct icmap_item *copy;
+	cs_error_t err;
+
+	copy = icmap_item_alloc(item->value_len);
+	if (copy == NULL) {
+		return (CS_ERR_NO_MEMORY);
+	}
+	memcpy(copy, item, sizeof(struct icmap_item) + item->value_len);
+	copy->counter = 0;
+	copy->refcount = 1;
+
+	err = icmap_item_adjust_int(copy, step);
+	if (err != CS_OK) {
+		icmap_item_free(copy);
+		return (err);
+	}
+
+	copy->key_name = icmap_key_name_ref(item->key_name);
+
+	qb_map_put(map->qb_map, copy->key_name, copy);
+
+	if (new_item != NULL) {
+		*new_item = copy;
+	}
+
+	return (CS_OK);
+}
+
+cs_error_t icmap_fast_adjust_int_r(
+	const icmap_map_t map,
+	const char *key_name,
+	int32_t step)
+{
+	struct icmap_item *item;
+	cs_error_t err;
+
+	if (key_name == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	item = qb_map_get(map->qb_map, key_name);
+	if (item == NULL) {
+		return (CS_ERR_NOT_EXIST);
+	}
+
+	if (item->refcount > 1) {
+		return (icmap_item_unshare_adjust_int(map, item, step, NULL));
+	}
+
+	err = icmap_item_adjust_int(item, step);
+
 	if (err == CS_OK) {
 		qb_map_put(map->qb_map, item->key_name, item);
 	}
@@ -1085,6 +1539,128 @@ cs_error_t icmap_fast_dec(const char *key_name)
 	return (icmap_fast_dec_r(icmap_global_map, key_name));
 }
 
+cs_error_t icmap_counter_create_r(
+	const icmap_map_t map,
+	const char *key_name,
+	icmap_counter_t *counter)
+{
+	struct icmap_counter *new_counter;
+
+	if (key_name == NULL || counter == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	new_counter = malloc(sizeof(*new_counter));
+	if (new_counter == NULL) {
+		return (CS_ERR_NO_MEMORY);
+	}
+	memset(new_counter, 0, sizeof(*new_counter));
+
+	new_counter->key_name = strdup(key_name);
+	if (new_counter->key_name == NULL) {
+		free(new_counter);
+		return (CS_ERR_NO_MEMORY);
+	}
+
+	new_counter->map = map;
+	qb_list_init(&new_counter->dirty_list);
+	qb_list_add(&new_counter->list, &icmap_counter_list_head);
+
+	*counter = new_counter;
+
+	return (CS_OK);
+}
+
+cs_error_t icmap_counter_create(const char *key_name, icmap_counter_t *counter)
+{
+
+	return (icmap_counter_create_r(icmap_global_map, key_name, counter));
+}
+
+void icmap_counter_destroy(icmap_counter_t counter)
+{
+
+	if (counter == NULL) {
+		return ;
+	}
+
+	qb_list_del(&counter->dirty_list);
+	qb_list_del(&counter->list);
+	free(counter->key_name);
+	free(counter);
+}
+
+cs_error_t icmap_counter_adjust(icmap_counter_t counter, int32_t step)
+{
+	struct icmap_item *new_item;
+	cs_error_t err;
+
+	if (counter == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	if (counter->item == NULL) {
+		/*
+		 * First use or item was replaced since, resolve key again
+		 */
+		counter->item = qb_map_get(counter->map->qb_map, counter->key_name);
+		if (counter->item == NULL) {
+			return (CS_ERR_NOT_EXIST);
+		}
+		counter->item->counter = 1;
+	}
+
+	if (counter->item->refcount > 1) {
+		/*
+		 * Item is also in other map, replace it by a copy. That calls
+		 * trackers and drops cached item, so cache the copy instead.
+		 */
+		err = icmap_item_unshare_adjust_int(counter->map, counter->item, step, &new_item);
+		if (err == CS_OK) {
+			counter->item = new_item;
+			counter->item->counter = 1;
+		}
+
+		return (err);
+	}
+
+	err = icmap_item_adjust_int(counter->item, step);
+
+	if (err == CS_OK && qb_list_empty(&counter->dirty_list)) {
+		qb_list_add_tail(&counter->dirty_list, &icmap_counter_dirty_list_head);
+	}
+
+	return (err);
+}
+
+cs_error_t icmap_counter_inc(icmap_counter_t counter)
+{
+
+	if (counter == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	return (icmap_counter_adjust(counter, 1));
+}
+
+void icmap_counter_notify(void)
+{
+	struct qb_list_head *iter, *tmp_iter;
+	struct icmap_counter *counter;
+
+	qb_list_for_each_safe(iter, tmp_iter, &icmap_counter_dirty_list_head) {
+		counter = qb_list_entry(iter, struct icmap_counter, dirty_list);
+
+		qb_list_del(&counter->dirty_list);
+		qb_list_init(&counter->dirty_list);
+
+		/*
+		 * Same as icmap_fast_adjust_int, put item back to call trackers
+		 */
+		qb_map_put(counter->map->qb_map, counter->item->key_name, counter->item);
+	}
+}
+
 icmap_iter_t icmap_iter_init_r(const icmap_map_t map, const char *prefix)
 {
 	return (qb_map_pref_iter_create(map->qb_map, prefix));
@@ -1129,6 +1705,7 @@ static void icmap_notify_fn(uint32_t event, char *key, void *old_value, void *va
 	struct icmap_item *old_item = (struct icmap_item *)old_value;
 	struct icmap_notify_value new_val;
 	struct icmap_notify_value old_val;
+	struct icmap_inplace_update *update;
 
 	if (value == NULL && old_value == NULL) {
 		return ;
@@ -1143,14 +1720,24 @@ static void icmap_notify_fn(uint32_t event, char *key, void *old_value, void *va
 	}
 
 	/*
-	 * old_item == new_item if fast functions are used -> don't fill old value
+	 * old_item == new_item if fast functions are used -> don't fill old value,
+	 * unless the item was changed in place by icmap_set_r
 	 */
+	memset(&old_val, 0, sizeof(old_val));
+
 	if (old_item != NULL && old_item != new_item) {
 		old_val.type = old_item->type;
 		old_val.len = old_item->value_len;
 		old_val.data = old_item->value;
-	} else {
-		memset(&old_val, 0, sizeof(old_val));
+	} else if (old_item != NULL) {
+		for (update = icmap_inplace_update_head; update != NULL; update = update->prev) {
+			if (update->item == old_item) {
+				old_val.type = update->type;
+				old_val.len = update->value_len;
+				old_val.data = &update->old_value;
+				break;
+			}
+		}
 	}
 
 	icmap_track->notify_fn(icmap_qbtt_to_tt(event),
@@ -1244,6 +1831,7 @@ cs_error_t icmap_set_ro_access(const char *key_name, int prefix, int ro_access)
 				qb_list_del(&icmap_ro_ai->list);
 				free(icmap_ro_ai->key_name);
 				free(icmap_ro_ai);
+				icmap_ro_trie_rebuild();
 
 				return (CS_OK);
 			}
@@ -1269,6 +1857,7 @@ cs_error_t icmap_set_ro_access(const char *key_name, int prefix, int ro_access)
 	icmap_ro_ai->prefix = prefix;
 	qb_list_init(&icmap_ro_ai->list);
 	qb_list_add (&icmap_ro_ai->list, &icmap_ro_access_item_list_head);
+	icmap_ro_trie_rebuild();
 
 	return (CS_OK);
 }
@@ -1277,6 +1866,26 @@ int icmap_is_key_ro(const char *key_name)
 {
 	struct qb_list_head *iter;
 	struct icmap_ro_access_item *icmap_ro_ai;
+	const struct icmap_ro_trie_node *node;
+	const char *p;
+
+	if (icmap_ro_trie != NULL) {
+		node = icmap_ro_trie;
+		for (p = key_name; ; p++) {
+			if (node->ro_prefix) {
+				return (CS_TRUE);
+			}
+
+			if (*p == '\0') {
+				return (node->ro_key ? CS_TRUE : CS_FALSE);
+			}
+
+			node = icmap_ro_trie_child(node, *p);
+			if (node == NULL) {
+				return (CS_FALSE);
+			}
+		}
+	}
 
 	qb_list_for_each(iter, &icmap_ro_access_item_list_head) {
 		icmap_ro_ai = qb_list_entry(iter, struct icmap_ro_access_item, list);
@@ -1299,36 +1908,131 @@ int icmap_is_key_ro(const char *key_name)
 
 }
 
+/*
+ * Put item of other map into map, item is shared by both maps
+ */
+static void icmap_item_share(const icmap_map_t map, struct icmap_item *item)
+{
+
+	item->refcount++;
+	qb_map_put(map->qb_map, item->key_name, item);
+}
+
 cs_error_t icmap_copy_map(icmap_map_t dst_map, const icmap_map_t src_map)
 {
 	icmap_iter_t iter;
-	size_t value_len;
-	icmap_value_types_t value_type;
+	struct icmap_item *item;
+	struct icmap_item *dst_item;
 	const char *key_name;
-	cs_error_t err;
-	void *value;
 
 	iter = icmap_iter_init_r(src_map, NULL);
 	if (iter == NULL) {
 		return (CS_ERR_NO_MEMORY);
 	}
 
-	err = CS_OK;
+	/*
+	 * Changed and new items are shared with src_map instead of being
+	 * copied, unchanged ones are left alone so trackers are not called
+	 */
+	while ((key_name = qb_map_iter_next(iter, (void **)&item)) != NULL) {
+		dst_item = qb_map_get(dst_map->qb_map, key_name);
+		if (dst_item == item ||
+		    (dst_item != NULL && icmap_item_eq(dst_item, item->value, item->value_len, item->type))) {
+			continue;
+		}
+
+		icmap_item_share(dst_map, item);
+	}
+
+	icmap_iter_finalize(iter);
+
+	return (CS_OK);
+}
+
+cs_error_t icmap_diff_r(
+	const icmap_map_t old_map,
+	const icmap_map_t new_map,
+	icmap_diff_fn_t diff_fn,
+	void *user_data)
+{
+	icmap_iter_t old_iter;
+	icmap_iter_t new_iter;
+	struct icmap_item *old_item = NULL;
+	struct icmap_item *new_item = NULL;
+	const char *old_key;
+	const char *new_key;
+	int cmp;
+
+	old_iter = icmap_iter_init_r(old_map, NULL);
+	if (old_iter == NULL) {
+		return (CS_ERR_NO_MEMORY);
+	}
+
+	new_iter = icmap_iter_init_r(new_map, NULL);
+	if (new_iter == NULL) {
+		icmap_iter_finalize(old_iter);
+		return (CS_ERR_NO_MEMORY);
+	}
 
-	while ((key_name = icmap_iter_next(iter, &value_len, &value_type)) != NULL) {
-		err = icmap_get_ref_r(src_map, key_name, &value, &value_len, &value_type);
-		if (err != CS_OK) {
-			goto exit_iter_finalize;
+	/*
+	 * Both iterators return keys sorted, so one merge walk is enough.
+	 * Shared items are equal without looking at the value.
+	 */
+	old_key = qb_map_iter_next(old_iter, (void **)&old_item);
+	new_key = qb_map_iter_next(new_iter, (void **)&new_item);
+
+	while (old_key != NULL || new_key != NULL) {
+		if (old_key == NULL) {
+			cmp = 1;
+		} else if (new_key == NULL) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(old_key, new_key);
 		}
 
-		err = icmap_set_r(dst_map, key_name, value, value_len, value_type);
-		if (err != CS_OK) {
-			goto exit_iter_finalize;
+		if (cmp < 0) {
+			diff_fn(ICMAP_TRACK_DELETE, old_key, user_data);
+			old_key = qb_map_iter_next(old_iter, (void **)&old_item);
+		} else if (cmp > 0) {
+			diff_fn(ICMAP_TRACK_ADD, new_key, user_data);
+			new_key = qb_map_iter_next(new_iter, (void **)&new_item);
+		} else {
+			if (old_item != new_item &&
+			    !icmap_item_eq(old_item, new_item->value, new_item->value_len, new_item->type)) {
+				diff_fn(ICMAP_TRACK_MODIFY, new_key, user_data);
+			}
+			old_key = qb_map_iter_next(old_iter, (void **)&old_item);
+			new_key = qb_map_iter_next(new_iter, (void **)&new_item);
 		}
 	}
 
-exit_iter_finalize:
-	icmap_iter_finalize(iter);
+	icmap_iter_finalize(new_iter);
+	icmap_iter_finalize(old_iter);
 
-	return (err);
+	return (CS_OK);
+}
+
+cs_error_t icmap_copy_key(icmap_map_t dst_map, const icmap_map_t src_map, const char *key_name)
+{
+	struct icmap_item *item;
+	struct icmap_item *dst_item;
+
+	if (key_name == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	item = qb_map_get(src_map->qb_map, key_name);
+	if (item == NULL) {
+		return (CS_ERR_NOT_EXIST);
+	}
+
+	dst_item = qb_map_get(dst_map->qb_map, key_name);
+	if (dst_item == item ||
+	    (dst_item != NULL && icmap_item_eq(dst_item, item->value, item->value_len, item->type))) {
+		return (CS_OK);
+	}
+
+	icmap_item_share(dst_map, item);
+
+	return (CS_OK);
 }
@@ -36,6 +36,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <assert.h>
 #include <sys/uio.h>
@@ -71,6 +73,7 @@ static int32_t ipc_fc_is_quorate; /* boolean */
 static int32_t ipc_fc_totem_queue_level; /* percentage used */
 static int32_t ipc_fc_sync_in_process; /* boolean */
 static int32_t ipc_allow_connections = 0; /* boolean */
+static int32_t ipc_fc_outq_over_budget; /* connections over their outq budget */
 
 #define CS_IPCS_MAPPER_SERV_NAME		256
 
@@ -80,6 +83,34 @@ struct cs_ipcs_mapper {
 	char name[CS_IPCS_MAPPER_SERV_NAME];
 };
 
+/*
+ * Dispatch messages a client isn't reading fast enough are copied into a
+ * per connection ring of ipc_outq_size bytes, allocated the first time the
+ * connection queues and kept until it is destroyed. Once the ring is full
+ * ipc_outq_policy decides what happens to further messages.
+ */
+#define OUTQ_SIZE_DEFAULT		(4 * 1024 * 1024)
+#define OUTQ_ALIGN(len)			(((len) + 7) & ~((size_t)7))
+#define OUTQ_WRAP			UINT32_MAX
+
+enum cs_ipcs_outq_policy {
+	CS_IPCS_OUTQ_POLICY_BACKPRESSURE,
+	CS_IPCS_OUTQ_POLICY_DROP,
+	CS_IPCS_OUTQ_POLICY_DISCONNECT,
+};
+
+static size_t ipc_outq_size = OUTQ_SIZE_DEFAULT;
+static enum cs_ipcs_outq_policy ipc_outq_policy = CS_IPCS_OUTQ_POLICY_BACKPRESSURE;
+
+struct outq_entry {
+	uint32_t mlen; /* OUTQ_WRAP if the reader has to continue at the start */
+	uint32_t pad;
+	char msg[];
+};
+
+/*
+ * Messages over the ring budget, only used with the backpressure policy
+ */
 struct outq_item {
 	void *msg;
 	size_t mlen;
@@ -95,6 +126,7 @@ static int32_t cs_ipcs_dispatch_mod(enum qb_loop_priority p, int32_t fd, int32_t
 	void *data, qb_ipcs_dispatch_fn_t fn);
 static int32_t cs_ipcs_dispatch_del(int32_t fd);
 static void outq_flush (void *data);
+static void cs_ipcs_check_for_flow_control(void);
 
 
 static struct qb_ipcs_poll_handlers corosync_poll_funcs = {
@@ -333,6 +365,12 @@ static void cs_ipcs_connection_destroyed (qb_ipcs_connection_t *c)
 			free (outq_item->msg);
 			free (outq_item);
 		}
+		free(context->outq_buf);
+		if (context->outq_over_budget &&
+		    ipc_outq_policy == CS_IPCS_OUTQ_POLICY_BACKPRESSURE) {
+			ipc_fc_outq_over_budget--;
+			cs_ipcs_check_for_flow_control();
+		}
 		free(context);
 	}
 }
@@ -380,14 +418,110 @@ int cs_ipcs_response_send(void *conn, const void *msg, size_t mlen)
 	return rc;
 }
 
+/*
+ * Reserve room for a message of mlen bytes at the write end of the ring,
+ * returns NULL if it doesn't fit
+ */
+static struct outq_entry *outq_ring_reserve (struct cs_ipcs_conn_context *context, size_t mlen)
+{
+	size_t need = OUTQ_ALIGN(sizeof(struct outq_entry) + mlen);
+	size_t tail;
+	struct outq_entry *entry;
+
+	if (need > context->outq_size - context->outq_used) {
+		return NULL;
+	}
+
+	if (context->outq_used == 0) {
+		context->outq_read = context->outq_write = 0;
+	}
+
+	if (context->outq_write >= context->outq_read) {
+		tail = context->outq_size - context->outq_write;
+		if (need > tail) {
+			if (need > context->outq_read) {
+				return NULL;
+			}
+			/*
+			 * Leave the tail unused, the reader skips it
+			 */
+			if (tail >= sizeof(struct outq_entry)) {
+				entry = (struct outq_entry *)(context->outq_buf + context->outq_write);
+				entry->mlen = OUTQ_WRAP;
+			}
+			context->outq_used += tail;
+			context->outq_write = 0;
+		}
+	} else if (need > context->outq_read - context->outq_write) {
+		return NULL;
+	}
+
+	entry = (struct outq_entry *)(context->outq_buf + context->outq_write);
+	entry->mlen = mlen;
+	context->outq_write += need;
+	if (context->outq_write == context->outq_size) {
+		context->outq_write = 0;
+	}
+	context->outq_used += need;
+
+	return entry;
+}
+
+static struct outq_entry *outq_ring_first (struct cs_ipcs_conn_context *context)
+{
+	size_t tail;
+
+	if (context->outq_used == 0) {
+		return NULL;
+	}
+
+	tail = context->outq_size - context->outq_read;
+	if (tail < sizeof(struct outq_entry) ||
+	    ((struct outq_entry *)(context->outq_buf + context->outq_read))->mlen == OUTQ_WRAP) {
+		context->outq_used -= tail;
+		context->outq_read = 0;
+	}
+
+	return (struct outq_entry *)(context->outq_buf + context->outq_read);
+}
+
+static void outq_ring_remove (struct cs_ipcs_conn_context *context, struct outq_entry *entry)
+{
+	size_t need = OUTQ_ALIGN(sizeof(struct outq_entry) + entry->mlen);
+
+	context->outq_read += need;
+	if (context->outq_read == context->outq_size) {
+		context->outq_read = 0;
+	}
+	context->outq_used -= need;
+}
+
 static void outq_flush (void *data)
 {
 	qb_ipcs_connection_t *conn = data;
 	struct qb_list_head *list, *tmp_iter;
 	struct outq_item *outq_item;
+	struct outq_entry *entry;
 	int32_t rc;
 	struct cs_ipcs_conn_context *context = qb_ipcs_context_get(conn);
 
+	while ((entry = outq_ring_first(context)) != NULL) {
+		rc = qb_ipcs_event_send(conn, entry->msg, entry->mlen);
+		if (rc < 0 && rc != -EAGAIN) {
+			errno = -rc;
+			qb_perror(LOG_ERR, "qb_ipcs_event_send");
+			return;
+		} else if (rc == -EAGAIN) {
+			goto requeue;
+		}
+		assert(rc == entry->mlen);
+		context->sent++;
+		context->queued--;
+		context->outq_bytes -= entry->mlen;
+
+		outq_ring_remove(context, entry);
+	}
+
 	qb_list_for_each_safe(list, tmp_iter, &(context->outq_head)) {
 		outq_item = qb_list_entry (list, struct outq_item, list);
 
@@ -402,6 +536,7 @@ static void outq_flush (void *data)
 		assert(rc == outq_item->mlen);
 		context->sent++;
 		context->queued--;
+		context->outq_bytes -= outq_item->mlen;
 
 		qb_list_del (list);
 		free (outq_item->msg);
@@ -413,8 +548,28 @@ static void outq_flush (void *data)
 			context->queued, context->sent);
 		context->queued = 0;
 		context->sent = 0;
-	} else {
-		qb_loop_job_add(cs_poll_handle_get(), QB_LOOP_HIGH, conn, outq_flush);
+
+		if (context->outq_over_budget) {
+			context->outq_over_budget = 0;
+			if (ipc_outq_policy == CS_IPCS_OUTQ_POLICY_BACKPRESSURE) {
+				ipc_fc_outq_over_budget--;
+				cs_ipcs_check_for_flow_control();
+			}
+		}
+		return;
+	}
+
+requeue:
+	qb_loop_job_add(cs_poll_handle_get(), QB_LOOP_HIGH, conn, outq_flush);
+}
+
+static void msg_copy (char *write_buf, const struct iovec *iov, uint32_t iov_len)
+{
+	int32_t i;
+
+	for (i = 0; i < iov_len; i++) {
+		memcpy (write_buf, iov[i].iov_base, iov[i].iov_len);
+		write_buf += iov[i].iov_len;
 	}
 }
 
@@ -424,7 +579,7 @@ static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *io
 	int32_t i;
 	int32_t bytes_msg = 0;
 	struct outq_item *outq_item;
-	char *write_buf = 0;
+	struct outq_entry *entry;
 	struct cs_ipcs_conn_context *context = qb_ipcs_context_get(conn);
 
 	for (i = 0; i < iov_len; i++) {
@@ -448,6 +603,49 @@ static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *io
 			return;
 		}
 	}
+
+	if (context->outq_buf == NULL) {
+		context->outq_buf = malloc (ipc_outq_size);
+		context->outq_size = (context->outq_buf != NULL) ? ipc_outq_size : 0;
+		context->outq_used = 0;
+	}
+
+	/*
+	 * Messages already over budget go first, the ring can't take new
+	 * ones before they are sent
+	 */
+	if (qb_list_empty (&context->outq_head)) {
+		entry = outq_ring_reserve (context, bytes_msg);
+		if (entry != NULL) {
+			msg_copy (entry->msg, iov, iov_len);
+			context->queued++;
+			context->outq_bytes += bytes_msg;
+			return;
+		}
+	}
+
+	if (!context->outq_over_budget) {
+		log_printf(LOGSYS_LEVEL_WARNING,
+			"Dispatch queue of %s is over budget (%u messages, %"PRIu64" bytes)",
+			context->proc_name, context->queued, context->outq_bytes);
+		context->outq_over_budget = 1;
+		if (ipc_outq_policy == CS_IPCS_OUTQ_POLICY_BACKPRESSURE) {
+			ipc_fc_outq_over_budget++;
+			cs_ipcs_check_for_flow_control();
+		}
+	}
+
+	switch (ipc_outq_policy) {
+	case CS_IPCS_OUTQ_POLICY_DISCONNECT:
+		qb_ipcs_disconnect(conn);
+		return;
+	case CS_IPCS_OUTQ_POLICY_DROP:
+		context->outq_dropped++;
+		return;
+	case CS_IPCS_OUTQ_POLICY_BACKPRESSURE:
+		break;
+	}
+
 	outq_item = malloc (sizeof (struct outq_item));
 	if (outq_item == NULL) {
 		qb_ipcs_disconnect(conn);
@@ -460,15 +658,12 @@ static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *io
 		return;
 	}
 
-	write_buf = outq_item->msg;
-	for (i = 0; i < iov_len; i++) {
-		memcpy (write_buf, iov[i].iov_base, iov[i].iov_len);
-		write_buf += iov[i].iov_len;
-	}
+	msg_copy (outq_item->msg, iov, iov_len);
 	outq_item->mlen = bytes_msg;
 	qb_list_init (&outq_item->list);
 	qb_list_add_tail (&outq_item->list, &context->outq_head);
 	context->queued++;
+	context->outq_bytes += bytes_msg;
 }
 
 int cs_ipcs_dispatch_send(void *conn, const void *msg, size_t mlen)
@@ -621,7 +816,8 @@ static void cs_ipcs_check_for_flow_control(void)
 			 * now check flow control
 			 */
 			if (ipc_fc_totem_queue_level != TOTEM_Q_LEVEL_CRITICAL &&
-			    ipc_fc_sync_in_process == 0) {
+			    ipc_fc_sync_in_process == 0 &&
+			    ipc_fc_outq_over_budget == 0) {
 				fc_enabled = QB_FALSE;
 			} else if (ipc_fc_totem_queue_level != TOTEM_Q_LEVEL_CRITICAL &&
 			    i == VOTEQUORUM_SERVICE) {
@@ -733,6 +929,7 @@ void cs_ipcs_clear_stats(void)
 			cnx->invalid_request = 0;
 			cnx->overload = 0;
 			cnx->sent = 0;
+			cnx->outq_dropped = 0;
 
 		}
 	}
@@ -815,10 +1012,39 @@ const char *cs_ipcs_service_init(struct corosync_service_engine *service)
 	return NULL;
 }
 
+static void cs_ipcs_outq_config_read(void)
+{
+	uint32_t u32;
+	char *str;
+
+	if (icmap_get_uint32("system.ipc_outq_size", &u32) == CS_OK) {
+		if (u32 < CS_IPCS_OUTQ_SIZE_MIN) {
+			log_printf(LOGSYS_LEVEL_WARNING,
+				"system.ipc_outq_size %u is too small, using %u",
+				u32, CS_IPCS_OUTQ_SIZE_MIN);
+			u32 = CS_IPCS_OUTQ_SIZE_MIN;
+		}
+		ipc_outq_size = u32;
+	}
+
+	if (icmap_get_string("system.ipc_outq_policy", &str) == CS_OK) {
+		if (strcmp(str, "backpressure") == 0) {
+			ipc_outq_policy = CS_IPCS_OUTQ_POLICY_BACKPRESSURE;
+		} else if (strcmp(str, "drop") == 0) {
+			ipc_outq_policy = CS_IPCS_OUTQ_POLICY_DROP;
+		} else if (strcmp(str, "disconnect") == 0) {
+			ipc_outq_policy = CS_IPCS_OUTQ_POLICY_DISCONNECT;
+		}
+		free(str);
+	}
+}
+
 void cs_ipcs_init(void)
 {
 	api = apidef_get ();
 
+	cs_ipcs_outq_config_read();
+
 	qb_loop_poll_low_fds_event_set(cs_poll_handle_get(), cs_ipcs_low_fds_event);
 
 	api->quorum_register_callback (cs_ipcs_fc_quorum_changed, NULL);
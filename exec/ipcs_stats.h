@@ -33,12 +33,20 @@
  */
 
 struct cs_ipcs_conn_context {
-	struct qb_list_head outq_head;
+	struct qb_list_head outq_head; /* messages which didn't fit into outq_buf */
 	int32_t queuing;
 	uint32_t queued;
 	uint64_t invalid_request;
 	uint64_t overload;
 	uint32_t sent;
+	char *outq_buf; /* ring of queued dispatch messages, outq_size bytes */
+	size_t outq_size;
+	size_t outq_used; /* bytes of outq_buf in use, including a skipped tail */
+	size_t outq_read;
+	size_t outq_write;
+	uint64_t outq_bytes; /* message bytes queued in outq_buf and outq_head */
+	uint64_t outq_dropped;
+	int32_t outq_over_budget;
 	char proc_name[32];
 	char data[1];
 };
@@ -496,6 +496,46 @@ static void corosync_mlockall (void)
 }
 
 
+/*
+ * Value at given permille of the histogram
+ */
+static uint64_t totem_histogram_value_at (const totem_histogram_t *histogram, uint64_t permille)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	uint64_t value;
+	unsigned int i;
+
+	if (histogram->count == 0) {
+		return (0);
+	}
+
+	target = (histogram->count * permille + 999) / 1000;
+	if (target == 0) {
+		target = 1;
+	}
+
+	for (i = 0; i < TOTEM_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->bucket[i];
+		if (seen >= target) {
+			value = totem_histogram_bucket_value (i);
+			return (value < histogram->max ? value : histogram->max);
+		}
+	}
+
+	return (histogram->max);
+}
+
+static void totem_histogram_summary_update (
+	const totem_histogram_t *histogram,
+	totem_histogram_summary_t *summary)
+{
+	summary->p50 = totem_histogram_value_at (histogram, 500);
+	summary->p99 = totem_histogram_value_at (histogram, 990);
+	summary->p999 = totem_histogram_value_at (histogram, 999);
+	summary->max = histogram->max;
+}
+
 static void corosync_totem_stats_updater (void *data)
 {
 	totempg_stats_t * stats;
@@ -561,11 +601,22 @@ static void corosync_totem_stats_updater (void *data)
 		stats->srp->avg_backlog_calc = (total_backlog_calc / token_count);
 	}
 
+	totem_histogram_summary_update (&stats->srp->token_rotation_histogram, &stats->srp->token_rotation);
+	totem_histogram_summary_update (&stats->srp->token_hold_histogram, &stats->srp->token_hold);
+	totem_histogram_summary_update (&stats->srp->token_retransmits_histogram, &stats->srp->token_retransmits);
+	totem_histogram_summary_update (&stats->srp->token_delivered_histogram, &stats->srp->token_delivered);
+
 	stats->srp->time_since_token_last_received = qb_util_nano_current_get () / QB_TIME_NS_IN_MSEC -
 		stats->srp->token[stats->srp->latest_token].rx;
 
 	stats_trigger_trackers();
 
+	/*
+	 * Trackers of service message counters are called at most once per
+	 * stats period
+	 */
+	icmap_counter_notify();
+
 	api->timer_add_duration (1500 * MILLI_2_NANO_SECONDS, NULL,
 		corosync_totem_stats_updater,
 		&corosync_stats_timer_handle);
@@ -612,7 +663,7 @@ static void deliver_fn (
 		return;
 	}
 
-	icmap_fast_inc(service_stats_rx[service][fn_id]);
+	icmap_counter_inc(service_stats_rx[service][fn_id]);
 
 	if (endian_conversion_required) {
 		assert(corosync_service[service]->exec_engine[fn_id].exec_endian_convert_fn != NULL);
@@ -637,7 +688,7 @@ int main_mcast (
 	fn_id = req->id & 0xffff;
 
 	if (corosync_service[service]) {
-		icmap_fast_inc(service_stats_tx[service][fn_id]);
+		icmap_counter_inc(service_stats_tx[service][fn_id]);
 	}
 
 	return (totempg_groups_mcast_joined (corosync_group_handle, iovec, iov_len, guarantee));
@@ -1069,6 +1120,7 @@ static void set_icmap_ro_keys_flag (void)
 	icmap_set_ro_access("totem.transport", CS_FALSE, CS_TRUE);
 	icmap_set_ro_access("totem.cluster_name", CS_FALSE, CS_TRUE);
 	icmap_set_ro_access("totem.netmtu", CS_FALSE, CS_TRUE);
+	icmap_set_ro_access("totem.udp_recv_batch", CS_FALSE, CS_TRUE);
 	icmap_set_ro_access("totem.threads", CS_FALSE, CS_TRUE);
 	icmap_set_ro_access("totem.version", CS_FALSE, CS_TRUE);
 	icmap_set_ro_access("totem.nodeid", CS_FALSE, CS_TRUE);
@@ -92,6 +92,12 @@ extern void corosync_sending_allowed_release (void *sending_allowed_private_data
 
 extern void corosync_recheck_the_q_level(void *data);
 
+/*
+ * Smallest system.ipc_outq_size, so the ring holds at least one dispatch
+ * message of the largest size a library reads
+ */
+#define CS_IPCS_OUTQ_SIZE_MIN		(1024 * 1024)
+
 extern void cs_ipcs_init(void);
 
 extern const char *cs_ipcs_service_init(struct corosync_service_engine *service);
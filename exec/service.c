@@ -109,8 +109,8 @@ struct seus_handler_data {
 
 struct corosync_service_engine *corosync_service[SERVICES_COUNT_MAX];
 
-const char *service_stats_rx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
-const char *service_stats_tx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
+icmap_counter_t service_stats_rx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
+icmap_counter_t service_stats_tx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
 
 static void (*service_unlink_all_complete) (void) = NULL;
 
@@ -163,11 +163,17 @@ char *corosync_service_link_and_init (
 	for (fn = 0; fn < service_engine->exec_engine_count; fn++) {
 		snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "runtime.services.%s.%d.tx", name_sufix, fn);
 		icmap_set_uint64(key_name, 0);
-		service_stats_tx[service_engine->id][fn] = strdup(key_name);
+		if (icmap_counter_create(key_name, &service_stats_tx[service_engine->id][fn]) != CS_OK) {
+			log_printf (LOGSYS_LEVEL_WARNING, "Can't create counter for %s", key_name);
+			service_stats_tx[service_engine->id][fn] = NULL;
+		}
 
 		snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "runtime.services.%s.%d.rx", name_sufix, fn);
 		icmap_set_uint64(key_name, 0);
-		service_stats_rx[service_engine->id][fn] = strdup(key_name);
+		if (icmap_counter_create(key_name, &service_stats_rx[service_engine->id][fn]) != CS_OK) {
+			log_printf (LOGSYS_LEVEL_WARNING, "Can't create counter for %s", key_name);
+			service_stats_rx[service_engine->id][fn] = NULL;
+		}
 	}
 
 	log_printf (LOGSYS_LEVEL_NOTICE,
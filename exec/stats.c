@@ -71,9 +71,26 @@ static unsigned int highest_schedmiss_event;
 
 #define SCHEDMISS_PREFIX "stats.schedmiss"
 
+/*
+ * While a snapshot is in progress, structures fetched for one key are reused
+ * for the following keys of the same knet link or IPC connection. Keys come
+ * sorted from the trie, so these are next to each other.
+ */
+static struct {
+	int active;
+	char knet_key[ICMAP_KEYNAME_MAXLEN];
+	size_t knet_key_len; /* 0 when link_status is not valid */
+	struct knet_link_status link_status;
+	char ipcs_key[ICMAP_KEYNAME_MAXLEN];
+	size_t ipcs_key_len; /* 0 when ipcs_conn_stats is not valid */
+	struct ipcs_conn_stats ipcs_conn_stats;
+	int knet_handle_valid;
+	struct knet_handle_stats knet_handle_stats;
+} stats_snapshot;
+
 /* Convert iterator number to text and a stats pointer */
 struct cs_stats_conv {
-	enum {STAT_PG, STAT_SRP, STAT_KNET, STAT_KNET_HANDLE, STAT_IPCSC, STAT_IPCSG, STAT_SCHEDMISS} type;
+	enum {STAT_PG, STAT_SRP, STAT_SRP_TOKEN_SAMPLES, STAT_KNET, STAT_KNET_HANDLE, STAT_IPCSC, STAT_IPCSG, STAT_SCHEDMISS} type;
 	const char *name;
 	const size_t offset;
 	const icmap_value_types_t value_type;
@@ -114,6 +131,30 @@ struct cs_stats_conv cs_srp_stats[] = {
 	{ STAT_SRP, "mtt_rx_token",           offsetof(totemsrp_stats_t, mtt_rx_token),           ICMAP_VALUETYPE_UINT32},
 	{ STAT_SRP, "avg_token_workload",     offsetof(totemsrp_stats_t, avg_token_workload),     ICMAP_VALUETYPE_UINT32},
 	{ STAT_SRP, "avg_backlog_calc",       offsetof(totemsrp_stats_t, avg_backlog_calc),       ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "frame_pool_small_frames", offsetof(totemsrp_stats_t, frame_pool_small_frames), ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "frame_pool_small_free",  offsetof(totemsrp_stats_t, frame_pool_small_free),  ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "frame_pool_full_frames", offsetof(totemsrp_stats_t, frame_pool_full_frames), ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "frame_pool_full_free",   offsetof(totemsrp_stats_t, frame_pool_full_free),   ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "frame_pool_fallback",    offsetof(totemsrp_stats_t, frame_pool_fallback),    ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "fcc_window",             offsetof(totemsrp_stats_t, fcc_window),             ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "fcc_window_decreases",   offsetof(totemsrp_stats_t, fcc_window_decreases),   ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_rotation.p50",    offsetof(totemsrp_stats_t, token_rotation.p50),       ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_rotation.p99",    offsetof(totemsrp_stats_t, token_rotation.p99),       ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_rotation.p999",   offsetof(totemsrp_stats_t, token_rotation.p999),      ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_rotation.max",    offsetof(totemsrp_stats_t, token_rotation.max),       ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_hold.p50",        offsetof(totemsrp_stats_t, token_hold.p50),           ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_hold.p99",        offsetof(totemsrp_stats_t, token_hold.p99),           ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_hold.p999",       offsetof(totemsrp_stats_t, token_hold.p999),          ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_hold.max",        offsetof(totemsrp_stats_t, token_hold.max),           ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_retransmits.p50", offsetof(totemsrp_stats_t, token_retransmits.p50),    ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_retransmits.p99", offsetof(totemsrp_stats_t, token_retransmits.p99),    ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_retransmits.p999", offsetof(totemsrp_stats_t, token_retransmits.p999),   ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_retransmits.max", offsetof(totemsrp_stats_t, token_retransmits.max),    ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_delivered.p50",   offsetof(totemsrp_stats_t, token_delivered.p50),      ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_delivered.p99",   offsetof(totemsrp_stats_t, token_delivered.p99),      ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_delivered.p999",  offsetof(totemsrp_stats_t, token_delivered.p999),     ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "token_delivered.max",   offsetof(totemsrp_stats_t, token_delivered.max),      ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP_TOKEN_SAMPLES, "token_samples", 0,                                             ICMAP_VALUETYPE_BINARY},
 };
 
 struct cs_stats_conv cs_knet_stats[] = {
@@ -185,6 +226,8 @@ struct cs_stats_conv cs_knet_handle_stats[] = {
 struct cs_stats_conv cs_ipcs_conn_stats[] = {
 	{ STAT_IPCSC, "queueing",        offsetof(struct ipcs_conn_stats, cnx.queuing),          ICMAP_VALUETYPE_INT32},
 	{ STAT_IPCSC, "queued",          offsetof(struct ipcs_conn_stats, cnx.queued),           ICMAP_VALUETYPE_UINT32},
+	{ STAT_IPCSC, "queued_bytes",    offsetof(struct ipcs_conn_stats, cnx.outq_bytes),       ICMAP_VALUETYPE_UINT64},
+	{ STAT_IPCSC, "dropped",         offsetof(struct ipcs_conn_stats, cnx.outq_dropped),     ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "invalid_request", offsetof(struct ipcs_conn_stats, cnx.invalid_request),  ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "overload",        offsetof(struct ipcs_conn_stats, cnx.overload),         ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "sent",            offsetof(struct ipcs_conn_stats, cnx.sent),             ICMAP_VALUETYPE_UINT32},
@@ -254,6 +297,97 @@ static void stats_map_set_value(struct cs_stats_conv *conv,
 	}
 }
 
+/*
+ * Raw samples of the last tokens (stats.srp.token_samples), oldest first.
+ * Every sample is SRP_TOKEN_SAMPLE_FIELDS host endian uint64_t values:
+ * rx and tx time in ms, backlog, messages retransmitted on the token and
+ * messages delivered until the next token.
+ */
+#define SRP_TOKEN_SAMPLE_FIELDS 5
+
+static cs_error_t stats_srp_token_samples_get(const totemsrp_stats_t *srp,
+					      void *value,
+					      size_t *value_len,
+					      icmap_value_types_t *type)
+{
+	uint64_t sample[SRP_TOKEN_SAMPLE_FIELDS];
+	size_t samples = 0;
+	size_t needed;
+	char *dst;
+	int t;
+
+	for (t = srp->earliest_token; t != srp->latest_token; t = (t + 1) % TOTEM_TOKEN_STATS_MAX) {
+		samples++;
+	}
+	needed = samples * sizeof(sample);
+
+	if (type) {
+		*type = ICMAP_VALUETYPE_BINARY;
+	}
+
+	if (value == NULL) {
+		if (value_len) {
+			*value_len = needed;
+		}
+		return CS_OK;
+	}
+
+	if (value_len == NULL || *value_len < needed) {
+		return CS_ERR_INVALID_PARAM;
+	}
+
+	dst = value;
+	for (t = srp->earliest_token; t != srp->latest_token; ) {
+		t = (t + 1) % TOTEM_TOKEN_STATS_MAX;
+
+		sample[0] = srp->token[t].rx;
+		sample[1] = srp->token[t].tx;
+		sample[2] = srp->token[t].backlog_calc;
+		sample[3] = srp->token[t].retransmits;
+		sample[4] = srp->token[t].delivered;
+		memcpy(dst, sample, sizeof(sample));
+		dst += sizeof(sample);
+	}
+	*value_len = needed;
+
+	return CS_OK;
+}
+
+/*
+ * Key name without the last (field) component matches cached key
+ */
+static int stats_snapshot_key_cached(const char *key_name, const char *cached_key, size_t cached_key_len)
+{
+	const char *dot = strrchr(key_name, '.');
+
+	return (cached_key_len > 0 && dot != NULL && (size_t)(dot - key_name) == cached_key_len &&
+	    memcmp(key_name, cached_key, cached_key_len) == 0);
+}
+
+static void stats_snapshot_key_store(const char *key_name, char *cached_key, size_t *cached_key_len)
+{
+	const char *dot = strrchr(key_name, '.');
+
+	if (dot == NULL) {
+		*cached_key_len = 0;
+		return ;
+	}
+
+	*cached_key_len = dot - key_name;
+	memcpy(cached_key, key_name, *cached_key_len);
+}
+
+void stats_map_snapshot_begin(void)
+{
+	memset(&stats_snapshot, 0, sizeof(stats_snapshot));
+	stats_snapshot.active = 1;
+}
+
+void stats_map_snapshot_end(void)
+{
+	stats_snapshot.active = 0;
+}
+
 static void stats_add_entry(const char *key, struct cs_stats_conv *cs_conv)
 {
 	struct stats_item *item = malloc(sizeof(struct stats_item));
@@ -358,14 +492,30 @@ cs_error_t stats_map_get(const char *key_name,
 			pg_stats = api->totem_get_stats();
 			stats_map_set_value(statinfo, pg_stats->srp, value, value_len, type);
 			break;
+		case STAT_SRP_TOKEN_SAMPLES:
+			pg_stats = api->totem_get_stats();
+			return stats_srp_token_samples_get(pg_stats->srp, value, value_len, type);
 		case STAT_KNET_HANDLE:
+			if (stats_snapshot.active && stats_snapshot.knet_handle_valid) {
+				stats_map_set_value(statinfo, &stats_snapshot.knet_handle_stats, value, value_len, type);
+				break;
+			}
 			res = totemknet_handle_get_stats(&knet_handle_stats);
 			if (res != CS_OK) {
 				return res;
 			}
 			stats_map_set_value(statinfo, &knet_handle_stats, value, value_len, type);
+			if (stats_snapshot.active) {
+				memcpy(&stats_snapshot.knet_handle_stats, &knet_handle_stats, sizeof(knet_handle_stats));
+				stats_snapshot.knet_handle_valid = 1;
+			}
 			break;
 		case STAT_KNET:
+			if (stats_snapshot.active &&
+			    stats_snapshot_key_cached(key_name, stats_snapshot.knet_key, stats_snapshot.knet_key_len)) {
+				stats_map_set_value(statinfo, &stats_snapshot.link_status, value, value_len, type);
+				break;
+			}
 			if (sscanf(key_name, "stats.knet.node%d.link%d", &nodeid, &link_no) != 2) {
 				return CS_ERR_NOT_EXIST;
 			}
@@ -382,8 +532,17 @@ cs_error_t stats_map_get(const char *key_name,
 				return CS_ERR_LIBRARY;
 			}
 			stats_map_set_value(statinfo, &link_status, value, value_len, type);
+			if (stats_snapshot.active) {
+				memcpy(&stats_snapshot.link_status, &link_status, sizeof(link_status));
+				stats_snapshot_key_store(key_name, stats_snapshot.knet_key, &stats_snapshot.knet_key_len);
+			}
 			break;
 		case STAT_IPCSC:
+			if (stats_snapshot.active &&
+			    stats_snapshot_key_cached(key_name, stats_snapshot.ipcs_key, stats_snapshot.ipcs_key_len)) {
+				stats_map_set_value(statinfo, &stats_snapshot.ipcs_conn_stats, value, value_len, type);
+				break;
+			}
 			if (sscanf(key_name, "stats.ipcs.service%d.%d.%p", &service_id, &pid, &conn_ptr) != 3) {
 				return CS_ERR_NOT_EXIST;
 			}
@@ -392,6 +551,10 @@ cs_error_t stats_map_get(const char *key_name,
 				return res;
 			}
 			stats_map_set_value(statinfo, &ipcs_conn_stats, value, value_len, type);
+			if (stats_snapshot.active) {
+				memcpy(&stats_snapshot.ipcs_conn_stats, &ipcs_conn_stats, sizeof(ipcs_conn_stats));
+				stats_snapshot_key_store(key_name, stats_snapshot.ipcs_key, &stats_snapshot.ipcs_key_len);
+			}
 			break;
 		case STAT_IPCSG:
 			cs_ipcs_get_global_stats(&ipcs_global_stats);
@@ -547,6 +710,10 @@ const char *stats_map_iter_next(icmap_iter_t iter, size_t *value_len, icmap_valu
 	if (res == NULL) {
 		return (res);
 	}
+	if (item->cs_conv->type == STAT_SRP_TOKEN_SAMPLES) {
+		(void)stats_map_get(res, NULL, value_len, type);
+		return res;
+	}
 	stats_map_set_value(item->cs_conv, NULL, NULL, value_len, type);
 
 	return res;
@@ -576,6 +743,7 @@ void stats_trigger_trackers(void)
 			continue;
 		}
 
+		value_len = sizeof(value);
 		res = stats_map_get(tracker->key_name,
 				    &value, &value_len, &type);
 
@@ -613,6 +781,7 @@ static void stats_map_notify_fn(uint32_t event, char *key, void *old_value, void
 	}
 
 	new_val.data = new_value;
+	new_val.len = sizeof(new_value);
 	if (stats_map_get(key,
 			  &new_value,
 			  &new_val.len,
@@ -667,6 +836,7 @@ cs_error_t stats_map_track_add(const char *key_name,
 			return CS_ERR_NO_MEMORY;
 		}
 		/* Get initial value */
+		value_len = sizeof(tracker->old_value);
 		if (stats_map_get(tracker->key_name,
 				  &tracker->old_value, &value_len, &type) != CS_OK) {
 			tracker->old_value = 0ULL;
@@ -54,6 +54,9 @@ icmap_iter_t stats_map_iter_init(const char *prefix);
 const char *stats_map_iter_next(icmap_iter_t iter, size_t *value_len, icmap_value_types_t *type);
 void stats_map_iter_finalize(icmap_iter_t iter);
 
+void stats_map_snapshot_begin(void);
+void stats_map_snapshot_end(void);
+
 cs_error_t stats_map_track_add(const char *key_name,
 			 int32_t track_type,
 			 icmap_notify_fn_t notify_fn,
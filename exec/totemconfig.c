@@ -82,8 +82,10 @@
 #define MISS_COUNT_CONST			5
 #define BLOCK_UNLISTED_IPS			1
 #define CANCEL_TOKEN_HOLD_ON_RETRANSMIT		0
+#define WINDOW_ADAPTIVE				0
 /* This constant is not used for knet */
 #define UDP_NETMTU                              1500
+#define UDP_RECV_BATCH                          8
 
 /* Currently all but PONG_COUNT match the defaults in libknet.h */
 #define KNET_PING_INTERVAL                      1000
@@ -150,6 +152,8 @@ static void *totem_get_param_by_name(struct totem_config *totem_config, const ch
 		return &totem_config->block_unlisted_ips;
 	if (strcmp(param_name, "totem.cancel_token_hold_on_retransmit") == 0)
 		return &totem_config->cancel_token_hold_on_retransmit;
+	if (strcmp(param_name, "totem.window_adaptive") == 0)
+		return &totem_config->window_adaptive;
 
 	return NULL;
 }
@@ -375,6 +379,9 @@ void totem_volatile_config_read (struct totem_config *totem_config, icmap_map_t
 
 	totem_volatile_config_set_boolean_value(totem_config, temp_map, "totem.cancel_token_hold_on_retransmit",
 	    deleted_key, CANCEL_TOKEN_HOLD_ON_RETRANSMIT);
+
+	totem_volatile_config_set_boolean_value(totem_config, temp_map, "totem.window_adaptive",
+	    deleted_key, WINDOW_ADAPTIVE);
 }
 
 int totem_volatile_config_validate (
@@ -1876,6 +1883,9 @@ extern int totem_config_read (
 
 	icmap_get_uint32("totem.netmtu", &totem_config->net_mtu);
 
+	totem_config->udp_recv_batch = UDP_RECV_BATCH;
+	icmap_get_uint32("totem.udp_recv_batch", &totem_config->udp_recv_batch);
+
 	totem_config->ip_version = totem_config_get_ip_version(totem_config);
 
 	if (icmap_get_string("totem.interface.0.bindnetaddr", &str) != CS_OK) {
@@ -2162,6 +2172,14 @@ int totem_config_validate (
 		goto parse_error;
 	}
 
+	if (totem_config->udp_recv_batch < 1 ||
+	    totem_config->udp_recv_batch > UDP_RECV_BATCH_MAX) {
+		snprintf (parse_error, sizeof(parse_error),
+			  "udp_recv_batch must be between 1 and %u.", UDP_RECV_BATCH_MAX);
+		error_reason = parse_error;
+		goto parse_error;
+	}
+
 	/* Only knet allows crypto */
 	if (totem_config->transport_number != TOTEM_TRANSPORT_KNET) {
 		if ((strcmp(totem_config->crypto_cipher_type, "none") != 0) ||
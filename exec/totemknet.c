@@ -147,7 +147,13 @@ struct totemknet_instance {
 
 	void *knet_context;
 
-	char iov_buffer[KNET_MAX_PACKET_SIZE + 1];
+	char iov_buffer_storage[KNET_MAX_PACKET_SIZE + 1];
+
+	/*
+	 * Current receive buffer, either iov_buffer_storage or a frame handed
+	 * over by totemnet (at least TOTEMKNET_BUFFER_SIZE bytes)
+	 */
+	char *iov_buffer;
 
 	char *link_status[INTERFACE_MAX];
 
@@ -215,6 +221,7 @@ static void totemknet_instance_initialize (struct totemknet_instance *instance)
 	int res;
 
 	memset (instance, 0, sizeof (struct totemknet_instance));
+	instance->iov_buffer = instance->iov_buffer_storage;
 	res = pthread_mutex_init(&instance->log_mutex, NULL);
 	/*
 	 * There is not too much else what can be done.
@@ -1401,8 +1408,7 @@ exit_error:
 
 void *totemknet_buffer_alloc (void)
 {
-	/* Need to have space for a message AND a struct mcast in case of encapsulated messages */
-	return malloc(KNET_MAX_PACKET_SIZE + 512);
+	return malloc(TOTEMKNET_BUFFER_SIZE);
 }
 
 void totemknet_buffer_release (void *ptr)
@@ -1410,6 +1416,21 @@ void totemknet_buffer_release (void *ptr)
 	return free (ptr);
 }
 
+int totemknet_recv_buffer_set (
+	void *knet_context,
+	void *buffer)
+{
+	struct totemknet_instance *instance = (struct totemknet_instance *)knet_context;
+
+	if (buffer == NULL) {
+		instance->iov_buffer = instance->iov_buffer_storage;
+	} else {
+		instance->iov_buffer = buffer;
+	}
+
+	return (0);
+}
+
 int totemknet_processor_count_set (
 	void *knet_context,
 	int processor_count)
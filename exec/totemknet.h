@@ -41,6 +41,11 @@
 
 #include <corosync/totem/totem.h>
 
+/*
+ * Need to have space for a message AND a struct mcast in case of encapsulated messages
+ */
+#define TOTEMKNET_BUFFER_SIZE	(KNET_MAX_PACKET_SIZE + 512)
+
 /**
  * Create an instance
  */
@@ -73,6 +78,10 @@ extern void *totemknet_buffer_alloc (void);
 
 extern void totemknet_buffer_release (void *ptr);
 
+extern int totemknet_recv_buffer_set (
+	void *knet_context,
+	void *buffer);
+
 extern int totemknet_processor_count_set (
 	void *knet_context,
 	int processor_count);
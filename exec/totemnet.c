@@ -36,6 +36,9 @@
 #include <config.h>
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <totemudp.h>
 #include <totemudpu.h>
@@ -78,6 +81,8 @@ struct transport {
 
 	void (*buffer_release) (void *ptr);
 
+	size_t buffer_size;
+
 	int (*processor_count_set) (
 		void *transport_context,
 		int processor_count);
@@ -132,6 +137,10 @@ struct transport {
 	int (*recv_mcast_empty) (
 		void *transport_context);
 
+	int (*recv_buffer_set) (
+		void *transport_context,
+		void *buffer);
+
 	int (*iface_set) (
 		void *transport_context,
 		const struct totem_ip_address *local,
@@ -173,6 +182,7 @@ struct transport transport_entries[] = {
 		.initialize = totemudp_initialize,
 		.buffer_alloc = totemudp_buffer_alloc,
 		.buffer_release = totemudp_buffer_release,
+		.buffer_size = FRAME_SIZE_MAX,
 		.processor_count_set = totemudp_processor_count_set,
 		.token_send = totemudp_token_send,
 		.mcast_flush_send = totemudp_mcast_flush_send,
@@ -198,6 +208,7 @@ struct transport transport_entries[] = {
 		.initialize = totemudpu_initialize,
 		.buffer_alloc = totemudpu_buffer_alloc,
 		.buffer_release = totemudpu_buffer_release,
+		.buffer_size = FRAME_SIZE_MAX,
 		.processor_count_set = totemudpu_processor_count_set,
 		.token_send = totemudpu_token_send,
 		.mcast_flush_send = totemudpu_mcast_flush_send,
@@ -223,6 +234,7 @@ struct transport transport_entries[] = {
 		.initialize = totemknet_initialize,
 		.buffer_alloc = totemknet_buffer_alloc,
 		.buffer_release = totemknet_buffer_release,
+		.buffer_size = TOTEMKNET_BUFFER_SIZE,
 		.processor_count_set = totemknet_processor_count_set,
 		.token_send = totemknet_token_send,
 		.mcast_flush_send = totemknet_mcast_flush_send,
@@ -241,15 +253,52 @@ struct transport transport_entries[] = {
 		.member_add = totemknet_member_add,
 		.member_remove = totemknet_member_remove,
 		.reconfigure = totemknet_reconfigure,
+		.recv_buffer_set = totemknet_recv_buffer_set,
 		.crypto_reconfigure_phase = totemknet_crypto_reconfigure_phase,
 		.stats_clear = totemknet_stats_clear
 	}
 };
 
+/*
+ * Frames up to this size (a full frame on a standard 1500 byte MTU plus
+ * headroom for encapsulation) are served from the small frame class
+ */
+#define FRAME_POOL_SMALL_FRAME_SIZE	2048
+
+/*
+ * Number of small frames preallocated for every full sized frame
+ */
+#define FRAME_POOL_SMALL_FRAMES_RATIO	4
+
+enum frame_pool_class_type {
+	FRAME_POOL_CLASS_SMALL,
+	FRAME_POOL_CLASS_FULL,
+	FRAME_POOL_CLASS_MAX
+};
+
+struct frame_pool_class {
+	char *slab;
+	size_t frame_size;
+	unsigned int frame_count;
+	unsigned int free_count;
+	unsigned int *free_stack;
+	unsigned int *frame_refcount;
+};
+
 struct totemnet_instance {
 	void *transport_context;
 
 	struct transport *transport;
+
+	totemsrp_stats_t *stats;
+
+	struct frame_pool_class frame_pool[FRAME_POOL_CLASS_MAX];
+
+	/*
+	 * Full sized pool frame the transport currently receives into
+	 */
+	char *recv_frame;
+
         void (*totemnet_log_printf) (
                 int level,
 		int subsys,
@@ -289,6 +338,79 @@ static void totemnet_instance_initialize (
 	instance->transport = &transport_entries[transport];
 }
 
+static void frame_pool_stats_update (struct totemnet_instance *instance)
+{
+	instance->stats->frame_pool_small_frames = instance->frame_pool[FRAME_POOL_CLASS_SMALL].frame_count;
+	instance->stats->frame_pool_small_free = instance->frame_pool[FRAME_POOL_CLASS_SMALL].free_count;
+	instance->stats->frame_pool_full_frames = instance->frame_pool[FRAME_POOL_CLASS_FULL].frame_count;
+	instance->stats->frame_pool_full_free = instance->frame_pool[FRAME_POOL_CLASS_FULL].free_count;
+}
+
+static void frame_pool_free (struct totemnet_instance *instance)
+{
+	int i;
+
+	if (instance->recv_frame != NULL) {
+		instance->transport->recv_buffer_set (instance->transport_context, NULL);
+		instance->recv_frame = NULL;
+	}
+
+	for (i = 0; i < FRAME_POOL_CLASS_MAX; i++) {
+		free (instance->frame_pool[i].slab);
+		free (instance->frame_pool[i].free_stack);
+		free (instance->frame_pool[i].frame_refcount);
+		memset (&instance->frame_pool[i], 0, sizeof (struct frame_pool_class));
+	}
+	frame_pool_stats_update (instance);
+}
+
+static char *frame_pool_class_alloc (
+	struct totemnet_instance *instance,
+	struct frame_pool_class *pool_class)
+{
+	unsigned int frame;
+
+	if (pool_class->free_count == 0) {
+		return (NULL);
+	}
+
+	pool_class->free_count--;
+	frame = pool_class->free_stack[pool_class->free_count];
+	assert (pool_class->frame_refcount[frame] == 0);
+	pool_class->frame_refcount[frame] = 1;
+	frame_pool_stats_update (instance);
+
+	return (pool_class->slab + (size_t)frame * pool_class->frame_size);
+}
+
+/*
+ * Find the pool frame ptr points into.  ptr doesn't have to point to the
+ * start of the frame, as encapsulated and adopted messages live at an
+ * offset within their frame.
+ */
+static struct frame_pool_class *frame_pool_lookup (
+	struct totemnet_instance *instance,
+	const void *ptr,
+	unsigned int *frame)
+{
+	struct frame_pool_class *pool_class;
+	int i;
+
+	for (i = 0; i < FRAME_POOL_CLASS_MAX; i++) {
+		pool_class = &instance->frame_pool[i];
+		if (pool_class->slab == NULL ||
+		    (const char *)ptr < pool_class->slab ||
+		    (const char *)ptr >= pool_class->slab + (size_t)pool_class->frame_count * pool_class->frame_size) {
+			continue;
+		}
+
+		*frame = ((const char *)ptr - pool_class->slab) / pool_class->frame_size;
+		return (pool_class);
+	}
+
+	return (NULL);
+}
+
 int totemnet_crypto_set (
 	void *net_context,
 	const char *cipher_type,
@@ -309,8 +431,18 @@ int totemnet_finalize (
 	struct totemnet_instance *instance = (struct totemnet_instance *)net_context;
 	int res = 0;
 
+	/*
+	 * Hand the transport its own receive buffer back before the pool goes away
+	 */
+	if (instance->recv_frame != NULL) {
+		instance->transport->recv_buffer_set (instance->transport_context, NULL);
+		instance->recv_frame = NULL;
+	}
+
 	res = instance->transport->finalize (instance->transport_context);
 
+	frame_pool_free (instance);
+
 	return (res);
 }
 
@@ -347,6 +479,8 @@ int totemnet_initialize (
 		return (-1);
 	}
 	totemnet_instance_initialize (instance, totem_config);
+	instance->stats = stats;
+	memset (instance->frame_pool, 0, sizeof (instance->frame_pool));
 
 	res = instance->transport->initialize (loop_pt,
 		&instance->transport_context, totem_config, stats,
@@ -364,20 +498,177 @@ error_destroy:
 	return (-1);
 }
 
-void *totemnet_buffer_alloc (void *net_context)
+void *totemnet_buffer_alloc (void *net_context, size_t size)
 {
 	struct totemnet_instance *instance = net_context;
+	char *frame;
+	int i;
+
 	assert (instance != NULL);
 	assert (instance->transport != NULL);
+
+	/*
+	 * Try the next (larger) class before giving up
+	 */
+	for (i = 0; i < FRAME_POOL_CLASS_MAX; i++) {
+		if (size > instance->frame_pool[i].frame_size) {
+			continue;
+		}
+		frame = frame_pool_class_alloc (instance, &instance->frame_pool[i]);
+		if (frame != NULL) {
+			return (frame);
+		}
+	}
+
+	instance->stats->frame_pool_fallback++;
 	return instance->transport->buffer_alloc();
 }
 
+int totemnet_buffer_ref (void *net_context, const void *ptr)
+{
+	struct totemnet_instance *instance = net_context;
+	struct frame_pool_class *pool_class;
+	unsigned int frame;
+
+	assert (instance != NULL);
+
+	pool_class = frame_pool_lookup (instance, ptr, &frame);
+	if (pool_class == NULL) {
+		/*
+		 * Frames allocated outside of the pool can't be shared
+		 */
+		return (-1);
+	}
+
+	assert (pool_class->frame_refcount[frame] > 0);
+	pool_class->frame_refcount[frame]++;
+	return (0);
+}
+
 void totemnet_buffer_release (void *net_context, void *ptr)
 {
 	struct totemnet_instance *instance = net_context;
+	struct frame_pool_class *pool_class;
+	unsigned int frame;
+
 	assert (instance != NULL);
 	assert (instance->transport != NULL);
-	instance->transport->buffer_release (ptr);
+
+	pool_class = frame_pool_lookup (instance, ptr, &frame);
+	if (pool_class == NULL) {
+		instance->transport->buffer_release (ptr);
+		return;
+	}
+
+	assert (pool_class->frame_refcount[frame] > 0);
+	pool_class->frame_refcount[frame]--;
+	if (pool_class->frame_refcount[frame] == 0) {
+		pool_class->free_stack[pool_class->free_count] = frame;
+		pool_class->free_count++;
+		frame_pool_stats_update (instance);
+	}
+}
+
+int totemnet_recv_buffer_adopt (
+	void *net_context,
+	const void *msg,
+	size_t msg_len)
+{
+	struct totemnet_instance *instance = (struct totemnet_instance *)net_context;
+	struct frame_pool_class *pool_class = &instance->frame_pool[FRAME_POOL_CLASS_FULL];
+	char *replacement;
+
+	/*
+	 * Copying small messages into a small frame is cheaper than
+	 * pinning a full sized frame for them
+	 */
+	if (instance->recv_frame == NULL || msg_len <= FRAME_POOL_SMALL_FRAME_SIZE ||
+	    (const char *)msg < instance->recv_frame ||
+	    (const char *)msg + msg_len > instance->recv_frame + pool_class->frame_size) {
+		return (-1);
+	}
+
+	replacement = frame_pool_class_alloc (instance, pool_class);
+	if (replacement == NULL) {
+		return (-1);
+	}
+
+	/*
+	 * Reference held by the transport is handed over to the caller
+	 */
+	instance->transport->recv_buffer_set (instance->transport_context, replacement);
+	instance->recv_frame = replacement;
+
+	return (0);
+}
+
+int totemnet_frame_pool_init (
+	void *net_context,
+	unsigned int frame_count)
+{
+	struct totemnet_instance *instance = (struct totemnet_instance *)net_context;
+	struct frame_pool_class *pool_class;
+	unsigned int i;
+	int class_no;
+
+	frame_pool_free (instance);
+
+	instance->frame_pool[FRAME_POOL_CLASS_SMALL].frame_size = FRAME_POOL_SMALL_FRAME_SIZE;
+	instance->frame_pool[FRAME_POOL_CLASS_SMALL].frame_count = frame_count * FRAME_POOL_SMALL_FRAMES_RATIO;
+	instance->frame_pool[FRAME_POOL_CLASS_FULL].frame_size = instance->transport->buffer_size;
+	instance->frame_pool[FRAME_POOL_CLASS_FULL].frame_count = frame_count;
+
+	for (class_no = 0; class_no < FRAME_POOL_CLASS_MAX; class_no++) {
+		pool_class = &instance->frame_pool[class_no];
+
+		/*
+		 * Slab is not touched here so only frames which are
+		 * really used are backed by memory
+		 */
+		pool_class->slab = malloc ((size_t)pool_class->frame_count * pool_class->frame_size);
+		pool_class->free_stack = malloc (pool_class->frame_count * sizeof (unsigned int));
+		pool_class->frame_refcount = calloc (pool_class->frame_count, sizeof (unsigned int));
+		if (pool_class->slab == NULL || pool_class->free_stack == NULL ||
+		    pool_class->frame_refcount == NULL) {
+			log_printf (LOGSYS_LEVEL_WARNING,
+				"Unable to allocate frame pool of %u frames, using malloc for every frame",
+				frame_count);
+			frame_pool_free (instance);
+			return (-1);
+		}
+
+		/*
+		 * Free stack is LIFO, lowest frames are handed out first
+		 */
+		for (i = 0; i < pool_class->frame_count; i++) {
+			pool_class->free_stack[i] = pool_class->frame_count - i - 1;
+		}
+		pool_class->free_count = pool_class->frame_count;
+	}
+
+	/*
+	 * Let the transport receive straight into a pool frame so received
+	 * messages can be adopted by the sort queue without a copy
+	 */
+	if (instance->transport->recv_buffer_set != NULL) {
+		instance->recv_frame = frame_pool_class_alloc (instance,
+			&instance->frame_pool[FRAME_POOL_CLASS_FULL]);
+		if (instance->recv_frame != NULL) {
+			instance->transport->recv_buffer_set (instance->transport_context,
+				instance->recv_frame);
+		}
+	}
+
+	frame_pool_stats_update (instance);
+
+	log_printf (LOGSYS_LEVEL_DEBUG,
+		"Frame pool: %u frames of %zu bytes, %u frames of %zu bytes",
+		instance->frame_pool[FRAME_POOL_CLASS_SMALL].frame_count,
+		instance->frame_pool[FRAME_POOL_CLASS_SMALL].frame_size,
+		instance->frame_pool[FRAME_POOL_CLASS_FULL].frame_count,
+		instance->frame_pool[FRAME_POOL_CLASS_FULL].frame_size);
+
+	return (0);
 }
 
 int totemnet_processor_count_set (
@@ -616,6 +907,14 @@ int totemnet_crypto_reconfigure_phase (
 	return (res);
 }
 
+void totemnet_frame_pool_stats_update (
+	void *net_context)
+{
+	struct totemnet_instance *instance = (struct totemnet_instance *)net_context;
+
+	frame_pool_stats_update (instance);
+}
+
 void totemnet_stats_clear (
 	void *net_context)
 {
@@ -79,10 +79,35 @@ extern int totemnet_initialize (
 	void (*target_set_completed) (
 		void *context));
 
-extern void *totemnet_buffer_alloc (void *net_context);
+extern void *totemnet_buffer_alloc (void *net_context, size_t size);
 
 extern void totemnet_buffer_release (void *net_context, void *ptr);
 
+/**
+ * Take an additional reference to the pool frame ptr points into.
+ * Returns -1 if the frame was not allocated from the pool and can't be shared.
+ */
+extern int totemnet_buffer_ref (void *net_context, const void *ptr);
+
+/**
+ * Take ownership of the receive buffer holding msg (called from deliver_fn).
+ * On success msg stays valid until released with totemnet_buffer_release and
+ * the transport continues with a fresh buffer.  Returns -1 if the message has
+ * to be copied instead.
+ */
+extern int totemnet_recv_buffer_adopt (
+	void *net_context,
+	const void *msg,
+	size_t msg_len);
+
+/**
+ * Preallocate frame_count full sized frames (and a proportional number of
+ * small frames) so buffer alloc/release don't have to go to malloc
+ */
+extern int totemnet_frame_pool_init (
+	void *net_context,
+	unsigned int frame_count);
+
 extern int totemnet_processor_count_set (
 	void *net_context,
 	int processor_count);
@@ -123,6 +148,8 @@ extern int totemnet_crypto_reconfigure_phase (void *net_context, struct totem_co
 
 extern void totemnet_stats_clear (void *net_context);
 
+extern void totemnet_frame_pool_stats_update (void *net_context);
+
 extern const char *totemnet_iface_print (void *net_context);
 
 extern int totemnet_nodestatus_get (
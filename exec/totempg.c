@@ -196,13 +196,36 @@ enum throw_away_mode {
 	THROW_AWAY_ACTIVE
 };
 
+/*
+ * Assemblies are found by nodeid in an open addressed table with linear
+ * probing, one table for the operational and one for the transitional
+ * configuration. The data buffer grows as fragments arrive, so nodes
+ * sending only small messages don't pin MESSAGE_SIZE_MAX of memory.
+ */
+#define ASSEMBLY_HASH_BITS	10
+#define ASSEMBLY_HASH_SIZE	(1 << ASSEMBLY_HASH_BITS)
+
+#if ASSEMBLY_HASH_SIZE < 2 * PROCESSOR_COUNT_MAX
+#error ASSEMBLY_HASH_SIZE is too small for PROCESSOR_COUNT_MAX
+#endif
+
+#define ASSEMBLY_DATA_MIN	4096
+#define ASSEMBLY_DATA_MAX	(MESSAGE_SIZE_MAX+KNET_MAX_PACKET_SIZE)
+
+/*
+ * Buffers bigger than this are freed when the assembly is released
+ */
+#define ASSEMBLY_DATA_KEEP	(64 * 1024)
+
 struct assembly {
 	unsigned int nodeid;
-	unsigned char data[MESSAGE_SIZE_MAX+KNET_MAX_PACKET_SIZE];
+	unsigned char *data;
+	size_t data_size;
 	int index;
 	unsigned char last_frag_num;
 	enum throw_away_mode throw_away_mode;
-	struct qb_list_head list;
+	struct assembly **table; /* table the assembly is in, NULL if free */
+	struct qb_list_head list; /* on assembly_list_free */
 };
 
 static void assembly_deref (struct assembly *assembly);
@@ -210,15 +233,15 @@ static void assembly_deref (struct assembly *assembly);
 static int callback_token_received_fn (enum totem_callback_token_type type,
 	const void *data);
 
-QB_LIST_DECLARE(assembly_list_inuse);
+static struct assembly *assembly_table[ASSEMBLY_HASH_SIZE];
+
+static struct assembly *assembly_table_trans[ASSEMBLY_HASH_SIZE];
 
 /*
  * Free list is used both for transitional and operational assemblies
  */
 QB_LIST_DECLARE(assembly_list_free);
 
-QB_LIST_DECLARE(assembly_list_inuse_trans);
-
 QB_LIST_DECLARE(totempg_groups_list);
 
 /*
@@ -258,9 +281,30 @@ struct totempg_group_instance {
 	int groups_cnt;
 	int32_t q_level;
 
+	unsigned int deliver_seq; /* app_deliver_seq of the last delivery */
+
 	struct qb_list_head list;
 };
 
+/*
+ * Registry of joined groups, hashed by group name, so delivery only
+ * compares the groups carried in a message against instances that
+ * joined a group with the same hash
+ */
+#define GROUP_HASH_SIZE		64
+
+struct totempg_group_entry {
+	struct totempg_group_instance *instance;
+	unsigned int hash;
+	size_t group_len;
+	struct totempg_group_entry *next;
+	char group[];
+};
+
+static struct totempg_group_entry *totempg_group_hash[GROUP_HASH_SIZE];
+
+static unsigned int app_deliver_seq = 0;
+
 static unsigned char next_fragment = 1;
 
 static pthread_mutex_t totempg_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -287,92 +331,163 @@ static void totempg_waiting_trans_ack_cb (int waiting_trans_ack)
 	totempg_waiting_transack = waiting_trans_ack;
 }
 
-static struct assembly *assembly_ref (unsigned int nodeid)
+static inline unsigned int assembly_hash (unsigned int nodeid)
 {
-	struct assembly *assembly;
-	struct qb_list_head *list;
-	struct qb_list_head *active_assembly_list_inuse;
+	return ((nodeid * 2654435761U) >> (32 - ASSEMBLY_HASH_BITS));
+}
 
-	if (totempg_waiting_transack) {
-		active_assembly_list_inuse = &assembly_list_inuse_trans;
-	} else {
-		active_assembly_list_inuse = &assembly_list_inuse;
+static struct assembly *assembly_find (struct assembly **table, unsigned int nodeid)
+{
+	unsigned int i;
+
+	for (i = assembly_hash (nodeid); table[i] != NULL; i = (i + 1) & (ASSEMBLY_HASH_SIZE - 1)) {
+		if (table[i]->nodeid == nodeid) {
+			return (table[i]);
+		}
+	}
+
+	return (NULL);
+}
+
+static void assembly_table_add (struct assembly **table, struct assembly *assembly)
+{
+	unsigned int i;
+
+	for (i = assembly_hash (assembly->nodeid); table[i] != NULL; i = (i + 1) & (ASSEMBLY_HASH_SIZE - 1)) {
+		;
+	}
+	table[i] = assembly;
+	assembly->table = table;
+}
+
+static void assembly_table_del (struct assembly **table, struct assembly *assembly)
+{
+	unsigned int i, j, k;
+
+	for (i = assembly_hash (assembly->nodeid); table[i] != assembly; i = (i + 1) & (ASSEMBLY_HASH_SIZE - 1)) {
+		assert (table[i] != NULL);
 	}
+	table[i] = NULL;
+	assembly->table = NULL;
 
 	/*
-	 * Search inuse list for node id and return assembly buffer if found
+	 * Move back entries which probed past the freed slot so lookups
+	 * don't stop early
 	 */
-	qb_list_for_each(list, active_assembly_list_inuse) {
-		assembly = qb_list_entry (list, struct assembly, list);
-
-		if (nodeid == assembly->nodeid) {
-			return (assembly);
+	for (j = (i + 1) & (ASSEMBLY_HASH_SIZE - 1); table[j] != NULL; j = (j + 1) & (ASSEMBLY_HASH_SIZE - 1)) {
+		k = assembly_hash (table[j]->nodeid);
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && (k <= i && k > j))) {
+			table[i] = table[j];
+			table[j] = NULL;
+			i = j;
 		}
 	}
+}
+
+static void assembly_data_reserve (struct assembly *assembly, size_t size)
+{
+	size_t data_size;
+
+	assert (size < ASSEMBLY_DATA_MAX);
+	if (size <= assembly->data_size) {
+		return;
+	}
 
+	data_size = (assembly->data_size != 0) ? assembly->data_size : ASSEMBLY_DATA_MIN;
+	while (data_size < size) {
+		data_size *= 2;
+	}
+	if (data_size > ASSEMBLY_DATA_MAX) {
+		data_size = ASSEMBLY_DATA_MAX;
+	}
+
+	assembly->data = realloc (assembly->data, data_size);
 	/*
-	 * Nothing found in inuse list get one from free list if available
+	 * TODO handle memory allocation failure here
 	 */
-	if (qb_list_empty (&assembly_list_free) == 0) {
-		assembly = qb_list_first_entry (&assembly_list_free, struct assembly, list);
-		qb_list_del (&assembly->list);
-		qb_list_add (&assembly->list, active_assembly_list_inuse);
-		assembly->nodeid = nodeid;
-		assembly->index = 0;
-		assembly->last_frag_num = 0;
-		assembly->throw_away_mode = THROW_AWAY_INACTIVE;
+	assert (assembly->data);
+	assembly->data_size = data_size;
+}
+
+static void assembly_data_release (struct assembly *assembly)
+{
+	free (assembly->data);
+	assembly->data = NULL;
+	assembly->data_size = 0;
+}
+
+static struct assembly **assembly_table_active (void)
+{
+	if (totempg_waiting_transack) {
+		return (assembly_table_trans);
+	}
+	return (assembly_table);
+}
+
+static struct assembly *assembly_ref (unsigned int nodeid)
+{
+	struct assembly *assembly;
+	struct assembly **active_assembly_table = assembly_table_active ();
+
+	assembly = assembly_find (active_assembly_table, nodeid);
+	if (assembly != NULL) {
 		return (assembly);
 	}
 
 	/*
-	 * Nothing available in inuse or free list, so allocate a new one
-	 */
-	assembly = malloc (sizeof (struct assembly));
-	/*
-	 * TODO handle memory allocation failure here
+	 * Nothing found in table get one from free list if available
 	 */
-	assert (assembly);
+	if (qb_list_empty (&assembly_list_free) == 0) {
+		assembly = qb_list_first_entry (&assembly_list_free, struct assembly, list);
+		qb_list_del (&assembly->list);
+	} else {
+		/*
+		 * Nothing available in free list, so allocate a new one
+		 */
+		assembly = malloc (sizeof (struct assembly));
+		/*
+		 * TODO handle memory allocation failure here
+		 */
+		assert (assembly);
+		assembly->data = NULL;
+		assembly->data_size = 0;
+		qb_list_init (&assembly->list);
+	}
+
 	assembly->nodeid = nodeid;
-	assembly->data[0] = 0;
 	assembly->index = 0;
 	assembly->last_frag_num = 0;
 	assembly->throw_away_mode = THROW_AWAY_INACTIVE;
-	qb_list_init (&assembly->list);
-	qb_list_add (&assembly->list, active_assembly_list_inuse);
+	assembly_table_add (active_assembly_table, assembly);
 
 	return (assembly);
 }
 
 static void assembly_deref (struct assembly *assembly)
 {
-	qb_list_del (&assembly->list);
+	assembly_table_del (assembly->table, assembly);
+	if (assembly->data_size > ASSEMBLY_DATA_KEEP) {
+		assembly_data_release (assembly);
+	}
 	qb_list_add (&assembly->list, &assembly_list_free);
 }
 
 static void assembly_deref_from_normal_and_trans (int nodeid)
 {
-	int j;
-	struct qb_list_head *list, *tmp_iter;
-	struct qb_list_head *active_assembly_list_inuse;
 	struct assembly *assembly;
 
-	for (j = 0; j < 2; j++) {
-		if (j == 0) {
-			active_assembly_list_inuse = &assembly_list_inuse;
-		} else {
-			active_assembly_list_inuse = &assembly_list_inuse_trans;
-		}
-
-		qb_list_for_each_safe(list, tmp_iter, active_assembly_list_inuse) {
-			assembly = qb_list_entry (list, struct assembly, list);
-
-			if (nodeid == assembly->nodeid) {
-				qb_list_del (&assembly->list);
-				qb_list_add (&assembly->list, &assembly_list_free);
-			}
-		}
+	assembly = assembly_find (assembly_table, nodeid);
+	if (assembly != NULL) {
+		assembly_deref (assembly);
+		assembly_data_release (assembly);
 	}
 
+	assembly = assembly_find (assembly_table_trans, nodeid);
+	if (assembly != NULL) {
+		assembly_deref (assembly);
+		assembly_data_release (assembly);
+	}
 }
 
 static inline void app_confchg_fn (
@@ -445,63 +560,60 @@ static inline void group_endian_convert (
 	}
 }
 
-static inline int group_matches (
-	struct iovec *iovec,
-	unsigned int iov_len,
-	struct totempg_group *groups_b,
-	unsigned int group_b_cnt,
-	unsigned int *adjust_iovec)
+static unsigned int group_hash (const char *group, size_t group_len)
 {
-	unsigned short *group_len;
-	char *group_name;
-	int i;
-	int j;
-#ifdef TOTEMPG_NEED_ALIGN
-        struct iovec iovec_aligned = { NULL, 0 };
-#endif
+	unsigned int hash = 2166136261U;
+	size_t i;
 
-	assert (iov_len == 1);
-
-#ifdef TOTEMPG_NEED_ALIGN
-	/*
-	 * Align data structure for not i386 or x86_64
-	 */
-	if ((size_t)iovec->iov_base % sizeof(char *) != 0) {
-		iovec_aligned.iov_base = alloca(iovec->iov_len);
-		memcpy(iovec_aligned.iov_base, iovec->iov_base, iovec->iov_len);
-		iovec_aligned.iov_len = iovec->iov_len;
-		iovec = &iovec_aligned;
+	for (i = 0; i < group_len; i++) {
+		hash ^= (unsigned char)group[i];
+		hash *= 16777619U;
 	}
-#endif
 
-	group_len = (unsigned short *)iovec->iov_base;
-	group_name = ((char *)iovec->iov_base) +
-		sizeof (unsigned short) * (group_len[0] + 1);
+	return (hash);
+}
 
+static int group_hash_add (
+	struct totempg_group_instance *instance,
+	const struct totempg_group *group)
+{
+	struct totempg_group_entry *entry;
 
-	/*
-	 * Calculate amount to adjust the iovec by before delivering to app
-	 */
-	*adjust_iovec = sizeof (unsigned short) * (group_len[0] + 1);
-	for (i = 1; i < group_len[0] + 1; i++) {
-		*adjust_iovec += group_len[i];
+	entry = malloc (sizeof (struct totempg_group_entry) + group->group_len);
+	if (entry == NULL) {
+		return (-1);
 	}
+	entry->instance = instance;
+	entry->group_len = group->group_len;
+	memcpy (entry->group, group->group, group->group_len);
+	entry->hash = group_hash (entry->group, entry->group_len);
+	entry->next = totempg_group_hash[entry->hash % GROUP_HASH_SIZE];
+	totempg_group_hash[entry->hash % GROUP_HASH_SIZE] = entry;
 
-	/*
-	 * Determine if this message should be delivered to this instance
-	 */
-	for (i = 1; i < group_len[0] + 1; i++) {
-		for (j = 0; j < group_b_cnt; j++) {
-			if ((group_len[i] == groups_b[j].group_len) &&
-				(memcmp (groups_b[j].group, group_name, group_len[i]) == 0)) {
-				return (1);
-			}
-		}
-		group_name += group_len[i];
-	}
 	return (0);
 }
 
+static void group_hash_del (
+	struct totempg_group_instance *instance,
+	const struct totempg_group *group)
+{
+	struct totempg_group_entry **entry_p;
+	struct totempg_group_entry *entry;
+	unsigned int hash;
+
+	hash = group_hash (group->group, group->group_len);
+	for (entry_p = &totempg_group_hash[hash % GROUP_HASH_SIZE]; *entry_p != NULL;
+	    entry_p = &(*entry_p)->next) {
+		entry = *entry_p;
+		if (entry->instance == instance &&
+		    entry->group_len == group->group_len &&
+		    memcmp (entry->group, group->group, group->group_len) == 0) {
+			*entry_p = entry->next;
+			free (entry);
+			return;
+		}
+	}
+}
 
 static inline void app_deliver_fn (
 	unsigned int nodeid,
@@ -510,10 +622,14 @@ static inline void app_deliver_fn (
 	int endian_conversion_required)
 {
 	struct totempg_group_instance *instance;
+	struct totempg_group_entry *entry, *entry_next;
 	struct iovec stripped_iovec;
 	unsigned int adjust_iovec;
 	struct iovec *iovec;
-	struct qb_list_head *list;
+	unsigned short *group_len;
+	char *group_name;
+	unsigned int hash;
+	int i;
 
         struct iovec aligned_iovec = { NULL, 0 };
 
@@ -541,33 +657,62 @@ static inline void app_deliver_fn (
 
 	iovec = &aligned_iovec;
 
-	qb_list_for_each(list, &totempg_groups_list) {
-		instance = qb_list_entry (list, struct totempg_group_instance, list);
-		if (group_matches (iovec, 1, instance->groups, instance->groups_cnt, &adjust_iovec)) {
-			stripped_iovec.iov_len = iovec->iov_len - adjust_iovec;
-			stripped_iovec.iov_base = (char *)iovec->iov_base + adjust_iovec;
+	group_len = (unsigned short *)iovec->iov_base;
+	group_name = ((char *)iovec->iov_base) +
+		sizeof (unsigned short) * (group_len[0] + 1);
+
+	/*
+	 * Calculate amount to adjust the iovec by before delivering to app
+	 */
+	adjust_iovec = sizeof (unsigned short) * (group_len[0] + 1);
+	for (i = 1; i < group_len[0] + 1; i++) {
+		adjust_iovec += group_len[i];
+	}
+	stripped_iovec.iov_len = iovec->iov_len - adjust_iovec;
+	stripped_iovec.iov_base = (char *)iovec->iov_base + adjust_iovec;
 
 #ifdef TOTEMPG_NEED_ALIGN
-			/*
-			 * Align data structure for not i386 or x86_64
-			 */
-			if ((uintptr_t)((char *)iovec->iov_base + adjust_iovec) % (sizeof(char *)) != 0) {
-				/*
-				 * Deal with misalignment
-				 */
-				stripped_iovec.iov_base =
-					alloca (stripped_iovec.iov_len);
-				memcpy (stripped_iovec.iov_base,
-					 (char *)iovec->iov_base + adjust_iovec,
-					stripped_iovec.iov_len);
-			}
+	/*
+	 * Align data structure for not i386 or x86_64
+	 */
+	if ((uintptr_t)((char *)iovec->iov_base + adjust_iovec) % (sizeof(char *)) != 0) {
+		/*
+		 * Deal with misalignment
+		 */
+		stripped_iovec.iov_base =
+			alloca (stripped_iovec.iov_len);
+		memcpy (stripped_iovec.iov_base,
+			 (char *)iovec->iov_base + adjust_iovec,
+			stripped_iovec.iov_len);
+	}
 #endif
+
+	/*
+	 * Deliver once to every instance which joined one of the groups
+	 * in the message
+	 */
+	app_deliver_seq++;
+	for (i = 1; i < group_len[0] + 1; i++) {
+		hash = group_hash (group_name, group_len[i]);
+
+		for (entry = totempg_group_hash[hash % GROUP_HASH_SIZE]; entry != NULL; entry = entry_next) {
+			entry_next = entry->next;
+			instance = entry->instance;
+
+			if (entry->hash != hash || entry->group_len != group_len[i] ||
+			    memcmp (entry->group, group_name, group_len[i]) != 0 ||
+			    instance->deliver_seq == app_deliver_seq) {
+				continue;
+			}
+			instance->deliver_seq = app_deliver_seq;
+
 			instance->deliver_fn (
 				nodeid,
 				stripped_iovec.iov_base,
 				stripped_iovec.iov_len,
 				endian_conversion_required);
 		}
+		group_name += group_len[i];
 	}
 }
 
@@ -605,9 +750,6 @@ static void totempg_deliver_fn (
 	struct iovec iov_delv;
 	size_t expected_msg_len;
 
-	assembly = assembly_ref (nodeid);
-	assert (assembly);
-
 	if (msg_len < sizeof(struct totempg_mcast)) {
 		log_printf(LOG_WARNING,
 		    "Message (totempg_mcast) received from node " CS_PRI_NODE_ID " is too short...  Ignoring.", nodeid);
@@ -637,10 +779,18 @@ static void totempg_deliver_fn (
 		return ;
 	}
 
-	memcpy (header, msg, datasize);
+	/*
+	 * Message lengths are only swapped in a copy of the header, the
+	 * frame itself may still be retransmitted
+	 */
+	if (endian_conversion_required) {
+		memcpy (header, msg, datasize);
+		msg_lens = (unsigned short *) (header + sizeof (struct totempg_mcast));
+	} else {
+		msg_lens = (unsigned short *) ((char *)msg + sizeof (struct totempg_mcast));
+	}
 	data = msg;
 
-	msg_lens = (unsigned short *) (header + sizeof (struct totempg_mcast));
 	expected_msg_len = datasize;
 	for (i = 0; i < mcast->msg_count; i++) {
 		if (endian_conversion_required) {
@@ -659,7 +809,26 @@ static void totempg_deliver_fn (
 		return ;
 	}
 
-	assert((assembly->index+msg_len) < sizeof(assembly->data));
+	/*
+	 * Frame with only complete messages and no pending fragment from
+	 * the node, deliver straight from the frame. Endian conversion is
+	 * done in place, so it still goes through the assembly buffer.
+	 */
+	if (mcast->fragmented == 0 && mcast->continuation == 0 &&
+	    endian_conversion_required == 0 &&
+	    assembly_find (assembly_table_active (), nodeid) == NULL) {
+		data = (const char *)msg + datasize;
+		for (i = 0; i < msg_count; i++) {
+			app_deliver_fn (nodeid, (void *)data, msg_lens[i], 0);
+			data += msg_lens[i];
+		}
+		return;
+	}
+
+	assembly = assembly_ref (nodeid);
+	assert (assembly);
+
+	assembly_data_reserve (assembly, assembly->index + msg_len);
 	memcpy (&assembly->data[assembly->index], &data[datasize],
 		msg_len - datasize);
 
@@ -1166,6 +1335,7 @@ int totempg_groups_initialize (
 	instance->groups = 0;
 	instance->groups_cnt = 0;
 	instance->q_level = QB_LOOP_MED;
+	instance->deliver_seq = 0;
 	qb_list_init (&instance->list);
 	qb_list_add (&instance->list, &totempg_groups_list);
 
@@ -1189,6 +1359,7 @@ int totempg_groups_join (
 {
 	struct totempg_group_instance *instance = (struct totempg_group_instance *)totempg_groups_instance;
 	struct totempg_group *new_groups;
+	size_t i;
 	int res = 0;
 
 	if (totempg_threaded_mode == 1) {
@@ -1202,9 +1373,20 @@ int totempg_groups_join (
 		res = -1;
 		goto error_exit;
 	}
+	instance->groups = new_groups;
+
+	for (i = 0; i < group_cnt; i++) {
+		if (group_hash_add (instance, &groups[i]) != 0) {
+			while (i-- > 0) {
+				group_hash_del (instance, &groups[i]);
+			}
+			res = -1;
+			goto error_exit;
+		}
+	}
+
 	memcpy (&new_groups[instance->groups_cnt],
 		groups, group_cnt * sizeof (struct totempg_group));
-	instance->groups = new_groups;
 	instance->groups_cnt += group_cnt;
 
 error_exit:
@@ -1219,10 +1401,27 @@ int totempg_groups_leave (
 	const struct totempg_group *groups,
 	size_t group_cnt)
 {
+	struct totempg_group_instance *instance = (struct totempg_group_instance *)totempg_groups_instance;
+	size_t i;
+	int j;
+
 	if (totempg_threaded_mode == 1) {
 		pthread_mutex_lock (&totempg_mutex);
 	}
 
+	for (i = 0; i < group_cnt; i++) {
+		for (j = 0; j < instance->groups_cnt; j++) {
+			if (instance->groups[j].group_len == groups[i].group_len &&
+			    memcmp (instance->groups[j].group, groups[i].group, groups[i].group_len) == 0) {
+				group_hash_del (instance, &groups[i]);
+				memmove (&instance->groups[j], &instance->groups[j + 1],
+					(instance->groups_cnt - j - 1) * sizeof (struct totempg_group));
+				instance->groups_cnt--;
+				break;
+			}
+		}
+	}
+
 	if (totempg_threaded_mode == 1) {
 		pthread_mutex_unlock (&totempg_mutex);
 	}
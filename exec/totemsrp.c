@@ -100,6 +100,8 @@
 #define RETRANSMIT_ENTRIES_MAX			30
 #define TOKEN_SIZE_MAX				64000 /* bytes */
 #define LEAVE_DUMMY_NODEID                      0
+#define FCC_ADAPTIVE_WINDOW_MIN			1 /* smallest adaptive per token budget */
+#define FCC_ADAPTIVE_ROTATION_SLACK		2 /* ms of token rotation jitter tolerated */
 
 /*
  * SRP address.
@@ -509,6 +511,22 @@ struct totemsrp_instance {
 
 	unsigned int my_cbl;
 
+	/*
+	 * Adaptive flow control (totem.window_adaptive)
+	 */
+	unsigned int fcc_window;
+
+	unsigned int fcc_rtr_last;
+
+	uint64_t fcc_rotation_avg8; /* token rotation EWMA in ms, scaled by 8 */
+
+	/*
+	 * Token latency histograms (stats.srp.token_*)
+	 */
+	uint64_t token_rx_us;
+
+	uint32_t token_delivered;
+
 	uint64_t pause_timestamp;
 
 	struct memb_commit_token *commit_token;
@@ -660,7 +678,7 @@ static void timer_function_heartbeat_timeout (void *data);
 static void timer_function_token_retransmit_timeout (void *data);
 static void timer_function_token_hold_retransmit_timeout (void *data);
 static void timer_function_merge_detect_timeout (void *data);
-static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance);
+static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance, size_t size);
 static void totemsrp_buffer_release (struct totemsrp_instance *instance, void *ptr);
 static const char* gsfrom_to_msg(enum gather_state_from gsfrom);
 
@@ -771,10 +789,22 @@ static int token_event_stats_collector (enum totem_callback_token_type type, con
 {
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)void_instance;
 	uint64_t time_now;
+	uint64_t time_now_us;
 
-	time_now = (qb_util_nano_current_get() / QB_TIME_NS_IN_MSEC);
+	time_now_us = qb_util_nano_current_get() / QB_TIME_NS_IN_USEC;
+	time_now = time_now_us / QB_TIME_US_IN_MSEC;
 
 	if (type == TOTEM_CALLBACK_TOKEN_RECEIVED) {
+		if (instance->token_rx_us != 0) {
+			totem_histogram_record (&instance->stats.token_rotation_histogram,
+			    time_now_us - instance->token_rx_us);
+			totem_histogram_record (&instance->stats.token_delivered_histogram,
+			    instance->token_delivered);
+		}
+		instance->stats.token[instance->stats.latest_token].delivered = instance->token_delivered;
+		instance->token_delivered = 0;
+		instance->token_rx_us = time_now_us;
+
 		/* incr latest token the index */
 		if (instance->stats.latest_token == (TOTEM_TOKEN_STATS_MAX - 1))
 			instance->stats.latest_token = 0;
@@ -791,12 +821,20 @@ static int token_event_stats_collector (enum totem_callback_token_type type, con
 			instance->stats.token[instance->stats.earliest_token].rx = 0;
 			instance->stats.token[instance->stats.earliest_token].tx = 0;
 			instance->stats.token[instance->stats.earliest_token].backlog_calc = 0;
+			instance->stats.token[instance->stats.earliest_token].retransmits = 0;
+			instance->stats.token[instance->stats.earliest_token].delivered = 0;
 		}
 
 		instance->stats.token[instance->stats.latest_token].rx = time_now;
 		instance->stats.token[instance->stats.latest_token].tx = 0; /* in case we drop the token */
+		instance->stats.token[instance->stats.latest_token].retransmits = 0;
+		instance->stats.token[instance->stats.latest_token].delivered = 0;
 	} else {
 		instance->stats.token[instance->stats.latest_token].tx = time_now;
+		if (instance->token_rx_us != 0) {
+			totem_histogram_record (&instance->stats.token_hold_histogram,
+			    time_now_us - instance->token_rx_us);
+		}
 	}
 	return 0;
 }
@@ -837,6 +875,7 @@ int totemsrp_initialize (
 		int waiting_trans_ack))
 {
 	struct totemsrp_instance *instance;
+	unsigned int frame_pool_frames;
 	int res;
 
 	instance = malloc (sizeof (struct totemsrp_instance));
@@ -991,6 +1030,19 @@ int totemsrp_initialize (
 		goto error_exit;
 	}
 
+	/*
+	 * Frames are held by the pending queue (up to max_messages per token
+	 * hold), by the regular sort queue until every processor has seen them
+	 * (up to window_size per rotation) and by the previous rotation until
+	 * messages_free() catches up with the aru, hence twice the sum.
+	 * The sort queue can never hold more than QUEUE_RTR_ITEMS_SIZE_MAX.
+	 */
+	frame_pool_frames = 2 * (totem_config->window_size + totem_config->max_messages);
+	if (frame_pool_frames > QUEUE_RTR_ITEMS_SIZE_MAX) {
+		frame_pool_frames = QUEUE_RTR_ITEMS_SIZE_MAX;
+	}
+	totemnet_frame_pool_init (instance->totemnet_context, frame_pool_frames);
+
 	instance->my_id.nodeid = instance->totem_config->interfaces[instance->lowest_active_if].boundto.nodeid;
 
 	/*
@@ -1180,32 +1232,166 @@ static void memb_consensus_reset (struct totemsrp_instance *instance)
 	instance->consensus_list_entries = 0;
 }
 
+/*
+ * Sorted nodeid index of a member set.  The membership helpers below build
+ * one of these for the larger operand so lookups are a binary search
+ * instead of a nested scan, keeping join processing O((n + m) log n).
+ */
+struct memb_set_index {
+	unsigned int nodeid[PROCESSOR_COUNT_MAX];
+	int entries;
+};
+
+/*
+ * Sets smaller than this are compared with a plain linear scan, building
+ * the index would cost more than it saves.
+ */
+#define MEMB_SET_INDEX_MIN	8
+
+static int memb_nodeid_compare (const void *a, const void *b)
+{
+	unsigned int nodeid_a = *(const unsigned int *)a;
+	unsigned int nodeid_b = *(const unsigned int *)b;
+
+	if (nodeid_a < nodeid_b) {
+		return (-1);
+	}
+	if (nodeid_a > nodeid_b) {
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Position of the first entry of sorted list which is not lower than nodeid
+ */
+static int memb_nodeid_lower_bound (
+	const unsigned int *list, int list_entries,
+	unsigned int nodeid)
+{
+	int low = 0;
+	int high = list_entries;
+	int mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (list[mid] < nodeid) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return (low);
+}
+
+static void memb_set_index_build (
+	struct memb_set_index *index,
+	const struct srp_addr *set, int set_entries)
+{
+	int i;
+
+	for (i = 0; i < set_entries; i++) {
+		index->nodeid[i] = set[i].nodeid;
+	}
+	index->entries = set_entries;
+	qsort (index->nodeid, set_entries, sizeof (unsigned int), memb_nodeid_compare);
+}
+
+static int memb_set_index_contains (
+	const struct memb_set_index *index,
+	unsigned int nodeid)
+{
+	int pos;
+
+	pos = memb_nodeid_lower_bound (index->nodeid, index->entries, nodeid);
+
+	return (pos < index->entries && index->nodeid[pos] == nodeid);
+}
+
+/*
+ * Add nodeid to the index keeping it sorted, returns 0 if already present
+ */
+static int memb_set_index_add (
+	struct memb_set_index *index,
+	unsigned int nodeid)
+{
+	int pos;
+
+	pos = memb_nodeid_lower_bound (index->nodeid, index->entries, nodeid);
+	if (pos < index->entries && index->nodeid[pos] == nodeid) {
+		return (0);
+	}
+	memmove (&index->nodeid[pos + 1], &index->nodeid[pos],
+		sizeof (unsigned int) * (index->entries - pos));
+	index->nodeid[pos] = nodeid;
+	index->entries++;
+	return (1);
+}
+
+static int memb_set_find (
+	const struct srp_addr *set, int set_entries,
+	const struct srp_addr *addr)
+{
+	int i;
+
+	for (i = 0; i < set_entries; i++) {
+		if (srp_addr_equal (&set[i], addr)) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
 static void memb_set_subtract (
         struct srp_addr *out_list, int *out_list_entries,
         struct srp_addr *one_list, int one_list_entries,
         struct srp_addr *two_list, int two_list_entries)
 {
-	int found = 0;
+	struct memb_set_index two_index;
+	int found;
 	int i;
-	int j;
 
 	*out_list_entries = 0;
 
+	if (one_list_entries >= MEMB_SET_INDEX_MIN) {
+		memb_set_index_build (&two_index, two_list, two_list_entries);
+	}
+
 	for (i = 0; i < one_list_entries; i++) {
-		for (j = 0; j < two_list_entries; j++) {
-			if (srp_addr_equal (&one_list[i], &two_list[j])) {
-				found = 1;
-				break;
-			}
+		if (one_list_entries >= MEMB_SET_INDEX_MIN) {
+			found = memb_set_index_contains (&two_index, one_list[i].nodeid);
+		} else {
+			found = memb_set_find (two_list, two_list_entries, &one_list[i]);
 		}
 		if (found == 0) {
 			out_list[*out_list_entries] = one_list[i];
 			*out_list_entries = *out_list_entries + 1;
 		}
-		found = 0;
 	}
 }
 
+/*
+ * Position of addr in the consensus list, which is kept sorted by nodeid
+ */
+static int memb_consensus_lower_bound (
+	struct totemsrp_instance *instance,
+	const struct srp_addr *addr)
+{
+	int low = 0;
+	int high = instance->consensus_list_entries;
+	int mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (instance->consensus_list[mid].addr.nodeid < addr->nodeid) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return (low);
+}
+
 /*
  * Set consensus for a specific processor
  */
@@ -1213,20 +1399,18 @@ static void memb_consensus_set (
 	struct totemsrp_instance *instance,
 	const struct srp_addr *addr)
 {
-	int found = 0;
 	int i;
 
-	for (i = 0; i < instance->consensus_list_entries; i++) {
-		if (srp_addr_equal(addr, &instance->consensus_list[i].addr)) {
-			found = 1;
-			break; /* found entry */
-		}
+	i = memb_consensus_lower_bound (instance, addr);
+	if (i == instance->consensus_list_entries ||
+		srp_addr_equal (addr, &instance->consensus_list[i].addr) == 0) {
+
+		memmove (&instance->consensus_list[i + 1], &instance->consensus_list[i],
+			sizeof (struct consensus_list_item) * (instance->consensus_list_entries - i));
+		instance->consensus_list_entries++;
 	}
 	instance->consensus_list[i].addr = *addr;
 	instance->consensus_list[i].set = 1;
-	if (found == 0) {
-		instance->consensus_list_entries++;
-	}
 	return;
 }
 
@@ -1239,10 +1423,11 @@ static int memb_consensus_isset (
 {
 	int i;
 
-	for (i = 0; i < instance->consensus_list_entries; i++) {
-		if (srp_addr_equal (addr, &instance->consensus_list[i].addr)) {
-			return (instance->consensus_list[i].set);
-		}
+	i = memb_consensus_lower_bound (instance, addr);
+	if (i < instance->consensus_list_entries &&
+		srp_addr_equal (addr, &instance->consensus_list[i].addr)) {
+
+		return (instance->consensus_list[i].set);
 	}
 	return (0);
 }
@@ -1303,62 +1488,49 @@ static void memb_consensus_notset (
 }
 
 /*
- * Is set1 equal to set2 Entries can be in different orders
+ * Is subset fully contained in fullset
  */
-static int memb_set_equal (
-	struct srp_addr *set1, int set1_entries,
-	struct srp_addr *set2, int set2_entries)
+static int memb_set_subset (
+	const struct srp_addr *subset, int subset_entries,
+	const struct srp_addr *fullset, int fullset_entries)
 {
+	struct memb_set_index full_index;
 	int i;
-	int j;
-
-	int found = 0;
 
-	if (set1_entries != set2_entries) {
+	if (subset_entries > fullset_entries) {
 		return (0);
 	}
-	for (i = 0; i < set2_entries; i++) {
-		for (j = 0; j < set1_entries; j++) {
-			if (srp_addr_equal (&set1[j], &set2[i])) {
-				found = 1;
-				break;
+	if (subset_entries < MEMB_SET_INDEX_MIN) {
+		for (i = 0; i < subset_entries; i++) {
+			if (memb_set_find (fullset, fullset_entries, &subset[i]) == 0) {
+				return (0);
 			}
 		}
-		if (found == 0) {
+		return (1);
+	}
+
+	memb_set_index_build (&full_index, fullset, fullset_entries);
+	for (i = 0; i < subset_entries; i++) {
+		if (memb_set_index_contains (&full_index, subset[i].nodeid) == 0) {
 			return (0);
 		}
-		found = 0;
 	}
 	return (1);
 }
 
 /*
- * Is subset fully contained in fullset
+ * Is set1 equal to set2 Entries can be in different orders
  */
-static int memb_set_subset (
-	const struct srp_addr *subset, int subset_entries,
-	const struct srp_addr *fullset, int fullset_entries)
+static int memb_set_equal (
+	struct srp_addr *set1, int set1_entries,
+	struct srp_addr *set2, int set2_entries)
 {
-	int i;
-	int j;
-	int found = 0;
-
-	if (subset_entries > fullset_entries) {
+	if (set1_entries != set2_entries) {
 		return (0);
 	}
-	for (i = 0; i < subset_entries; i++) {
-		for (j = 0; j < fullset_entries; j++) {
-			if (srp_addr_equal (&subset[i], &fullset[j])) {
-				found = 1;
-			}
-		}
-		if (found == 0) {
-			return (0);
-		}
-		found = 0;
-	}
-	return (1);
+	return (memb_set_subset (set2, set2_entries, set1, set1_entries));
 }
+
 /*
  * merge subset into fullset taking care not to add duplicates
  */
@@ -1366,22 +1538,25 @@ static void memb_set_merge (
 	const struct srp_addr *subset, int subset_entries,
 	struct srp_addr *fullset, int *fullset_entries)
 {
-	int found = 0;
+	struct memb_set_index full_index;
 	int i;
-	int j;
 
-	for (i = 0; i < subset_entries; i++) {
-		for (j = 0; j < *fullset_entries; j++) {
-			if (srp_addr_equal (&fullset[j], &subset[i])) {
-				found = 1;
-				break;
+	if (subset_entries < MEMB_SET_INDEX_MIN) {
+		for (i = 0; i < subset_entries; i++) {
+			if (memb_set_find (fullset, *fullset_entries, &subset[i]) == 0) {
+				fullset[*fullset_entries] = subset[i];
+				*fullset_entries = *fullset_entries + 1;
 			}
 		}
-		if (found == 0) {
+		return;
+	}
+
+	memb_set_index_build (&full_index, fullset, *fullset_entries);
+	for (i = 0; i < subset_entries; i++) {
+		if (memb_set_index_add (&full_index, subset[i].nodeid)) {
 			fullset[*fullset_entries] = subset[i];
 			*fullset_entries = *fullset_entries + 1;
 		}
-		found = 0;
 	}
 	return;
 }
@@ -1456,38 +1631,41 @@ static void my_leave_memb_clear(
         instance->my_leave_memb_entries = 0;
 }
 
+/*
+ * my_leave_memb_list is kept sorted so it can be binary searched
+ */
 static unsigned int my_leave_memb_match(
         struct totemsrp_instance *instance,
         unsigned int nodeid)
 {
         int i;
-        unsigned int ret = 0;
 
-        for (i = 0; i < instance->my_leave_memb_entries; i++){
-                if (instance->my_leave_memb_list[i] ==  nodeid){
-                        ret = nodeid;
-                        break;
-                }
+        i = memb_nodeid_lower_bound(instance->my_leave_memb_list,
+                instance->my_leave_memb_entries, nodeid);
+        if (i < instance->my_leave_memb_entries &&
+                instance->my_leave_memb_list[i] == nodeid) {
+                return nodeid;
         }
-        return ret;
+        return 0;
 }
 
 static void my_leave_memb_set(
         struct totemsrp_instance *instance,
         unsigned int nodeid)
 {
-        int i, found = 0;
-        for (i = 0; i < instance->my_leave_memb_entries; i++){
-                if (instance->my_leave_memb_list[i] ==  nodeid){
-                        found = 1;
-                        break;
-                }
-        }
-        if (found == 1) {
+        int i;
+
+        i = memb_nodeid_lower_bound(instance->my_leave_memb_list,
+                instance->my_leave_memb_entries, nodeid);
+        if (i < instance->my_leave_memb_entries &&
+                instance->my_leave_memb_list[i] == nodeid) {
                 return;
         }
         if (instance->my_leave_memb_entries < (PROCESSOR_COUNT_MAX - 1)) {
-                instance->my_leave_memb_list[instance->my_leave_memb_entries] = nodeid;
+                memmove(&instance->my_leave_memb_list[i + 1],
+                        &instance->my_leave_memb_list[i],
+                        sizeof(unsigned int) * (instance->my_leave_memb_entries - i));
+                instance->my_leave_memb_list[i] = nodeid;
                 instance->my_leave_memb_entries++;
         } else {
                 log_printf (instance->totemsrp_log_level_warning,
@@ -1496,10 +1674,10 @@ static void my_leave_memb_set(
 }
 
 
-static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance)
+static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance, size_t size)
 {
 	assert (instance != NULL);
-	return totemnet_buffer_alloc (instance->totemnet_context);
+	return totemnet_buffer_alloc (instance->totemnet_context, size);
 }
 
 static void totemsrp_buffer_release (struct totemsrp_instance *instance, void *ptr)
@@ -1908,6 +2086,22 @@ static void deliver_messages_from_recovery_to_regular (struct totemsrp_instance
 
 			res = sq_item_inuse (&instance->regular_sort_queue, mcast->seq);
 			if (res == 0) {
+				/*
+				 * The regular message shares the frame of the recovery
+				 * message carrying it, so both queues hold a reference.
+				 * Frames which can't be shared are copied.
+				 */
+				if (totemnet_buffer_ref (instance->totemnet_context,
+					recovery_message_item->mcast) == -1) {
+
+					regular_message_item.mcast = totemsrp_buffer_alloc (instance,
+						regular_message_item.msg_len);
+					if (regular_message_item.mcast == NULL) {
+						continue;
+					}
+					memcpy (regular_message_item.mcast, mcast,
+						regular_message_item.msg_len);
+				}
 				sq_item_add (&instance->regular_sort_queue,
 					&regular_message_item, mcast->seq);
 				if (sq_lt_compare (instance->old_ring_state_high_seq_received, mcast->seq)) {
@@ -1921,6 +2115,37 @@ static void deliver_messages_from_recovery_to_regular (struct totemsrp_instance
 	}
 }
 
+static void regular_sort_queue_release_all (struct totemsrp_instance *instance)
+{
+	struct sort_queue_item *regular_message;
+	unsigned int seq;
+	unsigned int size;
+	unsigned int run;
+	unsigned int i;
+	void *ptr;
+	int res;
+
+	size = sq_size_get (&instance->regular_sort_queue);
+	seq = instance->regular_sort_queue.head_seqid;
+	i = 0;
+	while (i < size) {
+		/*
+		 * Skip holes and release following run of messages
+		 */
+		run = sq_items_hole_run (&instance->regular_sort_queue, seq, size - i);
+		i += run;
+		seq += run;
+		run = sq_items_inuse_run (&instance->regular_sort_queue, seq, size - i);
+
+		for (; run > 0; run--, i++, seq++) {
+			res = sq_item_get (&instance->regular_sort_queue, seq, &ptr);
+			assert (res == 0);
+			regular_message = ptr;
+			totemsrp_buffer_release (instance, regular_message->mcast);
+		}
+	}
+}
+
 /*
  * Change states in the state machine of the membership algorithm
  */
@@ -2026,8 +2251,11 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 	/*
 	 * The recovery sort queue now becomes the regular
 	 * sort queue.  It is necessary to copy the state
-	 * into the regular sort queue.
+	 * into the regular sort queue.  Messages of the old
+	 * ring still held by the regular sort queue are
+	 * released first.
 	 */
+	regular_sort_queue_release_all (instance);
 	sq_copy (&instance->regular_sort_queue, &instance->recovery_sort_queue);
 	instance->my_last_aru = SEQNO_START_MSG;
 
@@ -2084,7 +2312,7 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 			struct sort_queue_item *regular_message;
 
 			regular_message = ptr;
-			free (regular_message->mcast);
+			totemsrp_buffer_release (instance, regular_message->mcast);
 		}
 	}
 	sq_items_release (&instance->regular_sort_queue, instance->my_high_delivered);
@@ -2287,6 +2515,8 @@ static void memb_state_commit_enter (
 	instance->my_trc = 0;
 	instance->my_pbl = 0;
 	instance->my_cbl = 0;
+	instance->fcc_rtr_last = 0;
+	instance->fcc_rotation_avg8 = 0;
 	/*
 	 * commit token sent after callback that token target has been set
 	 */
@@ -2440,7 +2670,8 @@ static void memb_state_recovery_enter (
 		messages_originated++;
 		memset (&message_item, 0, sizeof (struct message_item));
 	// TODO	 LEAK
-		message_item.mcast = totemsrp_buffer_alloc (instance);
+		message_item.mcast = totemsrp_buffer_alloc (instance,
+			sort_queue_item->msg_len + sizeof (struct mcast));
 		assert (message_item.mcast);
 		memset(message_item.mcast, 0, sizeof (struct mcast));
 		message_item.mcast->header.magic = TOTEM_MH_MAGIC;
@@ -2506,6 +2737,7 @@ int totemsrp_mcast (
 	char *addr;
 	unsigned int addr_idx;
 	struct cs_queue *queue_use;
+	size_t msg_len;
 
 	if (instance->waiting_trans_ack) {
 		queue_use = &instance->new_message_queue_trans;
@@ -2520,10 +2752,15 @@ int totemsrp_mcast (
 
 	memset (&message_item, 0, sizeof (struct message_item));
 
+	msg_len = sizeof (struct mcast);
+	for (i = 0; i < iov_len; i++) {
+		msg_len += iovec[i].iov_len;
+	}
+
 	/*
 	 * Allocate pending item
 	 */
-	message_item.mcast = totemsrp_buffer_alloc (instance);
+	message_item.mcast = totemsrp_buffer_alloc (instance, msg_len);
 	if (message_item.mcast == 0) {
 		goto error_mcast;
 	}
@@ -2552,9 +2789,17 @@ int totemsrp_mcast (
 
 	message_item.msg_len = addr_idx;
 
+	if (cs_queue_item_add (queue_use, &message_item) != 0) {
+		/*
+		 * Other thread filled the (lock-free) queue after full check
+		 */
+		log_printf (instance->totemsrp_log_level_debug, "queue full");
+		totemsrp_buffer_release (instance, message_item.mcast);
+		return (-1);
+	}
+
 	log_printf (instance->totemsrp_log_level_trace, "mcasted message added to pending queue");
 	instance->stats.mcast_tx++;
-	cs_queue_item_add (queue_use, &message_item);
 
 	return (0);
 
@@ -2641,6 +2886,7 @@ static void messages_free (
 	int log_release = 0;
 	unsigned int release_to;
 	unsigned int range = 0;
+	unsigned int run;
 
 	release_to = token_aru;
 	if (sq_lt_compare (instance->my_last_aru, release_to)) {
@@ -2663,18 +2909,29 @@ static void messages_free (
 	/*
 	 * Release retransmit list items if group aru indicates they are transmitted
 	 */
-	for (i = 1; i <= range; i++) {
+	i = 1;
+	while (i <= range) {
 		void *ptr;
 
-		res = sq_item_get (&instance->regular_sort_queue,
-			instance->last_released + i, &ptr);
-		if (res == 0) {
+		/*
+		 * Skip holes and release following run of messages
+		 */
+		i += sq_items_hole_run (&instance->regular_sort_queue,
+			instance->last_released + i, range - i + 1);
+		run = sq_items_inuse_run (&instance->regular_sort_queue,
+			instance->last_released + i, range - i + 1);
+
+		for (; run > 0; run--, i++) {
+			res = sq_item_get (&instance->regular_sort_queue,
+				instance->last_released + i, &ptr);
+			assert (res == 0);
 			regular_message = ptr;
 			totemsrp_buffer_release (instance, regular_message->mcast);
 		}
-		sq_items_release (&instance->regular_sort_queue,
-			instance->last_released + i);
+	}
 
+	if (range > 0) {
+		sq_items_release (&instance->regular_sort_queue, release_to);
 		log_release = 1;
 	}
 	instance->last_released += range;
@@ -2688,11 +2945,8 @@ static void messages_free (
 static void update_aru (
 	struct totemsrp_instance *instance)
 {
-	unsigned int i;
-	int res;
 	struct sq *sort_queue;
 	unsigned int range;
-	unsigned int my_aru_saved = 0;
 
 	if (instance->memb_state == MEMB_STATE_RECOVERY) {
 		sort_queue = &instance->recovery_sort_queue;
@@ -2702,20 +2956,10 @@ static void update_aru (
 
 	range = instance->my_high_seq_received - instance->my_aru;
 
-	my_aru_saved = instance->my_aru;
-	for (i = 1; i <= range; i++) {
-
-		void *ptr;
-
-		res = sq_item_get (sort_queue, my_aru_saved + i, &ptr);
-		/*
-		 * If hole, stop updating aru
-		 */
-		if (res != 0) {
-			break;
-		}
-	}
-	instance->my_aru += i - 1;
+	/*
+	 * Aru is updated up to first hole
+	 */
+	instance->my_aru += sq_items_inuse_run (sort_queue, instance->my_aru + 1, range);
 }
 
 /*
@@ -3612,6 +3856,71 @@ static unsigned int backlog_get (struct totemsrp_instance *instance)
 	return (backlog);
 }
 
+/*
+ * AIMD controlled number of messages this processor may send per token,
+ * between FCC_ADAPTIVE_WINDOW_MIN and max_messages. The budget is halved
+ * when the retransmit list on the token grows, on multicast sendmsg failures
+ * or when the token rotation (as recorded by token_event_stats_collector)
+ * suddenly grows, and raised by one message per token while there is a
+ * backlog and nothing is waiting for retransmission.
+ */
+static unsigned int fcc_adaptive_window (
+	struct totemsrp_instance *instance,
+	struct orf_token *token)
+{
+	unsigned int max_window = instance->totem_config->max_messages;
+	int latest = instance->stats.latest_token;
+	int prev;
+	uint64_t rotation;
+	uint64_t rotation_avg;
+	int congested = 0;
+
+	if (instance->fcc_window == 0 || instance->fcc_window > max_window) {
+		instance->fcc_window = max_window;
+	}
+
+	if (token->rtr_list_entries > instance->fcc_rtr_last) {
+		congested = 1;
+	}
+	instance->fcc_rtr_last = token->rtr_list_entries;
+
+	if (instance->stats.continuous_sendmsg_failures > 0) {
+		congested = 1;
+	}
+
+	prev = (latest == 0) ? TOTEM_TOKEN_STATS_MAX - 1 : latest - 1;
+	if (instance->stats.token[prev].rx != 0 &&
+	    instance->stats.token[latest].rx >= instance->stats.token[prev].rx) {
+		rotation = instance->stats.token[latest].rx - instance->stats.token[prev].rx;
+
+		if (instance->fcc_rotation_avg8 == 0) {
+			instance->fcc_rotation_avg8 = rotation * 8;
+		}
+		rotation_avg = instance->fcc_rotation_avg8 / 8;
+
+		if (rotation > rotation_avg * 2 + FCC_ADAPTIVE_ROTATION_SLACK ||
+		    rotation * 2 > instance->totem_config->token_retransmit_timeout) {
+			congested = 1;
+		}
+		instance->fcc_rotation_avg8 += rotation - rotation_avg;
+	}
+
+	if (congested) {
+		if (instance->fcc_window > FCC_ADAPTIVE_WINDOW_MIN) {
+			instance->fcc_window /= 2;
+			if (instance->fcc_window < FCC_ADAPTIVE_WINDOW_MIN) {
+				instance->fcc_window = FCC_ADAPTIVE_WINDOW_MIN;
+			}
+			instance->stats.fcc_window_decreases++;
+		}
+	} else if (token->rtr_list_entries == 0 && instance->my_cbl > 0 &&
+	    instance->fcc_window < max_window) {
+		instance->fcc_window++;
+	}
+
+	return (instance->fcc_window);
+}
+
 static int fcc_calculate (
 	struct totemsrp_instance *instance,
 	struct orf_token *token)
@@ -3619,14 +3928,19 @@ static int fcc_calculate (
 	unsigned int transmits_allowed;
 	unsigned int backlog_calc;
 
-	transmits_allowed = instance->totem_config->max_messages;
+	instance->my_cbl = backlog_get (instance);
+
+	if (instance->totem_config->window_adaptive) {
+		transmits_allowed = fcc_adaptive_window (instance, token);
+	} else {
+		transmits_allowed = instance->totem_config->max_messages;
+	}
+	instance->stats.fcc_window = transmits_allowed;
 
 	if (transmits_allowed > instance->totem_config->window_size - token->fcc) {
 		transmits_allowed = instance->totem_config->window_size - token->fcc;
 	}
 
-	instance->my_cbl = backlog_get (instance);
-
 	/*
 	 * Only do backlog calculation if there is a backlog otherwise
 	 * we would result in div by zero
@@ -4014,6 +4328,8 @@ static int message_handler_orf_token (
 
 		transmits_allowed = fcc_calculate (instance, token);
 		mcasted_retransmit = orf_token_rtr (instance, token, &transmits_allowed);
+		instance->stats.token[instance->stats.latest_token].retransmits = mcasted_retransmit;
+		totem_histogram_record (&instance->stats.token_retransmits_histogram, mcasted_retransmit);
 
 		if (instance->totem_config->cancel_token_hold_on_retransmit &&
 		    instance->my_token_held == 1 &&
@@ -4268,6 +4584,8 @@ static void messages_deliver_to_app (
 			"Delivering MCAST message with seq %x to pending delivery queue",
 			mcast_header.seq);
 
+		instance->token_delivered++;
+
 		/*
 		 * Message is locally originated multicast
 		 */
@@ -4377,12 +4695,20 @@ static int message_handler_mcast (
 		/*
 		 * Allocate new multicast memory block
 		 */
+		if (totemnet_recv_buffer_adopt (instance->totemnet_context,
+			msg, msg_len) == 0) {
+			/*
+			 * Sort queue now owns the frame the message was received into
+			 */
+			sort_queue_item.mcast = (struct mcast *)msg;
+		} else {
 // TODO LEAK
-		sort_queue_item.mcast = totemsrp_buffer_alloc (instance);
-		if (sort_queue_item.mcast == NULL) {
-			return (-1); /* error here is corrected by the algorithm */
+			sort_queue_item.mcast = totemsrp_buffer_alloc (instance, msg_len);
+			if (sort_queue_item.mcast == NULL) {
+				return (-1); /* error here is corrected by the algorithm */
+			}
+			memcpy (sort_queue_item.mcast, msg, msg_len);
 		}
-		memcpy (sort_queue_item.mcast, msg, msg_len);
 		sort_queue_item.msg_len = msg_len;
 
 		if (sq_lt_compare (instance->my_high_seq_received,
@@ -5222,11 +5548,57 @@ int totemsrp_member_remove (
 	return (res);
 }
 
+/*
+ * Nothing calls totempg_threaded_mode_enable at the moment, so the mpsc
+ * queues are only used once a threaded IPC mode is brought back
+ */
 void totemsrp_threaded_mode_enable (void *context)
 {
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)context;
+	struct cs_queue new_message_queue;
+	struct cs_queue new_message_queue_trans;
+	size_t queue_size;
 
 	instance->threaded_mode_enabled = 1;
+
+	/*
+	 * New messages are queued by IPC worker threads and consumed by token
+	 * holder, so switch (still empty) queues to lock-free mpsc variant
+	 */
+	assert (cs_queue_is_empty (&instance->new_message_queue));
+	assert (cs_queue_is_empty (&instance->new_message_queue_trans));
+
+	queue_size = instance->new_message_queue.size;
+
+	if (cs_queue_init_mpsc (&new_message_queue,
+		queue_size, sizeof (struct message_item)) != 0) {
+		goto error_exit;
+	}
+	if (cs_queue_init_mpsc (&new_message_queue_trans,
+		queue_size, sizeof (struct message_item)) != 0) {
+		cs_queue_free (&new_message_queue);
+		goto error_exit;
+	}
+
+	cs_queue_free (&instance->new_message_queue);
+	cs_queue_free (&instance->new_message_queue_trans);
+
+	memcpy (&instance->new_message_queue, &new_message_queue, sizeof (struct cs_queue));
+	memcpy (&instance->new_message_queue_trans, &new_message_queue_trans, sizeof (struct cs_queue));
+
+	return;
+
+error_exit:
+	/*
+	 * Keep the current queues, but protect them by their mutex
+	 */
+	log_printf (instance->totemsrp_log_level_error,
+		"Unable to allocate lock-free message queues, using locked ones");
+
+	instance->new_message_queue.threaded_mode_enabled = 1;
+	pthread_mutex_init (&instance->new_message_queue.mutex, NULL);
+	instance->new_message_queue_trans.threaded_mode_enabled = 1;
+	pthread_mutex_init (&instance->new_message_queue_trans.mutex, NULL);
 }
 
 void totemsrp_trans_ack (void *context)
@@ -5261,6 +5633,7 @@ void totemsrp_stats_clear (void *context, int flags)
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)context;
 
 	memset(&instance->stats, 0, sizeof(totemsrp_stats_t));
+	totemnet_frame_pool_stats_update (instance->totemnet_context);
 	if (flags & TOTEMPG_STATS_CLEAR_TRANSPORT) {
 		totemnet_stats_clear (instance->totemnet_context);
 	}
@@ -159,6 +159,30 @@ struct totemudp_instance {
 
 	struct iovec totemudp_iov_recv_flush;
 
+	/*
+	 * Batched receive ring (totem.udp_recv_batch entries), NULL when
+	 * receiving one datagram per wakeup
+	 */
+	unsigned int recv_batch;
+
+	char *recv_batch_buffer;
+
+	struct iovec *recv_batch_iov;
+
+	struct sockaddr_storage *recv_batch_from;
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr *recv_batch_msgs;
+
+	/*
+	 * Ring entries [recv_batch_pos, recv_batch_received) are not
+	 * delivered yet
+	 */
+	int recv_batch_received;
+
+	int recv_batch_pos;
+#endif
+
 	struct totemudp_socket totemudp_sockets;
 
 	struct totem_ip_address mcast_address;
@@ -246,6 +270,65 @@ do {												\
 		fmt ": %s (%d)\n", ##args, _error_ptr, err_num);				\
 	} while(0)
 
+static void totemudp_recv_batch_free (struct totemudp_instance *instance)
+{
+	free (instance->recv_batch_buffer);
+	free (instance->recv_batch_iov);
+	free (instance->recv_batch_from);
+	instance->recv_batch_buffer = NULL;
+	instance->recv_batch_iov = NULL;
+	instance->recv_batch_from = NULL;
+#ifdef HAVE_RECVMMSG
+	free (instance->recv_batch_msgs);
+	instance->recv_batch_msgs = NULL;
+	instance->recv_batch_received = 0;
+	instance->recv_batch_pos = 0;
+#endif
+	instance->recv_batch = 1;
+}
+
+static void totemudp_recv_batch_alloc (struct totemudp_instance *instance)
+{
+#ifdef HAVE_RECVMMSG
+	unsigned int i;
+
+	instance->recv_batch = instance->totem_config->udp_recv_batch;
+	if (instance->recv_batch <= 1) {
+		instance->recv_batch = 1;
+		return;
+	}
+
+	/*
+	 * Buffer is not touched here, so only the pages actually
+	 * written by received datagrams become resident
+	 */
+	instance->recv_batch_buffer = malloc ((size_t)instance->recv_batch * (UDP_RECEIVE_FRAME_SIZE_MAX + 1));
+	instance->recv_batch_iov = malloc (instance->recv_batch * sizeof (struct iovec));
+	instance->recv_batch_from = malloc (instance->recv_batch * sizeof (struct sockaddr_storage));
+	instance->recv_batch_msgs = calloc (instance->recv_batch, sizeof (struct mmsghdr));
+	if (instance->recv_batch_buffer == NULL || instance->recv_batch_iov == NULL ||
+	    instance->recv_batch_from == NULL || instance->recv_batch_msgs == NULL) {
+		log_printf (instance->totemudp_log_level_warning,
+			"Unable to allocate receive batch of %u datagrams, receiving one datagram at a time",
+			instance->recv_batch);
+		totemudp_recv_batch_free (instance);
+		return;
+	}
+
+	for (i = 0; i < instance->recv_batch; i++) {
+		instance->recv_batch_iov[i].iov_base = instance->recv_batch_buffer +
+			(size_t)i * (UDP_RECEIVE_FRAME_SIZE_MAX + 1);
+		instance->recv_batch_iov[i].iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1;
+		instance->recv_batch_msgs[i].msg_hdr.msg_name = &instance->recv_batch_from[i];
+		instance->recv_batch_msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		instance->recv_batch_msgs[i].msg_hdr.msg_iov = &instance->recv_batch_iov[i];
+		instance->recv_batch_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#else
+	instance->recv_batch = 1;
+#endif
+}
+
 int totemudp_crypto_set (
 	void *udp_context,
 	const char *cipher_type,
@@ -375,9 +458,81 @@ int totemudp_finalize (
 		close (instance->totemudp_sockets.token);
 	}
 
+	totemudp_recv_batch_free (instance);
+
 	return (res);
 }
 
+static void net_deliver_datagram (
+	struct totemudp_instance *instance,
+	struct iovec *iovec,
+	int bytes_received,
+	const struct sockaddr_storage *system_from)
+{
+	instance->stats_recv += bytes_received;
+
+	if (bytes_received >= UDP_RECEIVE_FRAME_SIZE_MAX + 1) {
+		/*
+		 * Maximum packet size should be UDP_RECEIVE_FRAME_SIZE_MAX.
+		 * If received packet is UDP_RECEIVE_FRAME_SIZE_MAX + 1 it means packet was truncated
+		 * (iov_buffer size and iov_len are intentionally set to UDP_RECEIVE_FRAME_SIZE_MAX + 1).
+		 */
+		log_printf (instance->totemudp_log_level_error,
+				"Received too big message. This may be because something bad is happening "
+				"on the network (attack?), or you tried join more nodes than corosync is "
+				"compiled with (%u) or bug in the code (bad estimation of "
+				"the UDP_RECEIVE_FRAME_SIZE_MAX). Dropping packet.", PROCESSOR_COUNT_MAX);
+		return;
+	}
+
+	/*
+	 * Handle incoming message
+	 */
+	instance->totemudp_deliver_fn (
+		instance->context,
+		iovec->iov_base,
+		bytes_received,
+		system_from);
+}
+
+#ifdef HAVE_RECVMMSG
+static int net_deliver_batch_fn (
+	int fd,
+	struct totemudp_instance *instance)
+{
+	int received;
+	int i;
+
+	/*
+	 * Drain up to recv_batch datagrams with one syscall and deliver
+	 * them in the order they were received
+	 */
+	received = recvmmsg (fd, instance->recv_batch_msgs, instance->recv_batch,
+		MSG_NOSIGNAL | MSG_DONTWAIT, NULL);
+	if (received == -1) {
+		return (0);
+	}
+
+	instance->recv_batch_received = received;
+	instance->recv_batch_pos = 0;
+
+	/*
+	 * A pause flush (totemudp_recv_mcast_empty) run while one of these
+	 * frames is delivered drops the rest of the batch
+	 */
+	while (instance->recv_batch_pos < instance->recv_batch_received) {
+		i = instance->recv_batch_pos++;
+
+		net_deliver_datagram (instance, &instance->recv_batch_iov[i],
+			instance->recv_batch_msgs[i].msg_len, &instance->recv_batch_from[i]);
+
+		instance->recv_batch_msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+	}
+
+	return (0);
+}
+#endif
+
 /*
  * Only designed to work with a message with one iov
  */
@@ -396,6 +551,11 @@ static int net_deliver_fn (
 	if (instance->flushing == 1) {
 		iovec = &instance->totemudp_iov_recv_flush;
 	} else {
+#ifdef HAVE_RECVMMSG
+		if (instance->recv_batch_msgs != NULL) {
+			return (net_deliver_batch_fn (fd, instance));
+		}
+#endif
 		iovec = &instance->totemudp_iov_recv;
 	}
 
@@ -411,36 +571,10 @@ static int net_deliver_fn (
 	bytes_received = recvmsg (fd, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
 	if (bytes_received == -1) {
 		return (0);
-	} else {
-		instance->stats_recv += bytes_received;
-	}
-
-	if (bytes_received >= UDP_RECEIVE_FRAME_SIZE_MAX + 1) {
-		/*
-		 * Maximum packet size should be UDP_RECEIVE_FRAME_SIZE_MAX.
-		 * If received packet is UDP_RECEIVE_FRAME_SIZE_MAX + 1 it means packet was truncated
-		 * (iov_buffer size and iov_len are intentionally set to UDP_RECEIVE_FRAME_SIZE_MAX + 1).
-		 */
-		log_printf (instance->totemudp_log_level_error,
-				"Received too big message. This may be because something bad is happening "
-				"on the network (attack?), or you tried join more nodes than corosync is "
-				"compiled with (%u) or bug in the code (bad estimation of "
-				"the UDP_RECEIVE_FRAME_SIZE_MAX). Dropping packet.", PROCESSOR_COUNT_MAX);
-		return (0);
 	}
 
-	iovec->iov_len = bytes_received;
+	net_deliver_datagram (instance, iovec, bytes_received, &system_from);
 
-	/*
-	 * Handle incoming message
-	 */
-	instance->totemudp_deliver_fn (
-		instance->context,
-		iovec->iov_base,
-		iovec->iov_len,
-		&system_from);
-
-	iovec->iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1;
 	return (0);
 }
 
@@ -1142,6 +1276,7 @@ int totemudp_initialize (
 	totemip_copy (&instance->mcast_address, &instance->totem_interface->mcast_addr);
 	memset (instance->iov_buffer, 0, UDP_RECEIVE_FRAME_SIZE_MAX + 1);
 	memset (instance->iov_buffer_flush, 0, UDP_RECEIVE_FRAME_SIZE_MAX + 1);
+	totemudp_recv_batch_alloc (instance);
 
 	instance->totemudp_poll_handle = poll_handle;
 
@@ -1389,6 +1524,18 @@ extern int totemudp_recv_mcast_empty (
 	msg_recv.msg_iov = &instance->totemudp_iov_recv_flush;
 	msg_recv.msg_iovlen = 1;
 
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Frames of a batch that is being delivered were received before
+	 * the flush, drop them together with the socket backlog
+	 */
+	for (i = instance->recv_batch_pos; i < instance->recv_batch_received; i++) {
+		instance->recv_batch_msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		msg_processed = 1;
+	}
+	instance->recv_batch_pos = instance->recv_batch_received;
+#endif
+
 	for (i = 0; i < 2; i++) {
 		sock = -1;
 		if (i == 0) {
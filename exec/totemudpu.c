@@ -82,9 +82,17 @@
 #define BIND_STATE_REGULAR	1
 #define BIND_STATE_LOOPBACK	2
 
+/*
+ * Number of buckets of the member address hash, must be power of 2
+ */
+#define MEMBER_HASH_SIZE	256
+
 struct totemudpu_member {
 	struct qb_list_head list;
+	struct qb_list_head hash_list;
 	struct totem_ip_address member;
+	struct sockaddr_storage sockaddr;
+	int sockaddr_len;
 	int fd;
 	int active;
 };
@@ -143,8 +151,38 @@ struct totemudpu_instance {
 
 	struct iovec totemudpu_iov_recv;
 
+	/*
+	 * Batched receive ring (totem.udp_recv_batch entries), NULL when
+	 * receiving one datagram per wakeup
+	 */
+	unsigned int recv_batch;
+
+	char *recv_batch_buffer;
+
+	struct iovec *recv_batch_iov;
+
+	struct sockaddr_storage *recv_batch_from;
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr *recv_batch_msgs;
+
+	/*
+	 * Ring entries [recv_batch_pos, recv_batch_received) are not
+	 * delivered yet
+	 */
+	int recv_batch_received;
+
+	int recv_batch_pos;
+#endif
+
 	struct qb_list_head member_list;
 
+	/*
+	 * Members hashed by address, used to filter received datagrams
+	 * without walking member_list
+	 */
+	struct qb_list_head member_hash[MEMBER_HASH_SIZE];
+
 	int stats_sent;
 
 	int stats_recv;
@@ -173,6 +211,16 @@ struct totemudpu_instance {
 
 	int token_socket;
 
+	/*
+	 * Socket used to send one mcast frame to all members with a single
+	 * sendmmsg call
+	 */
+	int fanout_socket;
+
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr fanout_msgs[PROCESSOR_COUNT_MAX];
+#endif
+
 	int local_loop_sock[2];
 
 	qb_loop_timer_handle timer_merge_detect_timeout;
@@ -208,6 +256,8 @@ static void totemudpu_stop_merge_detect_timeout(
 
 static void totemudpu_instance_initialize (struct totemudpu_instance *instance)
 {
+	int i;
+
 	memset (instance, 0, sizeof (struct totemudpu_instance));
 
 	instance->netif_state_report = NETIF_STATE_REPORT_UP | NETIF_STATE_REPORT_DOWN;
@@ -222,6 +272,16 @@ static void totemudpu_instance_initialize (struct totemudpu_instance *instance)
 	instance->my_memb_entries = 1;
 
 	qb_list_init (&instance->member_list);
+
+	for (i = 0; i < MEMBER_HASH_SIZE; i++) {
+		qb_list_init (&instance->member_hash[i]);
+	}
+
+#ifdef HAVE_SENDMMSG
+	for (i = 0; i < PROCESSOR_COUNT_MAX; i++) {
+		instance->fanout_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
 }
 
 #define log_printf(level, format, args...)		\
@@ -241,6 +301,65 @@ do {												\
 		fmt ": %s (%d)", ##args, _error_ptr, err_num);				\
 	} while(0)
 
+static void totemudpu_recv_batch_free (struct totemudpu_instance *instance)
+{
+	free (instance->recv_batch_buffer);
+	free (instance->recv_batch_iov);
+	free (instance->recv_batch_from);
+	instance->recv_batch_buffer = NULL;
+	instance->recv_batch_iov = NULL;
+	instance->recv_batch_from = NULL;
+#ifdef HAVE_RECVMMSG
+	free (instance->recv_batch_msgs);
+	instance->recv_batch_msgs = NULL;
+	instance->recv_batch_received = 0;
+	instance->recv_batch_pos = 0;
+#endif
+	instance->recv_batch = 1;
+}
+
+static void totemudpu_recv_batch_alloc (struct totemudpu_instance *instance)
+{
+#ifdef HAVE_RECVMMSG
+	unsigned int i;
+
+	instance->recv_batch = instance->totem_config->udp_recv_batch;
+	if (instance->recv_batch <= 1) {
+		instance->recv_batch = 1;
+		return;
+	}
+
+	/*
+	 * Buffer is not touched here, so only the pages actually
+	 * written by received datagrams become resident
+	 */
+	instance->recv_batch_buffer = malloc ((size_t)instance->recv_batch * (UDP_RECEIVE_FRAME_SIZE_MAX + 1));
+	instance->recv_batch_iov = malloc (instance->recv_batch * sizeof (struct iovec));
+	instance->recv_batch_from = malloc (instance->recv_batch * sizeof (struct sockaddr_storage));
+	instance->recv_batch_msgs = calloc (instance->recv_batch, sizeof (struct mmsghdr));
+	if (instance->recv_batch_buffer == NULL || instance->recv_batch_iov == NULL ||
+	    instance->recv_batch_from == NULL || instance->recv_batch_msgs == NULL) {
+		log_printf (instance->totemudpu_log_level_warning,
+			"Unable to allocate receive batch of %u datagrams, receiving one datagram at a time",
+			instance->recv_batch);
+		totemudpu_recv_batch_free (instance);
+		return;
+	}
+
+	for (i = 0; i < instance->recv_batch; i++) {
+		instance->recv_batch_iov[i].iov_base = instance->recv_batch_buffer +
+			(size_t)i * (UDP_RECEIVE_FRAME_SIZE_MAX + 1);
+		instance->recv_batch_iov[i].iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1;
+		instance->recv_batch_msgs[i].msg_hdr.msg_name = &instance->recv_batch_from[i];
+		instance->recv_batch_msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		instance->recv_batch_msgs[i].msg_hdr.msg_iov = &instance->recv_batch_iov[i];
+		instance->recv_batch_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#else
+	instance->recv_batch = 1;
+#endif
+}
+
 int totemudpu_crypto_set (
 	void *udpu_context,
 	const char *cipher_type,
@@ -298,6 +417,39 @@ static inline void ucast_sendmsg (
 	}
 }
 
+#ifdef HAVE_SENDMMSG
+/*
+ * Returns number of messages which failed to be sent
+ */
+static inline unsigned int mcast_sendmmsg_flush (
+	struct totemudpu_instance *instance,
+	unsigned int msgs_count)
+{
+	unsigned int sent = 0;
+	unsigned int failed = 0;
+	int res;
+
+	while (sent < msgs_count) {
+		res = sendmmsg (instance->fanout_socket, &instance->fanout_msgs[sent],
+			msgs_count - sent, MSG_NOSIGNAL);
+		if (res < 0) {
+			/*
+			 * First message of the remaining batch failed, skip it.
+			 * An error here is recovered by totemsrp
+			 */
+			LOGSYS_PERROR (errno, instance->totemudpu_log_level_debug,
+				"sendmmsg(mcast) failed (non-critical)");
+			sent++;
+			failed++;
+		} else {
+			sent += res;
+		}
+	}
+
+	return (failed);
+}
+#endif
+
 static inline void mcast_sendmsg (
 	struct totemudpu_instance *instance,
 	const void *msg,
@@ -307,15 +459,21 @@ static inline void mcast_sendmsg (
 	struct msghdr msg_mcast;
 	int res = 0;
 	struct iovec iovec;
-	struct sockaddr_storage sockaddr;
-	int addrlen;
 	struct qb_list_head *list;
 	struct totemudpu_member *member;
+	unsigned int sends = 0;
+	unsigned int failed = 0;
+#ifdef HAVE_SENDMMSG
+	unsigned int msgs_count = 0;
+#endif
 
 	iovec.iov_base = (void *)msg;
 	iovec.iov_len = msg_len;
 
 	memset(&msg_mcast, 0, sizeof(msg_mcast));
+	msg_mcast.msg_iov = (void *)&iovec;
+	msg_mcast.msg_iovlen = 1;
+
 	/*
 	 * Build multicast message
 	 */
@@ -329,13 +487,24 @@ static inline void mcast_sendmsg (
 			if (only_active && !member->active && !instance->send_merge_detect_message)
 				continue ;
 
-			totemip_totemip_to_sockaddr_convert(&member->member,
-				instance->totem_interface->ip_port, &sockaddr, &addrlen);
-			memset(&msg_mcast, 0, sizeof(msg_mcast));
-			msg_mcast.msg_name = &sockaddr;
-			msg_mcast.msg_namelen = addrlen;
-			msg_mcast.msg_iov = (void *)&iovec;
-			msg_mcast.msg_iovlen = 1;
+			sends++;
+
+#ifdef HAVE_SENDMMSG
+			if (instance->fanout_socket > 0) {
+				instance->fanout_msgs[msgs_count].msg_hdr.msg_name = &member->sockaddr;
+				instance->fanout_msgs[msgs_count].msg_hdr.msg_namelen = member->sockaddr_len;
+				instance->fanout_msgs[msgs_count].msg_hdr.msg_iov = &iovec;
+				msgs_count++;
+				if (msgs_count == PROCESSOR_COUNT_MAX) {
+					failed += mcast_sendmmsg_flush (instance, msgs_count);
+					msgs_count = 0;
+				}
+				continue;
+			}
+#endif
+
+			msg_mcast.msg_name = &member->sockaddr;
+			msg_mcast.msg_namelen = member->sockaddr_len;
 
 			/*
 			 * Transmit multicast message
@@ -345,9 +514,26 @@ static inline void mcast_sendmsg (
 			if (res < 0) {
 				LOGSYS_PERROR (errno, instance->totemudpu_log_level_debug,
 					"sendmsg(mcast) failed (non-critical)");
+				failed++;
 			}
 		}
 
+#ifdef HAVE_SENDMMSG
+		if (msgs_count > 0) {
+			failed += mcast_sendmmsg_flush (instance, msgs_count);
+		}
+#endif
+
+		/*
+		 * Same meaning as failed mcast of totemudp, so only sending to
+		 * all members counts. One dead member is not a local problem.
+		 */
+		if (sends > 0 && failed == sends) {
+			instance->stats->continuous_sendmsg_failures++;
+		} else {
+			instance->stats->continuous_sendmsg_failures = 0;
+		}
+
 		if (!only_active || instance->send_merge_detect_message) {
 			/*
 			 * Current message was sent to all nodes
@@ -360,11 +546,6 @@ static inline void mcast_sendmsg (
 		 * Transmit multicast message to local unix mcast loop
 		 * An error here is recovered by totemsrp
 		 */
-		msg_mcast.msg_name = NULL;
-		msg_mcast.msg_namelen = 0;
-		msg_mcast.msg_iov = (void *)&iovec;
-		msg_mcast.msg_iovlen = 1;
-
 		res = sendmsg (instance->local_loop_sock[1], &msg_mcast,
 			MSG_NOSIGNAL);
 		if (res < 0) {
@@ -393,65 +574,89 @@ int totemudpu_finalize (
 		close (instance->local_loop_sock[1]);
 	}
 
+	if (instance->fanout_socket > 0) {
+		close (instance->fanout_socket);
+	}
+
 	totemudpu_stop_merge_detect_timeout(instance);
 
+	totemudpu_recv_batch_free (instance);
+
 	return (res);
 }
 
+/*
+ * FNV-1a hash of the raw address bytes
+ */
+static unsigned int member_hash_addr (
+	const void *addr,
+	size_t addr_len)
+{
+	const unsigned char *p = (const unsigned char *)addr;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < addr_len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+
+	return (hash & (MEMBER_HASH_SIZE - 1));
+}
+
+static unsigned int member_hash_totemip (
+	const struct totem_ip_address *totem_ip)
+{
+	if (totem_ip->family == AF_INET6) {
+		return (member_hash_addr (totem_ip->addr, sizeof (struct in6_addr)));
+	}
+
+	return (member_hash_addr (totem_ip->addr, sizeof (struct in_addr)));
+}
+
 static struct totemudpu_member *find_member_by_sockaddr(
 	const void *udpu_context,
 	const struct sockaddr *sa)
 {
 	struct qb_list_head *list;
 	struct totemudpu_member *member;
-	struct totemudpu_member *res_member;
 	const struct totemudpu_instance *instance = (const struct totemudpu_instance *)udpu_context;
+	unsigned int hash;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		hash = member_hash_addr (&((const struct sockaddr_in *)sa)->sin_addr,
+			sizeof (struct in_addr));
+		break;
+	case AF_INET6:
+		hash = member_hash_addr (&((const struct sockaddr_in6 *)sa)->sin6_addr,
+			sizeof (struct in6_addr));
+		break;
+	default:
+		return (NULL);
+	}
 
-	res_member = NULL;
-
-	qb_list_for_each(list, &(instance->member_list)) {
+	qb_list_for_each(list, &(instance->member_hash[hash])) {
 		member = qb_list_entry (list,
 			struct totemudpu_member,
-			list);
+			hash_list);
 
 		if (totemip_sa_equal(&member->member, sa)) {
-			res_member = member;
-			break ;
+			return (member);
 		}
 	}
 
-	return (res_member);
+	return (NULL);
 }
 
 
-static int net_deliver_fn (
-	int fd,
-	int revents,
-	void *data)
+static void net_deliver_datagram (
+	struct totemudpu_instance *instance,
+	struct iovec *iovec,
+	int bytes_received,
+	const struct sockaddr_storage *system_from)
 {
-	struct totemudpu_instance *instance = (struct totemudpu_instance *)data;
-	struct msghdr msg_recv;
-	struct iovec *iovec;
-	struct sockaddr_storage system_from;
-	int bytes_received;
-
-	iovec = &instance->totemudpu_iov_recv;
-
-	/*
-	 * Receive datagram
-	 */
-	memset(&msg_recv, 0, sizeof(msg_recv));
-	msg_recv.msg_name = &system_from;
-	msg_recv.msg_namelen = sizeof (struct sockaddr_storage);
-	msg_recv.msg_iov = iovec;
-	msg_recv.msg_iovlen = 1;
-
-	bytes_received = recvmsg (fd, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
-	if (bytes_received == -1) {
-		return (0);
-	} else {
-		instance->stats_recv += bytes_received;
-	}
+	instance->stats_recv += bytes_received;
 
 	if (bytes_received >= UDP_RECEIVE_FRAME_SIZE_MAX + 1) {
 		/*
@@ -464,30 +669,101 @@ static int net_deliver_fn (
 				"on the network (attack?), or you tried join more nodes than corosync is "
 				"compiled with (%u) or bug in the code (bad estimation of "
 				"the UDP_RECEIVE_FRAME_SIZE_MAX). Dropping packet.", PROCESSOR_COUNT_MAX);
-		return (0);
+		return;
 	}
 
 	if (instance->totem_config->block_unlisted_ips &&
 	    instance->netif_bind_state == BIND_STATE_REGULAR &&
-	    find_member_by_sockaddr(instance, (const struct sockaddr *)&system_from) == NULL) {
+	    find_member_by_sockaddr(instance, (const struct sockaddr *)system_from) == NULL) {
 		log_printf(instance->totemudpu_log_level_debug, "Packet rejected from %s",
-		    totemip_sa_print((const struct sockaddr *)&system_from));
+		    totemip_sa_print((const struct sockaddr *)system_from));
 
-		return (0);
+		return;
 	}
 
-	iovec->iov_len = bytes_received;
-
 	/*
 	 * Handle incoming message
 	 */
 	instance->totemudpu_deliver_fn (
 		instance->context,
 		iovec->iov_base,
-		iovec->iov_len,
-		&system_from);
+		bytes_received,
+		system_from);
+}
+
+#ifdef HAVE_RECVMMSG
+static int net_deliver_batch_fn (
+	int fd,
+	struct totemudpu_instance *instance)
+{
+	int received;
+	int i;
+
+	/*
+	 * Drain up to recv_batch datagrams with one syscall and deliver
+	 * them in the order they were received
+	 */
+	received = recvmmsg (fd, instance->recv_batch_msgs, instance->recv_batch,
+		MSG_NOSIGNAL | MSG_DONTWAIT, NULL);
+	if (received == -1) {
+		return (0);
+	}
+
+	instance->recv_batch_received = received;
+	instance->recv_batch_pos = 0;
+
+	/*
+	 * A pause flush (totemudpu_recv_mcast_empty) run while one of these
+	 * frames is delivered drops the rest of the batch
+	 */
+	while (instance->recv_batch_pos < instance->recv_batch_received) {
+		i = instance->recv_batch_pos++;
+
+		net_deliver_datagram (instance, &instance->recv_batch_iov[i],
+			instance->recv_batch_msgs[i].msg_len, &instance->recv_batch_from[i]);
+
+		instance->recv_batch_msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+	}
+
+	return (0);
+}
+#endif
+
+static int net_deliver_fn (
+	int fd,
+	int revents,
+	void *data)
+{
+	struct totemudpu_instance *instance = (struct totemudpu_instance *)data;
+	struct msghdr msg_recv;
+	struct iovec *iovec;
+	struct sockaddr_storage system_from;
+	int bytes_received;
+
+#ifdef HAVE_RECVMMSG
+	if (instance->recv_batch_msgs != NULL) {
+		return (net_deliver_batch_fn (fd, instance));
+	}
+#endif
+
+	iovec = &instance->totemudpu_iov_recv;
+
+	/*
+	 * Receive datagram
+	 */
+	memset(&msg_recv, 0, sizeof(msg_recv));
+	msg_recv.msg_name = &system_from;
+	msg_recv.msg_namelen = sizeof (struct sockaddr_storage);
+	msg_recv.msg_iov = iovec;
+	msg_recv.msg_iovlen = 1;
+
+	bytes_received = recvmsg (fd, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (bytes_received == -1) {
+		return (0);
+	}
+
+	net_deliver_datagram (instance, iovec, bytes_received, &system_from);
 
-	iovec->iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1;
 	return (0);
 }
 
@@ -938,6 +1214,7 @@ int totemudpu_initialize (
 	 */
 	instance->totem_interface = &totem_config->interfaces[0];
 	memset (instance->iov_buffer, 0, UDP_RECEIVE_FRAME_SIZE_MAX + 1);
+	totemudpu_recv_batch_alloc (instance);
 
 	instance->totemudpu_poll_handle = poll_handle;
 
@@ -1128,6 +1405,18 @@ extern int totemudpu_recv_mcast_empty (
 	msg_recv.msg_iov = &instance->totemudpu_iov_recv;
 	msg_recv.msg_iovlen = 1;
 
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Frames of a batch that is being delivered were received before
+	 * the flush, drop them together with the socket backlog
+	 */
+	for (i = instance->recv_batch_pos; i < instance->recv_batch_received; i++) {
+		instance->recv_batch_msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		msg_processed = 1;
+	}
+	instance->recv_batch_pos = instance->recv_batch_received;
+#endif
+
 	for (i = 0; i < 2; i++) {
 		sock = -1;
 		if (i == 0) {
@@ -1256,9 +1545,20 @@ int totemudpu_member_add (
 	qb_list_init (&new_member->list);
 	qb_list_add_tail (&new_member->list, &instance->member_list);
 	memcpy (&new_member->member, member, sizeof (struct totem_ip_address));
+	qb_list_init (&new_member->hash_list);
+	qb_list_add_tail (&new_member->hash_list,
+		&instance->member_hash[member_hash_totemip (&new_member->member)]);
+	totemip_totemip_to_sockaddr_convert(&new_member->member,
+		instance->totem_interface->ip_port, &new_member->sockaddr, &new_member->sockaddr_len);
 	new_member->fd = totemudpu_create_sending_socket(udpu_context, member);
 	new_member->active = 1;
 
+#ifdef HAVE_SENDMMSG
+	if (instance->fanout_socket <= 0) {
+		instance->fanout_socket = totemudpu_create_sending_socket(udpu_context, member);
+	}
+#endif
+
 	return (0);
 }
 
@@ -1304,6 +1604,7 @@ int totemudpu_member_remove (
 	 */
 	if (found) {
 		qb_list_del (list);
+		qb_list_del (&member->hash_list);
 	}
 
 	instance = NULL;
@@ -1330,6 +1631,20 @@ int totemudpu_member_list_rebind_ip (
 		member->fd = totemudpu_create_sending_socket(udpu_context, &member->member);
 	}
 
+#ifdef HAVE_SENDMMSG
+	if (instance->fanout_socket > 0) {
+		close (instance->fanout_socket);
+		instance->fanout_socket = 0;
+	}
+
+	if (!qb_list_empty (&instance->member_list)) {
+		member = qb_list_first_entry (&instance->member_list,
+			struct totemudpu_member,
+			list);
+		instance->fanout_socket = totemudpu_create_sending_socket(udpu_context, &member->member);
+	}
+#endif
+
 	return (0);
 }
 
@@ -63,6 +63,11 @@ typedef uint64_t cmap_iter_handle_t;
  */
 typedef uint64_t cmap_track_handle_t;
 
+/*
+ * Handle for cmap snapshot
+ */
+typedef uint64_t cmap_snapshot_handle_t;
+
 /*
  * Maximum length of key in cmap
  */
@@ -86,6 +91,15 @@ typedef uint64_t cmap_track_handle_t;
  */
 #define CMAP_TRACK_PREFIX	8
 
+/**
+ * Notifications of tracker are collected together with other coalesced
+ * notifications of the same handle made in one iteration of corosync main
+ * loop and delivered as single dispatch event. notify_fn is still called
+ * once per change and in order of changes. This value is never returned
+ * inside of callback and is used only in adding track
+ */
+#define CMAP_TRACK_COALESCE	16
+
 /**
  * Possible types of value. Binary is raw data without trailing zero with given length
  */
@@ -332,6 +346,33 @@ extern cs_error_t cmap_iter_next(
 		size_t *value_len,
 		cmap_value_types_t *type);
 
+/**
+ * @brief Return next item in iteration together with its value
+ *
+ * Same as cmap_iter_next, but also pointer to value is returned. Value is read
+ * together with key (keys are transferred from server in batches) and it's valid
+ * only until next call of cmap_iter_next, cmap_iter_next_value or cmap_iter_finalize.
+ * Key returned from a batch may have been changed or deleted since the batch was
+ * received.
+ *
+ * @param handle cmap handle
+ * @param iter_handle iterator handle
+ * @param key_name place to store name of key. Maximum length is CMAP_KEYNAME_MAXLEN and
+ *                 trailing zero is always added so size of the buffer has to be at least
+ *                 CMAP_KEYNAME_MAXLEN + 1.
+ * @param value place to store pointer to value (can be NULL)
+ * @param value_len length of value
+ * @param type type of value
+ * @return CS_NO_SECTION if there are no more sections to iterate
+ */
+extern cs_error_t cmap_iter_next_value(
+		cmap_handle_t handle,
+		cmap_iter_handle_t iter_handle,
+		char key_name[],
+		const void **value,
+		size_t *value_len,
+		cmap_value_types_t *type);
+
 /**
  * @brief Finalize iterator
  * @param handle
@@ -340,6 +381,48 @@ extern cs_error_t cmap_iter_next(
  */
 extern cs_error_t cmap_iter_finalize(cmap_handle_t handle, cmap_iter_handle_t iter_handle);
 
+/**
+ * @brief Create snapshot of all keys (names, types and values) with given prefix.
+ *
+ * Unlike iterator, whole prefix is transferred in (usually) one IPC call and
+ * values are taken at (almost) same time. Keys can be read by cmap_snapshot_next.
+ * Snapshot is independent of cmap handle and must be freed by cmap_snapshot_free.
+ *
+ * @param handle cmap handle
+ * @param prefix prefix of keys to include (NULL or empty string for all keys)
+ * @param cmap_snapshot_handle handle used for reading and freeing of snapshot
+ * @return CS_OK on success, CS_ERR_NO_SECTIONS if map doesn't exist
+ */
+extern cs_error_t cmap_snapshot_create(
+	cmap_handle_t handle,
+	const char *prefix,
+	cmap_snapshot_handle_t *cmap_snapshot_handle);
+
+/**
+ * @brief Return next key from snapshot.
+ *
+ * Returned pointers are valid until snapshot is freed. Keys are returned sorted.
+ *
+ * @param snapshot_handle snapshot handle
+ * @param key_name place to store pointer to name of key
+ * @param value place to store pointer to value (can be NULL)
+ * @param value_len length of value (can be NULL)
+ * @param type type of value (can be NULL)
+ * @return CS_OK on success, CS_ERR_NO_SECTIONS if there are no more keys
+ */
+extern cs_error_t cmap_snapshot_next(
+	cmap_snapshot_handle_t snapshot_handle,
+	const char **key_name,
+	const void **value,
+	size_t *value_len,
+	cmap_value_types_t *type);
+
+/**
+ * @brief Free snapshot created by cmap_snapshot_create
+ * @param snapshot_handle snapshot handle
+ */
+extern cs_error_t cmap_snapshot_free(cmap_snapshot_handle_t snapshot_handle);
+
 /**
  * @brief Add tracking function for given key_name.
  *
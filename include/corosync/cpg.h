@@ -192,6 +192,7 @@ typedef struct {
 } cpg_model_data_t;
 
 #define CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF 0x01
+#define CPG_MODEL_V1_DELIVER_BATCHED 0x02
 
 /**
  * @brief The cpg_model_v1_data_t struct
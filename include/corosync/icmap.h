@@ -127,6 +127,11 @@ typedef qb_map_iter_t *icmap_iter_t;
  */
 typedef struct icmap_track *icmap_track_t;
 
+/**
+ * @brief Counter type
+ */
+typedef struct icmap_counter *icmap_counter_t;
+
 /**
  * @brief Initialize global icmap
  * @return
@@ -440,6 +445,60 @@ extern cs_error_t icmap_fast_dec(const char *key_name);
  */
 extern cs_error_t icmap_fast_dec_r(const icmap_map_t map, const char *key_name);
 
+/**
+ * @brief Create counter handle for [u]int* key
+ *
+ * Counter is meant for values changed on hot paths. Key is looked up only
+ * on first use (and again if it was replaced or deleted in the meantime),
+ * after that icmap_counter_adjust just changes value in place. Readers
+ * see new value at once, but trackers are called only from
+ * icmap_counter_notify. Key doesn't have to exist when counter is created.
+ *
+ * @param key_name
+ * @param counter
+ * @return
+ */
+extern cs_error_t icmap_counter_create(const char *key_name, icmap_counter_t *counter);
+
+/**
+ * @brief icmap_counter_create_r
+ * @param map
+ * @param key_name
+ * @param counter
+ * @return
+ */
+extern cs_error_t icmap_counter_create_r(const icmap_map_t map, const char *key_name,
+	icmap_counter_t *counter);
+
+/**
+ * @brief Destroy counter handle. Key itself is not changed.
+ * @param counter
+ */
+extern void icmap_counter_destroy(icmap_counter_t counter);
+
+/**
+ * @brief Add step to value of counter key
+ * @param counter
+ * @param step
+ * @return CS_ERR_INVALID_PARAM if counter is NULL (e.g. its creation failed)
+ */
+extern cs_error_t icmap_counter_adjust(icmap_counter_t counter, int32_t step);
+
+/**
+ * @brief Increase value of counter key by one
+ * @param counter
+ * @return
+ */
+extern cs_error_t icmap_counter_inc(icmap_counter_t counter);
+
+/**
+ * @brief Call trackers of all counters changed since last call
+ *
+ * Old value passed to tracking callback is undefined, same as for
+ * icmap_fast_adjust_int.
+ */
+extern void icmap_counter_notify(void);
+
 /**
  * @brief Initialize iterator with given prefix
  * @param prefix
@@ -537,12 +596,56 @@ extern void icmap_convert_name_to_valid_name(char *key_name);
 
 /**
  * @brief Copy content of src_map icmap to dst_map icmap.
+ *
+ * Values are not copied, items are shared by both maps. Keys with value
+ * already equal in dst_map are left untouched.
+ *
  * @param dst_map
  * @param src_map
  * @return
  */
 extern cs_error_t icmap_copy_map(icmap_map_t dst_map, const icmap_map_t src_map);
 
+/**
+ * Prototype for icmap_diff_r callback. event is ICMAP_TRACK_ADD (key only in new map),
+ * ICMAP_TRACK_DELETE (key only in old map) or ICMAP_TRACK_MODIFY (value differs).
+ * Callback must not change either of compared maps.
+ */
+typedef void (*icmap_diff_fn_t) (
+	int32_t event,
+	const char *key_name,
+	void *user_data);
+
+/**
+ * @brief Call diff_fn for every key which differs between old_map and new_map.
+ *
+ * Keys are visited in sorted order by one walk over both maps.
+ *
+ * @param old_map
+ * @param new_map
+ * @param diff_fn
+ * @param user_data
+ * @return
+ */
+extern cs_error_t icmap_diff_r(
+	const icmap_map_t old_map,
+	const icmap_map_t new_map,
+	icmap_diff_fn_t diff_fn,
+	void *user_data);
+
+/**
+ * @brief Copy key_name (with its value) from src_map to dst_map.
+ *
+ * Value is not copied, item is shared by both maps. Nothing is done if
+ * value in dst_map is already equal.
+ *
+ * @param dst_map
+ * @param src_map
+ * @param key_name
+ * @return CS_ERR_NOT_EXIST if key_name is not in src_map
+ */
+extern cs_error_t icmap_copy_key(icmap_map_t dst_map, const icmap_map_t src_map, const char *key_name);
+
 /*
  * Returns length of value of given type, or 0 for string and binary data type
  */
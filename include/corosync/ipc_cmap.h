@@ -53,6 +53,8 @@ enum req_cmap_types {
 	MESSAGE_REQ_CMAP_TRACK_ADD = 7,
 	MESSAGE_REQ_CMAP_TRACK_DELETE = 8,
 	MESSAGE_REQ_CMAP_SET_CURRENT_MAP = 9,
+	MESSAGE_REQ_CMAP_SNAPSHOT = 10,
+	MESSAGE_REQ_CMAP_ITER_NEXT_BATCH = 11,
 };
 
 /**
@@ -70,6 +72,9 @@ enum res_cmap_types {
 	MESSAGE_RES_CMAP_TRACK_DELETE = 8,
 	MESSAGE_RES_CMAP_NOTIFY_CALLBACK = 9,
 	MESSAGE_RES_CMAP_SET_CURRENT_MAP = 10,
+	MESSAGE_RES_CMAP_SNAPSHOT = 11,
+	MESSAGE_RES_CMAP_ITER_NEXT_BATCH = 12,
+	MESSAGE_RES_CMAP_NOTIFY_BATCH_CALLBACK = 13,
 };
 
 enum {
@@ -250,6 +255,20 @@ struct res_lib_cmap_notify_callback {
 	mar_uint8_t new_value[];
 };
 
+/**
+ * Several notifications packed into one dispatch event, sent for trackers
+ * added with CMAP_TRACK_COALESCE. data holds items complete
+ * res_lib_cmap_notify_callback messages, each starting at a multiple of
+ * CMAP_NOTIFY_BATCH_ALIGN.
+ */
+struct res_lib_cmap_notify_batch_callback {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t items __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
+
+#define CMAP_NOTIFY_BATCH_ALIGN(size) (((size) + 7) & ~((size_t)7))
+
 /**
  * @brief The req_lib_cmap_set_current_map struct
  * used by cmap_initialize_map()
@@ -259,5 +278,72 @@ struct req_lib_cmap_set_current_map {
 	mar_int32_t map __attribute__((aligned(8)));
 };
 
+/**
+ * @brief The req_lib_cmap_snapshot struct
+ * used by cmap_snapshot_create(). Keys sorting after start_after
+ * (or all keys if its length is 0) are returned, up to max_size bytes of
+ * response. When start_after is the last key of the previous page of the
+ * same prefix, the server continues from its saved position.
+ */
+struct req_lib_cmap_snapshot {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_name_t prefix __attribute__((aligned(8)));
+	mar_name_t start_after __attribute__((aligned(8)));
+	mar_size_t max_size __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cmap_snapshot struct
+ * data contains items res_lib_cmap_snapshot_item. more is set when
+ * not all keys fit into the response.
+ */
+struct res_lib_cmap_snapshot {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t items __attribute__((aligned(8)));
+	mar_uint32_t more __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The req_lib_cmap_iter_next_batch struct
+ * used by cmap_iter_next(). Returns as many following keys (with values)
+ * as fit into max_size bytes of response.
+ */
+struct req_lib_cmap_iter_next_batch {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint64_t iter_handle __attribute__((aligned(8)));
+	mar_size_t max_size __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cmap_iter_next_batch struct
+ * data contains items res_lib_cmap_snapshot_item. end is set when
+ * there are no more keys to iterate.
+ */
+struct res_lib_cmap_iter_next_batch {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t items __attribute__((aligned(8)));
+	mar_uint32_t end __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cmap_snapshot_item struct
+ * (used also by res_lib_cmap_iter_next_batch) data contains key_len bytes of key name, zero byte and (8 bytes
+ * aligned) value. Size of item is CMAP_SNAPSHOT_ITEM_SIZE.
+ */
+struct res_lib_cmap_snapshot_item {
+	mar_uint32_t key_len __attribute__((aligned(8)));
+	mar_uint8_t type __attribute__((aligned(8)));
+	mar_size_t value_len __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
+
+#define CMAP_SNAPSHOT_ALIGN(len)	(((len) + 7) & ~((size_t)7))
+#define CMAP_SNAPSHOT_VALUE_OFFSET(key_len)	CMAP_SNAPSHOT_ALIGN((key_len) + 1)
+#define CMAP_SNAPSHOT_ITEM_SIZE(key_len, value_len) \
+	(sizeof(struct res_lib_cmap_snapshot_item) + CMAP_SNAPSHOT_VALUE_OFFSET(key_len) + \
+	 CMAP_SNAPSHOT_ALIGN(value_len))
+
 
 #endif /* IPC_CMAP_H_DEFINED */
@@ -59,6 +59,7 @@ enum req_cpg_types {
 	MESSAGE_REQ_CPG_ZC_FREE = 10,
 	MESSAGE_REQ_CPG_ZC_EXECUTE = 11,
 	MESSAGE_REQ_CPG_PARTIAL_MCAST = 12,
+	MESSAGE_REQ_CPG_PARTIAL_MCAST_PIPELINED = 13,
 };
 
 /**
@@ -84,6 +85,8 @@ enum res_cpg_types {
 	MESSAGE_RES_CPG_ZC_EXECUTE = 16,
 	MESSAGE_RES_CPG_PARTIAL_DELIVER_CALLBACK = 17,
 	MESSAGE_RES_CPG_PARTIAL_SEND = 18,
+	MESSAGE_RES_CPG_PARTIAL_SEND_ACK = 19,
+	MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK = 20,
 };
 
 /**
@@ -298,6 +301,18 @@ struct res_lib_cpg_partial_send {
 	struct qb_ipc_response_header header __attribute__((aligned(8)));
 };
 
+/**
+ * @brief The res_lib_cpg_partial_send_ack struct
+ *
+ * Sent for every pipelined fragment with ack_request set. acked is the
+ * number of bytes of the message the executive has accepted so far. With
+ * CS_ERR_TRY_AGAIN the library resends starting at acked.
+ */
+struct res_lib_cpg_partial_send_ack {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t acked __attribute__((aligned(8)));
+};
+
 /**
  * @brief The req_lib_cpg_mcast struct
  */
@@ -320,6 +335,20 @@ struct req_lib_cpg_partial_mcast {
 	mar_uint8_t message[] __attribute__((aligned(8)));
 };
 
+/**
+ * @brief The req_lib_cpg_partial_mcast_pipelined struct
+ */
+struct req_lib_cpg_partial_mcast_pipelined {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint32_t guarantee __attribute__((aligned(8)));
+	mar_uint32_t msglen __attribute__((aligned(8)));
+	mar_uint32_t fraglen __attribute__((aligned(8)));
+	mar_uint32_t type __attribute__((aligned(8)));
+	mar_uint32_t offset __attribute__((aligned(8)));
+	mar_uint32_t ack_request __attribute__((aligned(8)));
+	mar_uint8_t message[] __attribute__((aligned(8)));
+};
+
 /**
  * @brief The res_lib_cpg_mcast struct
  */
@@ -339,6 +368,20 @@ struct res_lib_cpg_deliver_callback {
 	mar_uint8_t message[] __attribute__((aligned(8)));
 };
 
+/**
+ * Several deliveries packed into one dispatch event, sent to clients joined
+ * with CPG_MODEL_V1_DELIVER_BATCHED. data holds items complete
+ * res_lib_cpg_deliver_callback messages, each starting at a multiple of
+ * CPG_DELIVER_BATCH_ALIGN.
+ */
+struct res_lib_cpg_deliver_batch_callback {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t items __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
+
+#define CPG_DELIVER_BATCH_ALIGN(size) (((size) + 7) & ~((size_t)7))
+
 /**
  * @brief The res_lib_cpg_partial_deliver_callback struct
  */
@@ -39,12 +39,15 @@
 
 /**
  * @brief The sq struct
+ *
+ * items_inuse is bitmap (one bit per item) so runs of received items and
+ * holes can be found and released one word at a time.
  */
 struct sq {
 	unsigned int head;
 	unsigned int size;
 	void *items;
-	unsigned int *items_inuse;
+	unsigned long *items_inuse;
 	unsigned int *items_miss_count;
 	unsigned int size_per_item;
 	unsigned int head_seqid;
@@ -107,6 +110,109 @@ static inline int sq_lte_compare (unsigned int a, unsigned int b) {
 	return (0);
 }
 
+#define SQ_BITS_PER_WORD	(sizeof (unsigned long) * 8)
+
+/**
+ * @brief sq_bitmap_words
+ * @param item_count
+ * @return number of words of items_inuse bitmap
+ */
+static inline size_t sq_bitmap_words (unsigned int item_count)
+{
+	return ((item_count + SQ_BITS_PER_WORD - 1) / SQ_BITS_PER_WORD);
+}
+
+/**
+ * @brief sq_bitmap_test
+ * @param bitmap
+ * @param pos
+ * @return
+ */
+static inline int sq_bitmap_test (const unsigned long *bitmap, unsigned int pos)
+{
+	return ((bitmap[pos / SQ_BITS_PER_WORD] >> (pos % SQ_BITS_PER_WORD)) & 1UL);
+}
+
+/**
+ * @brief sq_bitmap_clear
+ * Clear count bits starting with pos (without wrap around)
+ * @param bitmap
+ * @param pos
+ * @param count
+ */
+static inline void sq_bitmap_clear (unsigned long *bitmap, unsigned int pos, unsigned int count)
+{
+	unsigned int bit;
+	unsigned int n;
+	unsigned long mask;
+
+	while (count > 0) {
+		bit = pos % SQ_BITS_PER_WORD;
+		n = SQ_BITS_PER_WORD - bit;
+		if (n > count) {
+			n = count;
+		}
+
+		if (n == SQ_BITS_PER_WORD) {
+			bitmap[pos / SQ_BITS_PER_WORD] = 0;
+		} else {
+			mask = ((1UL << n) - 1) << bit;
+			bitmap[pos / SQ_BITS_PER_WORD] &= ~mask;
+		}
+
+		pos += n;
+		count -= n;
+	}
+}
+
+/**
+ * @brief sq_bitmap_run
+ * Return number of consecutive bits starting with pos (without wrap around,
+ * at most count) which are set (inuse != 0) or clear (inuse == 0).
+ * @param bitmap
+ * @param pos
+ * @param count
+ * @param inuse
+ * @return
+ */
+static inline unsigned int sq_bitmap_run (
+	const unsigned long *bitmap,
+	unsigned int pos,
+	unsigned int count,
+	int inuse)
+{
+	unsigned int done = 0;
+	unsigned int bit;
+	unsigned int n;
+	unsigned long word;
+
+	while (done < count) {
+		bit = pos % SQ_BITS_PER_WORD;
+		word = bitmap[pos / SQ_BITS_PER_WORD];
+		if (inuse) {
+			word = ~word;
+		}
+		/*
+		 * Now first set bit in word ends the run
+		 */
+		word >>= bit;
+
+		n = SQ_BITS_PER_WORD - bit;
+		if (n > count - done) {
+			n = count - done;
+		}
+
+		if (word != 0 && (unsigned int)__builtin_ctzl (word) < n) {
+			return (done + __builtin_ctzl (word));
+		}
+
+		done += n;
+		pos += n;
+	}
+
+	return (done);
+}
+
 /**
  * @brief sq_init
  * @param sq
@@ -134,7 +240,7 @@ static inline int sq_init (
 	}
 	memset (sq->items, 0, item_count * size_per_item);
 
-	if ((sq->items_inuse = malloc (item_count * sizeof (unsigned int)))
+	if ((sq->items_inuse = malloc (sq_bitmap_words (item_count) * sizeof (unsigned long)))
 	    == NULL) {
 		return (-ENOMEM);
 	}
@@ -142,7 +248,7 @@ static inline int sq_init (
 	    == NULL) {
 		return (-ENOMEM);
 	}
-	memset (sq->items_inuse, 0, item_count * sizeof (unsigned int));
+	memset (sq->items_inuse, 0, sq_bitmap_words (item_count) * sizeof (unsigned long));
 	memset (sq->items_miss_count, 0, item_count * sizeof (unsigned int));
 	return (0);
 }
@@ -159,7 +265,7 @@ static inline void sq_reinit (struct sq *sq, unsigned int head_seqid)
 	sq->pos_max = 0;
 
 	memset (sq->items, 0, sq->item_count * sq->size_per_item);
-	memset (sq->items_inuse, 0, sq->item_count * sizeof (unsigned int));
+	memset (sq->items_inuse, 0, sq_bitmap_words (sq->item_count) * sizeof (unsigned long));
 	memset (sq->items_miss_count, 0, sq->item_count * sizeof (unsigned int));
 }
 
@@ -174,8 +280,9 @@ static inline void sq_assert (const struct sq *sq, unsigned int pos)
 
 //	printf ("Instrument[%d] Asserting from %d to %d\n",
 //		pos, sq->pos_max, sq->size);
-	for (i = sq->pos_max + 1; i < sq->size; i++) {
-		assert (sq->items_inuse[i] == 0);
+	if (sq->pos_max + 1 < sq->size) {
+		i = sq->pos_max + 1;
+		assert (sq_bitmap_run (sq->items_inuse, i, sq->size - i, 0) == sq->size - i);
 	}
 }
 
@@ -196,7 +303,7 @@ static inline void sq_copy (struct sq *sq_dest, const struct sq *sq_src)
 	memcpy (sq_dest->items, sq_src->items,
 		sq_src->item_count * sq_src->size_per_item);
 	memcpy (sq_dest->items_inuse, sq_src->items_inuse,
-		sq_src->item_count * sizeof (unsigned int));
+		sq_bitmap_words (sq_src->item_count) * sizeof (unsigned long));
 	memcpy (sq_dest->items_miss_count, sq_src->items_miss_count,
 		sq_src->item_count * sizeof (unsigned int));
 }
@@ -233,13 +340,9 @@ static inline void *sq_item_add (
 
 	sq_item = sq->items;
 	sq_item += sq_position * sq->size_per_item;
-	assert(sq->items_inuse[sq_position] == 0);
+	assert(sq_bitmap_test (sq->items_inuse, sq_position) == 0);
 	memcpy (sq_item, item, sq->size_per_item);
-	if (seqid == 0) {
-		sq->items_inuse[sq_position] = 1;
-	} else {
-		sq->items_inuse[sq_position] = seqid;
-	}
+	sq->items_inuse[sq_position / SQ_BITS_PER_WORD] |= 1UL << (sq_position % SQ_BITS_PER_WORD);
 	sq->items_miss_count[sq_position] = 0;
 
 	return (sq_item);
@@ -270,7 +373,75 @@ static inline unsigned int sq_item_inuse (
 	}
 #endif
 	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
-	return (sq->items_inuse[sq_position] != 0);
+	return (sq_bitmap_test (sq->items_inuse, sq_position));
+}
+
+/**
+ * @brief sq_items_run
+ * Return number of consecutive items starting with seq_id (at most count)
+ * which are in use (inuse != 0) or missing (inuse == 0).
+ * @param sq
+ * @param seq_id
+ * @param count
+ * @param inuse
+ * @return
+ */
+static inline unsigned int sq_items_run (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count,
+	int inuse)
+{
+	unsigned int sq_position;
+	unsigned int first;
+	unsigned int res;
+
+	if (count > sq->size) {
+		count = sq->size;
+	}
+
+	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
+	first = sq->size - sq_position;
+	if (first > count) {
+		first = count;
+	}
+
+	res = sq_bitmap_run (sq->items_inuse, sq_position, first, inuse);
+	if (res == first && first < count) {
+		res += sq_bitmap_run (sq->items_inuse, 0, count - first, inuse);
+	}
+
+	return (res);
+}
+
+/**
+ * @brief sq_items_inuse_run
+ * @param sq
+ * @param seq_id
+ * @param count
+ * @return number of consecutive items in use starting with seq_id (at most count)
+ */
+static inline unsigned int sq_items_inuse_run (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count)
+{
+	return (sq_items_run (sq, seq_id, count, 1));
+}
+
+/**
+ * @brief sq_items_hole_run
+ * @param sq
+ * @param seq_id
+ * @param count
+ * @return number of consecutive missing items starting with seq_id (at most count)
+ */
+static inline unsigned int sq_items_hole_run (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count)
+{
+	return (sq_items_run (sq, seq_id, count, 0));
 }
 
 /**
@@ -365,7 +536,7 @@ static inline unsigned int sq_item_get (
 //	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
 //printf ("sq_position = %x\n", sq_position);
 //printf ("ITEMGET %d %d %d %d\n", sq_position, sq->head, sq->head_seqid, seq_id);
-	if (sq->items_inuse[sq_position] == 0) {
+	if (sq_bitmap_test (sq->items_inuse, sq_position) == 0) {
 		return (ENOENT);
 	}
 	sq_item = sq->items;
@@ -387,14 +558,12 @@ static inline void sq_items_release (struct sq *sq, unsigned int seqid)
 
 	sq->head = (sq->head + seqid - sq->head_seqid + 1) % sq->size;
 	if ((oldhead + seqid - sq->head_seqid + 1) > sq->size) {
-//		printf ("releasing %d for %d\n", oldhead, sq->size - oldhead);
-//		printf ("releasing %d for %d\n", 0, sq->head);
-		memset (&sq->items_inuse[oldhead], 0, (sq->size - oldhead) * sizeof (unsigned int));
-		memset (sq->items_inuse, 0, sq->head * sizeof (unsigned int));
+		sq_bitmap_clear (sq->items_inuse, oldhead, sq->size - oldhead);
+		sq_bitmap_clear (sq->items_inuse, 0, sq->head);
+		memset (&sq->items_miss_count[oldhead], 0, (sq->size - oldhead) * sizeof (unsigned int));
+		memset (sq->items_miss_count, 0, sq->head * sizeof (unsigned int));
 	} else {
-//		printf ("releasing %d for %d\n", oldhead, seqid - sq->head_seqid + 1);
-		memset (&sq->items_inuse[oldhead], 0,
-			(seqid - sq->head_seqid + 1) * sizeof (unsigned int));
+		sq_bitmap_clear (sq->items_inuse, oldhead, seqid - sq->head_seqid + 1);
 		memset (&sq->items_miss_count[oldhead], 0,
 			(seqid - sq->head_seqid + 1) * sizeof (unsigned int));
 	}
@@ -61,6 +61,11 @@
  */
 #define UDP_RECEIVE_FRAME_SIZE_MAX     (PROCESSOR_COUNT_MAX * (INTERFACE_MAX * 2 * sizeof(struct totem_ip_address)) + 1024)
 
+/*
+ * Maximum number of datagrams totemudp and totemudpu receive per wakeup
+ */
+#define UDP_RECV_BATCH_MAX	64
+
 #define TRANSMITS_ALLOWED	16
 #define SEND_THREADS_MAX	16
 
@@ -209,6 +214,8 @@ struct totem_config {
 
 	unsigned int net_mtu;
 
+	unsigned int udp_recv_batch;
+
 	unsigned int threads;
 
 	unsigned int heartbeat_failures_allowed;
@@ -247,6 +254,8 @@ struct totem_config {
 
 	unsigned int cancel_token_hold_on_retransmit;
 
+	unsigned int window_adaptive;
+
 	unsigned char ip_dscp;
 
 	void (*totem_memb_ring_id_create_or_load) (
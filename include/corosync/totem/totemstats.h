@@ -48,8 +48,77 @@ typedef struct {
 	uint64_t rx;
 	uint64_t tx;
 	int backlog_calc;
+	uint32_t retransmits;
+	uint32_t delivered;
 } totemsrp_token_stats_t;
 
+/*
+ * Log-linear (HDR style) histogram. Values below 2^TOTEM_HISTOGRAM_SUB_BITS
+ * have their own bucket, larger values share a bucket with values having the
+ * same TOTEM_HISTOGRAM_SUB_BITS + 1 most significant bits, so the error is
+ * below 1 / 2^TOTEM_HISTOGRAM_SUB_BITS. Values are capped at UINT32_MAX.
+ */
+#define TOTEM_HISTOGRAM_SUB_BITS	4
+#define TOTEM_HISTOGRAM_SUB_COUNT	(1 << TOTEM_HISTOGRAM_SUB_BITS)
+#define TOTEM_HISTOGRAM_BUCKETS		((32 - TOTEM_HISTOGRAM_SUB_BITS + 1) * TOTEM_HISTOGRAM_SUB_COUNT)
+
+typedef struct {
+	uint64_t count;
+	uint64_t max;
+	uint32_t bucket[TOTEM_HISTOGRAM_BUCKETS];
+} totem_histogram_t;
+
+typedef struct {
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+} totem_histogram_summary_t;
+
+static inline unsigned int totem_histogram_bucket (uint64_t value)
+{
+	unsigned int msb;
+
+	if (value > UINT32_MAX) {
+		value = UINT32_MAX;
+	}
+
+	if (value < TOTEM_HISTOGRAM_SUB_COUNT) {
+		return ((unsigned int)value);
+	}
+
+	for (msb = TOTEM_HISTOGRAM_SUB_BITS; (value >> (msb + 1)) != 0; msb++) ;
+
+	return (((msb - TOTEM_HISTOGRAM_SUB_BITS + 1) << TOTEM_HISTOGRAM_SUB_BITS) +
+	    (unsigned int)((value >> (msb - TOTEM_HISTOGRAM_SUB_BITS)) - TOTEM_HISTOGRAM_SUB_COUNT));
+}
+
+/*
+ * Highest value falling into bucket
+ */
+static inline uint64_t totem_histogram_bucket_value (unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < TOTEM_HISTOGRAM_SUB_COUNT) {
+		return (bucket);
+	}
+
+	shift = (bucket >> TOTEM_HISTOGRAM_SUB_BITS) - 1;
+
+	return ((((uint64_t)TOTEM_HISTOGRAM_SUB_COUNT + (bucket & (TOTEM_HISTOGRAM_SUB_COUNT - 1))) << shift) +
+	    ((uint64_t)1 << shift) - 1);
+}
+
+static inline void totem_histogram_record (totem_histogram_t *histogram, uint64_t value)
+{
+	histogram->bucket[totem_histogram_bucket (value)]++;
+	histogram->count++;
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+}
+
 typedef struct {
 	totem_stats_header_t hdr;
 	uint64_t orf_token_tx;
@@ -84,6 +153,28 @@ typedef struct {
 	uint32_t avg_token_workload;
 	uint32_t avg_backlog_calc;
 
+	uint32_t frame_pool_small_frames;
+	uint32_t frame_pool_small_free;
+	uint32_t frame_pool_full_frames;
+	uint32_t frame_pool_full_free;
+	uint64_t frame_pool_fallback;
+
+	uint32_t fcc_window;
+	uint64_t fcc_window_decreases;
+
+	/*
+	 * Histograms are filled by totemsrp for every token, summaries are
+	 * refreshed by the stats updater. Times are in microseconds.
+	 */
+	totem_histogram_t token_rotation_histogram;
+	totem_histogram_t token_hold_histogram;
+	totem_histogram_t token_retransmits_histogram;
+	totem_histogram_t token_delivered_histogram;
+	totem_histogram_summary_t token_rotation;
+	totem_histogram_summary_t token_hold;
+	totem_histogram_summary_t token_retransmits;
+	totem_histogram_summary_t token_delivered;
+
 	int earliest_token;
 	int latest_token;
 #define TOTEM_TOKEN_STATS_MAX 100
@@ -46,6 +46,7 @@
 #include <corosync/corodefs.h>
 #include <corosync/hdb.h>
 #include <qb/qbipcc.h>
+#include <qb/qblist.h>
 
 #include <corosync/cmap.h>
 #include <corosync/ipc_cmap.h>
@@ -53,10 +54,33 @@
 #include "util.h"
 #include <stdio.h>
 
+/*
+ * Size of batch requested by cmap_iter_next_value. Bigger batch (up to IPC_RESPONSE_SIZE)
+ * is requested only when key doesn't fit.
+ */
+#define CMAP_ITER_BATCH_SIZE	(IPC_RESPONSE_SIZE / 16)
+#define CMAP_ITER_BATCH_MAX_SIZE	(IPC_RESPONSE_SIZE - 1024)
+
 struct cmap_inst {
 	int finalize;
 	qb_ipcc_connection_t *c;
 	const void *context;
+	struct qb_list_head iter_list_head;
+};
+
+/*
+ * Client side state of iterator. Keys received in last batch are stored in
+ * batch and returned one by one by cmap_iter_next_value.
+ */
+struct cmap_iter_inst {
+	cmap_iter_handle_t iter_handle;
+	struct res_lib_cmap_iter_next_batch *batch;
+	size_t batch_allocated;
+	size_t pos;
+	uint32_t items_left;
+	int end;
+	int legacy; /* executive doesn't know MESSAGE_REQ_CMAP_ITER_NEXT_BATCH */
+	struct qb_list_head list;
 };
 
 struct cmap_track_inst {
@@ -66,10 +90,23 @@ struct cmap_track_inst {
 	cmap_track_handle_t track_handle;
 };
 
+/*
+ * Snapshot data are stored in same format as received from server
+ * (array of res_lib_cmap_snapshot_item)
+ */
+struct cmap_snapshot_inst {
+	char *data;
+	size_t data_len;
+	size_t data_allocated;
+	size_t pos;
+};
+
 static void cmap_inst_free (void *inst);
+static void cmap_snapshot_inst_free (void *inst);
 
 DECLARE_HDB_DATABASE(cmap_handle_t_db, cmap_inst_free);
 DECLARE_HDB_DATABASE(cmap_track_handle_t_db,NULL);
+DECLARE_HDB_DATABASE(cmap_snapshot_handle_t_db, cmap_snapshot_inst_free);
 
 /*
  * Function prototypes
@@ -103,6 +140,7 @@ cs_error_t cmap_initialize (cmap_handle_t *handle)
 
 	error = CS_OK;
 	cmap_inst->finalize = 0;
+	qb_list_init(&cmap_inst->iter_list_head);
 	cmap_inst->c = qb_ipcc_connect("cmap", IPC_REQUEST_SIZE);
 	if (cmap_inst->c == NULL) {
 		error = qb_to_cs_error(-errno);
@@ -164,12 +202,66 @@ cs_error_t cmap_initialize_map (cmap_handle_t *handle,
 	return (error);
 }
 
+static void cmap_iter_inst_free (struct cmap_iter_inst *cmap_iter_inst)
+{
+	qb_list_del(&cmap_iter_inst->list);
+	free(cmap_iter_inst->batch);
+	free(cmap_iter_inst);
+}
+
 static void cmap_inst_free (void *inst)
 {
 	struct cmap_inst *cmap_inst = (struct cmap_inst *)inst;
+	struct cmap_iter_inst *cmap_iter_inst;
+	struct qb_list_head *iter, *tmp_iter;
+
+	qb_list_for_each_safe(iter, tmp_iter, &cmap_inst->iter_list_head) {
+		cmap_iter_inst = qb_list_entry(iter, struct cmap_iter_inst, list);
+		cmap_iter_inst_free(cmap_iter_inst);
+	}
+
+	qb_list_init(&cmap_inst->iter_list_head);
 	qb_ipcc_disconnect(cmap_inst->c);
 }
 
+/*
+ * Check that data_len bytes of data contain items res_lib_cmap_snapshot_item.
+ * Length of items is stored in items_len and
+ * pointer to last item in last_item (NULL if there are no items).
+ */
+static cs_error_t cmap_items_validate(
+	const mar_uint8_t *data,
+	size_t data_len,
+	uint32_t items,
+	size_t *items_len,
+	const struct res_lib_cmap_snapshot_item **last_item)
+{
+	const struct res_lib_cmap_snapshot_item *item;
+	size_t pos;
+	uint32_t i;
+
+	pos = 0;
+	item = NULL;
+	for (i = 0; i < items; i++) {
+		if (pos + sizeof(*item) > data_len) {
+			return (CS_ERR_MESSAGE_ERROR);
+		}
+
+		item = (const struct res_lib_cmap_snapshot_item *)(data + pos);
+		if (item->key_len > CMAP_KEYNAME_MAXLEN ||
+		    pos + CMAP_SNAPSHOT_ITEM_SIZE(item->key_len, item->value_len) > data_len) {
+			return (CS_ERR_MESSAGE_ERROR);
+		}
+
+		pos += CMAP_SNAPSHOT_ITEM_SIZE(item->key_len, item->value_len);
+	}
+
+	*items_len = pos;
+	*last_item = item;
+
+	return (CS_OK);
+}
+
 cs_error_t cmap_finalize(cmap_handle_t handle)
 {
 	struct cmap_inst *cmap_inst;
@@ -226,6 +318,52 @@ cs_error_t cmap_fd_get(cmap_handle_t handle, int *fd)
 	return (error);
 }
 
+/*
+ * Call notify_fn of tracker for one notification. Notification of
+ * tracker already deleted by user is ignored.
+ */
+static cs_error_t cmap_notify_dispatch(
+	cmap_handle_t handle,
+	const struct res_lib_cmap_notify_callback *res_lib_cmap_notify_callback)
+{
+	struct cmap_track_inst *cmap_track_inst;
+	struct cmap_notify_value old_val;
+	struct cmap_notify_value new_val;
+	cs_error_t error;
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_track_handle_t_db,
+			res_lib_cmap_notify_callback->track_inst_handle,
+			(void *)&cmap_track_inst));
+	if (error == CS_ERR_BAD_HANDLE) {
+		/*
+		 * User deleted tracker -> ignore error
+		 */
+		return (CS_OK);
+	}
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	new_val.type = res_lib_cmap_notify_callback->new_value_type;
+	old_val.type = res_lib_cmap_notify_callback->old_value_type;
+	new_val.len = res_lib_cmap_notify_callback->new_value_len;
+	old_val.len = res_lib_cmap_notify_callback->old_value_len;
+	new_val.data = res_lib_cmap_notify_callback->new_value;
+	old_val.data = (((const char *)res_lib_cmap_notify_callback->new_value) + new_val.len);
+
+	cmap_track_inst->notify_fn(handle,
+			cmap_track_inst->track_handle,
+			res_lib_cmap_notify_callback->event,
+			(char *)res_lib_cmap_notify_callback->key_name.value,
+			new_val,
+			old_val,
+			cmap_track_inst->user_data);
+
+	(void)hdb_handle_put(&cmap_track_handle_t_db, res_lib_cmap_notify_callback->track_inst_handle);
+
+	return (CS_OK);
+}
+
 cs_error_t cmap_dispatch (
 	cmap_handle_t handle,
         cs_dispatch_flags_t dispatch_types)
@@ -237,9 +375,9 @@ cs_error_t cmap_dispatch (
 	struct qb_ipc_response_header *dispatch_data;
 	char dispatch_buf[IPC_DISPATCH_SIZE];
 	struct res_lib_cmap_notify_callback *res_lib_cmap_notify_callback;
-	struct cmap_track_inst *cmap_track_inst;
-	struct cmap_notify_value old_val;
-	struct cmap_notify_value new_val;
+	struct res_lib_cmap_notify_batch_callback *res_lib_cmap_notify_batch_callback;
+	size_t batch_pos;
+	uint32_t i;
 
 	error = hdb_error_to_cs(hdb_handle_get (&cmap_handle_t_db, handle, (void *)&cmap_inst));
 	if (error != CS_OK) {
@@ -292,35 +430,39 @@ cs_error_t cmap_dispatch (
 		case MESSAGE_RES_CMAP_NOTIFY_CALLBACK:
 			res_lib_cmap_notify_callback = (struct res_lib_cmap_notify_callback *)dispatch_data;
 
-			error = hdb_error_to_cs(hdb_handle_get(&cmap_track_handle_t_db,
-					res_lib_cmap_notify_callback->track_inst_handle,
-					(void *)&cmap_track_inst));
-			if (error == CS_ERR_BAD_HANDLE) {
-				/*
-				 * User deleted tracker -> ignore error
-				 */
-				 break;
-			}
+			error = cmap_notify_dispatch(handle, res_lib_cmap_notify_callback);
 			if (error != CS_OK) {
 				goto error_put;
 			}
+			break;
+		case MESSAGE_RES_CMAP_NOTIFY_BATCH_CALLBACK:
+			res_lib_cmap_notify_batch_callback = (struct res_lib_cmap_notify_batch_callback *)dispatch_data;
+			batch_pos = sizeof(struct res_lib_cmap_notify_batch_callback);
+
+			for (i = 0; i < res_lib_cmap_notify_batch_callback->items; i++) {
+				res_lib_cmap_notify_callback = (struct res_lib_cmap_notify_callback *)
+					(dispatch_buf + batch_pos);
+
+				if (batch_pos + sizeof(struct res_lib_cmap_notify_callback) > dispatch_data->size ||
+				    res_lib_cmap_notify_callback->header.size < sizeof(struct res_lib_cmap_notify_callback) ||
+				    batch_pos + res_lib_cmap_notify_callback->header.size > dispatch_data->size) {
+					error = CS_ERR_LIBRARY;
+					goto error_put;
+				}
+				batch_pos += CMAP_NOTIFY_BATCH_ALIGN(res_lib_cmap_notify_callback->header.size);
+
+				error = cmap_notify_dispatch(handle, res_lib_cmap_notify_callback);
+				if (error != CS_OK) {
+					goto error_put;
+				}
 
-			new_val.type = res_lib_cmap_notify_callback->new_value_type;
-			old_val.type = res_lib_cmap_notify_callback->old_value_type;
-			new_val.len = res_lib_cmap_notify_callback->new_value_len;
-			old_val.len = res_lib_cmap_notify_callback->old_value_len;
-			new_val.data = res_lib_cmap_notify_callback->new_value;
-			old_val.data = (((const char *)res_lib_cmap_notify_callback->new_value) + new_val.len);
-
-			cmap_track_inst->notify_fn(handle,
-					cmap_track_inst->track_handle,
-					res_lib_cmap_notify_callback->event,
-					(char *)res_lib_cmap_notify_callback->key_name.value,
-					new_val,
-					old_val,
-					cmap_track_inst->user_data);
-
-			(void)hdb_handle_put(&cmap_track_handle_t_db, res_lib_cmap_notify_callback->track_inst_handle);
+				/*
+				 * Rest of the batch is dropped if the callback finalized the handle
+				 */
+				if (cmap_inst->finalize) {
+					break;
+				}
+			}
 			break;
 		default:
 			error = CS_ERR_LIBRARY;
@@ -830,6 +972,7 @@ cs_error_t cmap_iter_init(
 	struct cmap_inst *cmap_inst;
 	struct req_lib_cmap_iter_init req_lib_cmap_iter_init;
 	struct res_lib_cmap_iter_init res_lib_cmap_iter_init;
+	struct cmap_iter_inst *cmap_iter_inst;
 
 	if (cmap_iter_handle == NULL) {
 		return (CS_ERR_INVALID_PARAM);
@@ -867,6 +1010,20 @@ cs_error_t cmap_iter_init(
 	}
 
 	if (error == CS_OK) {
+		cmap_iter_inst = malloc(sizeof(*cmap_iter_inst));
+		if (cmap_iter_inst == NULL) {
+			error = CS_ERR_NO_MEMORY;
+			(void)hdb_handle_put (&cmap_handle_t_db, handle);
+			(void)cmap_iter_finalize(handle, res_lib_cmap_iter_init.iter_handle);
+
+			return (error);
+		}
+
+		memset(cmap_iter_inst, 0, sizeof(*cmap_iter_inst));
+		cmap_iter_inst->iter_handle = res_lib_cmap_iter_init.iter_handle;
+		qb_list_init(&cmap_iter_inst->list);
+		qb_list_add(&cmap_iter_inst->list, &cmap_inst->iter_list_head);
+
 		*cmap_iter_handle = res_lib_cmap_iter_init.iter_handle;
 	}
 
@@ -875,66 +1032,358 @@ cs_error_t cmap_iter_init(
 	return (error);
 }
 
-cs_error_t cmap_iter_next(
-		cmap_handle_t handle,
-		cmap_iter_handle_t iter_handle,
-		char key_name[],
-		size_t *value_len,
-		cmap_value_types_t *type)
+static struct cmap_iter_inst *cmap_iter_inst_find(
+	struct cmap_inst *cmap_inst,
+	cmap_iter_handle_t iter_handle)
 {
-	cs_error_t error;
-	struct iovec iov;
-	struct cmap_inst *cmap_inst;
-	struct req_lib_cmap_iter_next req_lib_cmap_iter_next;
-	struct res_lib_cmap_iter_next res_lib_cmap_iter_next;
+	struct cmap_iter_inst *cmap_iter_inst;
+	struct qb_list_head *iter;
 
-	if (key_name == NULL) {
-		return (CS_ERR_INVALID_PARAM);
+	qb_list_for_each(iter, &cmap_inst->iter_list_head) {
+		cmap_iter_inst = qb_list_entry(iter, struct cmap_iter_inst, list);
+
+		if (cmap_iter_inst->iter_handle == iter_handle) {
+			return (cmap_iter_inst);
+		}
 	}
 
-	error = hdb_error_to_cs(hdb_handle_get (&cmap_handle_t_db, handle, (void *)&cmap_inst));
+	return (NULL);
+}
+
+/*
+ * Make sure batch buffer of iterator has at least size bytes
+ */
+static cs_error_t cmap_iter_batch_reserve(
+	struct cmap_iter_inst *cmap_iter_inst,
+	size_t size)
+{
+	struct res_lib_cmap_iter_next_batch *batch;
+
+	if (cmap_iter_inst->batch_allocated < size) {
+		batch = realloc(cmap_iter_inst->batch, size);
+		if (batch == NULL) {
+			return (CS_ERR_NO_MEMORY);
+		}
+
+		cmap_iter_inst->batch = batch;
+		cmap_iter_inst->batch_allocated = size;
+	}
+
+	return (CS_OK);
+}
+
+/*
+ * Receive next batch of keys (of maximum size max_size) from server
+ */
+static cs_error_t cmap_iter_fetch(
+	struct cmap_inst *cmap_inst,
+	struct cmap_iter_inst *cmap_iter_inst,
+	size_t max_size)
+{
+	cs_error_t error;
+	struct iovec iov;
+	struct req_lib_cmap_iter_next_batch req_lib_cmap_iter_next_batch;
+	struct res_lib_cmap_iter_next_batch *res_lib_cmap_iter_next_batch;
+	const struct res_lib_cmap_snapshot_item *last_item;
+	size_t items_len;
+
+	error = cmap_iter_batch_reserve(cmap_iter_inst, max_size);
 	if (error != CS_OK) {
 		return (error);
 	}
+	res_lib_cmap_iter_next_batch = cmap_iter_inst->batch;
+
+	cmap_iter_inst->pos = 0;
+	cmap_iter_inst->items_left = 0;
 
-	memset(&req_lib_cmap_iter_next, 0, sizeof(req_lib_cmap_iter_next));
-	req_lib_cmap_iter_next.header.size = sizeof(req_lib_cmap_iter_next);
-	req_lib_cmap_iter_next.header.id = MESSAGE_REQ_CMAP_ITER_NEXT;
-	req_lib_cmap_iter_next.iter_handle = iter_handle;
+	memset(&req_lib_cmap_iter_next_batch, 0, sizeof(req_lib_cmap_iter_next_batch));
+	req_lib_cmap_iter_next_batch.header.size = sizeof(req_lib_cmap_iter_next_batch);
+	req_lib_cmap_iter_next_batch.header.id = MESSAGE_REQ_CMAP_ITER_NEXT_BATCH;
+	req_lib_cmap_iter_next_batch.iter_handle = cmap_iter_inst->iter_handle;
+	req_lib_cmap_iter_next_batch.max_size = max_size;
 
-	iov.iov_base = (char *)&req_lib_cmap_iter_next;
-	iov.iov_len = sizeof(req_lib_cmap_iter_next);
+	iov.iov_base = (char *)&req_lib_cmap_iter_next_batch;
+	iov.iov_len = sizeof(req_lib_cmap_iter_next_batch);
 
 	error = qb_to_cs_error(qb_ipcc_sendv_recv(
 		cmap_inst->c,
 		&iov,
 		1,
-		&res_lib_cmap_iter_next,
-		sizeof (struct res_lib_cmap_iter_next), CS_IPC_TIMEOUT_MS));
+		res_lib_cmap_iter_next_batch,
+		max_size, CS_IPC_TIMEOUT_MS));
+
+	if (error == CS_OK) {
+		error = res_lib_cmap_iter_next_batch->header.error;
+	}
+
+	if (error == CS_OK && res_lib_cmap_iter_next_batch->header.size < sizeof(*res_lib_cmap_iter_next_batch)) {
+		error = CS_ERR_MESSAGE_ERROR;
+	}
 
 	if (error == CS_OK) {
-		error = res_lib_cmap_iter_next.header.error;
+		error = cmap_items_validate(res_lib_cmap_iter_next_batch->data,
+		    res_lib_cmap_iter_next_batch->header.size - sizeof(*res_lib_cmap_iter_next_batch),
+		    res_lib_cmap_iter_next_batch->items, &items_len, &last_item);
 	}
 
 	if (error == CS_OK) {
-		memcpy(key_name, (const char *)res_lib_cmap_iter_next.key_name.value,
-		    res_lib_cmap_iter_next.key_name.length);
-		key_name[res_lib_cmap_iter_next.key_name.length] = '\0';
+		cmap_iter_inst->items_left = res_lib_cmap_iter_next_batch->items;
+		cmap_iter_inst->end = res_lib_cmap_iter_next_batch->end;
+	}
 
-		if (value_len != NULL) {
-			*value_len = res_lib_cmap_iter_next.value_len;
+	return (error);
+}
+
+/*
+ * Receive next key by MESSAGE_REQ_CMAP_ITER_NEXT and store it as single item
+ * batch. Used by cmap_iter_next and with executive without
+ * MESSAGE_REQ_CMAP_ITER_NEXT_BATCH support. Value is fetched by cmap_get
+ * only if with_value is set.
+ */
+static cs_error_t cmap_iter_fetch_legacy(
+	cmap_handle_t handle,
+	struct cmap_inst *cmap_inst,
+	struct cmap_iter_inst *cmap_iter_inst,
+	int with_value)
+{
+	cs_error_t error;
+	struct iovec iov;
+	struct req_lib_cmap_iter_next req_lib_cmap_iter_next;
+	struct res_lib_cmap_iter_next res_lib_cmap_iter_next;
+	struct res_lib_cmap_snapshot_item *item;
+	char key_name[CMAP_KEYNAME_MAXLEN + 1];
+	size_t key_len;
+	size_t value_len;
+	cmap_value_types_t type;
+
+	cmap_iter_inst->pos = 0;
+	cmap_iter_inst->items_left = 0;
+
+	do {
+		memset(&req_lib_cmap_iter_next, 0, sizeof(req_lib_cmap_iter_next));
+		req_lib_cmap_iter_next.header.size = sizeof(req_lib_cmap_iter_next);
+		req_lib_cmap_iter_next.header.id = MESSAGE_REQ_CMAP_ITER_NEXT;
+		req_lib_cmap_iter_next.iter_handle = cmap_iter_inst->iter_handle;
+
+		iov.iov_base = (char *)&req_lib_cmap_iter_next;
+		iov.iov_len = sizeof(req_lib_cmap_iter_next);
+
+		error = qb_to_cs_error(qb_ipcc_sendv_recv(
+			cmap_inst->c,
+			&iov,
+			1,
+			&res_lib_cmap_iter_next,
+			sizeof (struct res_lib_cmap_iter_next), CS_IPC_TIMEOUT_MS));
+
+		if (error == CS_OK) {
+			error = res_lib_cmap_iter_next.header.error;
 		}
 
-		if (type != NULL) {
-			*type = res_lib_cmap_iter_next.type;
+		if (error != CS_OK) {
+			return (error);
+		}
+
+		key_len = res_lib_cmap_iter_next.key_name.length;
+		if (key_len > CMAP_KEYNAME_MAXLEN) {
+			return (CS_ERR_MESSAGE_ERROR);
+		}
+		memcpy(key_name, res_lib_cmap_iter_next.key_name.value, key_len);
+		key_name[key_len] = '\0';
+
+		value_len = res_lib_cmap_iter_next.value_len;
+		type = res_lib_cmap_iter_next.type;
+
+		if (with_value) {
+			/*
+			 * Key may change or disappear between iter_next and get
+			 */
+			error = cmap_get(handle, key_name, NULL, &value_len, &type);
+			if (error == CS_ERR_NOT_EXIST) {
+				continue;
+			}
+			if (error != CS_OK) {
+				return (error);
+			}
+		}
+
+		error = cmap_iter_batch_reserve(cmap_iter_inst, sizeof(struct res_lib_cmap_iter_next_batch) +
+		    CMAP_SNAPSHOT_ITEM_SIZE(key_len, with_value ? value_len : 0));
+		if (error != CS_OK) {
+			return (error);
+		}
+
+		item = (struct res_lib_cmap_snapshot_item *)cmap_iter_inst->batch->data;
+		memset(item, 0, sizeof(*item));
+		memcpy(item->data, key_name, key_len + 1);
+		item->key_len = key_len;
+		item->value_len = value_len;
+		item->type = type;
+
+		if (with_value) {
+			error = cmap_get(handle, key_name, item->data + CMAP_SNAPSHOT_VALUE_OFFSET(key_len),
+			    &value_len, &type);
+			if (error == CS_ERR_NOT_EXIST) {
+				continue;
+			}
+			if (error != CS_OK) {
+				return (error);
+			}
+			item->value_len = value_len;
+			item->type = type;
+		}
+
+		cmap_iter_inst->items_left = 1;
+	} while (cmap_iter_inst->items_left == 0);
+
+	return (CS_OK);
+}
+
+/*
+ * Return next item of iteration. Item is valid only until next call.
+ * Value of item is defined only if with_value is set. Without batched
+ * every key is requested from the server when it's returned.
+ */
+static cs_error_t cmap_iter_next_item(
+	cmap_handle_t handle,
+	cmap_iter_handle_t iter_handle,
+	int with_value,
+	int batched,
+	const struct res_lib_cmap_snapshot_item **item)
+{
+	cs_error_t error;
+	struct cmap_inst *cmap_inst;
+	struct cmap_iter_inst *cmap_iter_inst;
+
+	error = hdb_error_to_cs(hdb_handle_get (&cmap_handle_t_db, handle, (void *)&cmap_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	cmap_iter_inst = cmap_iter_inst_find(cmap_inst, iter_handle);
+	if (cmap_iter_inst == NULL) {
+		error = CS_ERR_BAD_HANDLE;
+		goto error_put;
+	}
+
+	if (cmap_iter_inst->items_left == 0) {
+		if (cmap_iter_inst->end) {
+			error = CS_ERR_NO_SECTIONS;
+			goto error_put;
+		}
+
+		if (batched && !cmap_iter_inst->legacy) {
+			error = cmap_iter_fetch(cmap_inst, cmap_iter_inst, CMAP_ITER_BATCH_SIZE);
+			if (error == CS_ERR_TOO_BIG) {
+				error = cmap_iter_fetch(cmap_inst, cmap_iter_inst, CMAP_ITER_BATCH_MAX_SIZE);
+			}
+
+			if (error == CS_ERR_INVALID_PARAM || error == CS_ERR_NOT_SUPPORTED) {
+				/*
+				 * Older executive doesn't know batch request,
+				 * use one request per key from now on
+				 */
+				cmap_iter_inst->legacy = 1;
+			}
+		}
+
+		if (!batched || cmap_iter_inst->legacy) {
+			error = cmap_iter_fetch_legacy(handle, cmap_inst, cmap_iter_inst, with_value);
+		}
+
+		if (error != CS_OK) {
+			goto error_put;
+		}
+
+		if (cmap_iter_inst->items_left == 0) {
+			error = CS_ERR_NO_SECTIONS;
+			goto error_put;
 		}
 	}
 
+	*item = (const struct res_lib_cmap_snapshot_item *)(cmap_iter_inst->batch->data + cmap_iter_inst->pos);
+	cmap_iter_inst->pos += CMAP_SNAPSHOT_ITEM_SIZE((*item)->key_len, (*item)->value_len);
+	cmap_iter_inst->items_left--;
+
+error_put:
 	(void)hdb_handle_put (&cmap_handle_t_db, handle);
 
 	return (error);
 }
 
+cs_error_t cmap_iter_next(
+		cmap_handle_t handle,
+		cmap_iter_handle_t iter_handle,
+		char key_name[],
+		size_t *value_len,
+		cmap_value_types_t *type)
+{
+	cs_error_t error;
+	const struct res_lib_cmap_snapshot_item *item;
+
+	if (key_name == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	/*
+	 * One request per key, so the key is current when it's returned
+	 */
+	error = cmap_iter_next_item(handle, iter_handle, 0, 0, &item);
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	memcpy(key_name, (const char *)item->data, item->key_len);
+	key_name[item->key_len] = '\0';
+
+	if (value_len != NULL) {
+		*value_len = item->value_len;
+	}
+
+	if (type != NULL) {
+		*type = item->type;
+	}
+
+	return (CS_OK);
+}
+
+cs_error_t cmap_iter_next_value(
+		cmap_handle_t handle,
+		cmap_iter_handle_t iter_handle,
+		char key_name[],
+		const void **value,
+		size_t *value_len,
+		cmap_value_types_t *type)
+{
+	cs_error_t error;
+	const struct res_lib_cmap_snapshot_item *item;
+
+	if (key_name == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	error = cmap_iter_next_item(handle, iter_handle, value != NULL, 1, &item);
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	memcpy(key_name, (const char *)item->data, item->key_len);
+	key_name[item->key_len] = '\0';
+
+	if (value != NULL) {
+		*value = item->data + CMAP_SNAPSHOT_VALUE_OFFSET(item->key_len);
+	}
+
+	if (value_len != NULL) {
+		*value_len = item->value_len;
+	}
+
+	if (type != NULL) {
+		*type = item->type;
+	}
+
+	return (CS_OK);
+}
+
 cs_error_t cmap_iter_finalize(
 		cmap_handle_t handle,
 		cmap_iter_handle_t iter_handle)
@@ -944,12 +1393,18 @@ cs_error_t cmap_iter_finalize(
 	struct cmap_inst *cmap_inst;
 	struct req_lib_cmap_iter_finalize req_lib_cmap_iter_finalize;
 	struct res_lib_cmap_iter_finalize res_lib_cmap_iter_finalize;
+	struct cmap_iter_inst *cmap_iter_inst;
 
 	error = hdb_error_to_cs(hdb_handle_get (&cmap_handle_t_db, handle, (void *)&cmap_inst));
 	if (error != CS_OK) {
 		return (error);
 	}
 
+	cmap_iter_inst = cmap_iter_inst_find(cmap_inst, iter_handle);
+	if (cmap_iter_inst != NULL) {
+		cmap_iter_inst_free(cmap_iter_inst);
+	}
+
 	memset(&req_lib_cmap_iter_finalize, 0, sizeof(req_lib_cmap_iter_finalize));
 	req_lib_cmap_iter_finalize.header.size = sizeof(req_lib_cmap_iter_finalize);
 	req_lib_cmap_iter_finalize.header.id = MESSAGE_REQ_CMAP_ITER_FINALIZE;
@@ -974,6 +1429,236 @@ cs_error_t cmap_iter_finalize(
 	return (error);
 }
 
+static void cmap_snapshot_inst_free (void *inst)
+{
+	struct cmap_snapshot_inst *cmap_snapshot_inst = (struct cmap_snapshot_inst *)inst;
+
+	free(cmap_snapshot_inst->data);
+}
+
+/*
+ * Append items of one snapshot page to snapshot instance. Name of last key is
+ * stored into last_key so next page can continue after it.
+ */
+static cs_error_t cmap_snapshot_append(
+	struct cmap_snapshot_inst *cmap_snapshot_inst,
+	const struct res_lib_cmap_snapshot *res_lib_cmap_snapshot,
+	mar_name_t *last_key)
+{
+	const struct res_lib_cmap_snapshot_item *item;
+	size_t new_allocated;
+	size_t pos;
+	char *new_data;
+	cs_error_t error;
+
+	if (res_lib_cmap_snapshot->header.size < sizeof(*res_lib_cmap_snapshot)) {
+		return (CS_ERR_MESSAGE_ERROR);
+	}
+
+	/*
+	 * Validate items before they are copied
+	 */
+	error = cmap_items_validate(res_lib_cmap_snapshot->data,
+	    res_lib_cmap_snapshot->header.size - sizeof(*res_lib_cmap_snapshot),
+	    res_lib_cmap_snapshot->items, &pos, &item);
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	if (item == NULL) {
+		return (CS_OK);
+	}
+
+	memcpy(last_key->value, item->data, item->key_len);
+	last_key->length = item->key_len;
+
+	if (cmap_snapshot_inst->data_len + pos > cmap_snapshot_inst->data_allocated) {
+		new_allocated = (cmap_snapshot_inst->data_allocated + pos) * 2;
+		new_data = realloc(cmap_snapshot_inst->data, new_allocated);
+		if (new_data == NULL) {
+			return (CS_ERR_NO_MEMORY);
+		}
+
+		cmap_snapshot_inst->data = new_data;
+		cmap_snapshot_inst->data_allocated = new_allocated;
+	}
+
+	memcpy(cmap_snapshot_inst->data + cmap_snapshot_inst->data_len, res_lib_cmap_snapshot->data, pos);
+	cmap_snapshot_inst->data_len += pos;
+
+	return (CS_OK);
+}
+
+cs_error_t cmap_snapshot_create(
+		cmap_handle_t handle,
+		const char *prefix,
+		cmap_snapshot_handle_t *cmap_snapshot_handle)
+{
+	cs_error_t error;
+	struct iovec iov;
+	struct cmap_inst *cmap_inst;
+	struct cmap_snapshot_inst *cmap_snapshot_inst;
+	struct req_lib_cmap_snapshot req_lib_cmap_snapshot;
+	struct res_lib_cmap_snapshot *res_lib_cmap_snapshot;
+	size_t res_size;
+
+	if (cmap_snapshot_handle == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	if (prefix != NULL && strlen(prefix) >= CS_MAX_NAME_LENGTH) {
+		return (CS_ERR_NAME_TOO_LONG);
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get (&cmap_handle_t_db, handle, (void *)&cmap_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	res_size = IPC_RESPONSE_SIZE - 1024;
+	res_lib_cmap_snapshot = malloc(res_size);
+	if (res_lib_cmap_snapshot == NULL) {
+		error = CS_ERR_NO_MEMORY;
+		goto error_put;
+	}
+
+	error = hdb_error_to_cs(hdb_handle_create(&cmap_snapshot_handle_t_db,
+	    sizeof(*cmap_snapshot_inst), cmap_snapshot_handle));
+	if (error != CS_OK) {
+		goto error_free;
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_snapshot_handle_t_db,
+	    *cmap_snapshot_handle, (void *)&cmap_snapshot_inst));
+	if (error != CS_OK) {
+		goto error_destroy;
+	}
+
+	memset(&req_lib_cmap_snapshot, 0, sizeof(req_lib_cmap_snapshot));
+	req_lib_cmap_snapshot.header.size = sizeof(req_lib_cmap_snapshot);
+	req_lib_cmap_snapshot.header.id = MESSAGE_REQ_CMAP_SNAPSHOT;
+	req_lib_cmap_snapshot.max_size = res_size;
+
+	if (prefix) {
+		memcpy(req_lib_cmap_snapshot.prefix.value, prefix, strlen(prefix));
+		req_lib_cmap_snapshot.prefix.length = strlen(prefix);
+	}
+
+	iov.iov_base = (char *)&req_lib_cmap_snapshot;
+	iov.iov_len = sizeof(req_lib_cmap_snapshot);
+
+	/*
+	 * Keys which don't fit into one response are requested in next page
+	 */
+	do {
+		error = qb_to_cs_error(qb_ipcc_sendv_recv(
+			cmap_inst->c,
+			&iov,
+			1,
+			res_lib_cmap_snapshot,
+			res_size, CS_IPC_TIMEOUT_MS));
+
+		if (error == CS_OK) {
+			error = res_lib_cmap_snapshot->header.error;
+		}
+
+		if (error == CS_OK) {
+			error = cmap_snapshot_append(cmap_snapshot_inst, res_lib_cmap_snapshot,
+			    &req_lib_cmap_snapshot.start_after);
+		}
+	} while (error == CS_OK && res_lib_cmap_snapshot->more);
+
+	(void)hdb_handle_put (&cmap_snapshot_handle_t_db, *cmap_snapshot_handle);
+
+	if (error != CS_OK) {
+		goto error_destroy;
+	}
+
+	free(res_lib_cmap_snapshot);
+	(void)hdb_handle_put (&cmap_handle_t_db, handle);
+
+	return (CS_OK);
+
+error_destroy:
+	(void)hdb_handle_destroy (&cmap_snapshot_handle_t_db, *cmap_snapshot_handle);
+
+error_free:
+	free(res_lib_cmap_snapshot);
+
+error_put:
+	(void)hdb_handle_put (&cmap_handle_t_db, handle);
+
+	return (error);
+}
+
+cs_error_t cmap_snapshot_next(
+		cmap_snapshot_handle_t snapshot_handle,
+		const char **key_name,
+		const void **value,
+		size_t *value_len,
+		cmap_value_types_t *type)
+{
+	cs_error_t error;
+	struct cmap_snapshot_inst *cmap_snapshot_inst;
+	const struct res_lib_cmap_snapshot_item *item;
+
+	if (key_name == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get (&cmap_snapshot_handle_t_db, snapshot_handle,
+	    (void *)&cmap_snapshot_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	if (cmap_snapshot_inst->pos >= cmap_snapshot_inst->data_len) {
+		error = CS_ERR_NO_SECTIONS;
+		goto error_put;
+	}
+
+	item = (const struct res_lib_cmap_snapshot_item *)(cmap_snapshot_inst->data + cmap_snapshot_inst->pos);
+
+	*key_name = (const char *)item->data;
+
+	if (value != NULL) {
+		*value = item->data + CMAP_SNAPSHOT_VALUE_OFFSET(item->key_len);
+	}
+
+	if (value_len != NULL) {
+		*value_len = item->value_len;
+	}
+
+	if (type != NULL) {
+		*type = item->type;
+	}
+
+	cmap_snapshot_inst->pos += CMAP_SNAPSHOT_ITEM_SIZE(item->key_len, item->value_len);
+
+error_put:
+	(void)hdb_handle_put (&cmap_snapshot_handle_t_db, snapshot_handle);
+
+	return (error);
+}
+
+cs_error_t cmap_snapshot_free(cmap_snapshot_handle_t snapshot_handle)
+{
+	cs_error_t error;
+	struct cmap_snapshot_inst *cmap_snapshot_inst;
+
+	error = hdb_error_to_cs(hdb_handle_get (&cmap_snapshot_handle_t_db, snapshot_handle,
+	    (void *)&cmap_snapshot_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	(void)hdb_handle_destroy (&cmap_snapshot_handle_t_db, snapshot_handle);
+
+	(void)hdb_handle_put (&cmap_snapshot_handle_t_db, snapshot_handle);
+
+	return (CS_OK);
+}
+
 cs_error_t cmap_track_add(
 	cmap_handle_t handle,
 	const char *key_name,
@@ -51,6 +51,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <limits.h>
+#include <assert.h>
 
 #include <qb/qblist.h>
 #include <qb/qbdefs.h>
@@ -75,6 +76,11 @@
  */
 #define MAX_RETRIES 100
 
+/*
+ * Number of pipelined fragments a large message may have outstanding
+ */
+#define CPG_PIPELINE_WINDOW 8
+
 /*
  * ZCB files have following umask (umask is same as used in libqb)
  */
@@ -99,6 +105,7 @@ struct cpg_inst {
 	};
 	struct qb_list_head iteration_list_head;
 	uint32_t max_msg_size;
+	int partial_pipeline; /* 1 if the executive acked pipelined fragments, -1 if it is too old */
 	struct qb_list_head assembly_list_head;
 };
 static void cpg_inst_free (void *inst);
@@ -216,7 +223,8 @@ cs_error_t cpg_model_initialize (
 		switch (model) {
 		case CPG_MODEL_V1:
 			memcpy (&cpg_inst->model_v1_data, model_data, sizeof (cpg_model_v1_data_t));
-			if ((cpg_inst->model_v1_data.flags & ~(CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF)) != 0) {
+			if ((cpg_inst->model_v1_data.flags & ~(CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF |
+			    CPG_MODEL_V1_DELIVER_BATCHED)) != 0) {
 				error = CS_ERR_INVALID_PARAM;
 
 				goto error_destroy;
@@ -227,6 +235,7 @@ cs_error_t cpg_model_initialize (
 
 	/* Allow space for corosync internal headers */
 	cpg_inst->max_msg_size = IPC_REQUEST_SIZE - 1024;
+	cpg_inst->partial_pipeline = 0;
 	cpg_inst->model_data.model = model;
 	cpg_inst->context = context;
 
@@ -377,6 +386,7 @@ cs_error_t cpg_dispatch (
 	struct cpg_inst *cpg_inst;
 	struct res_lib_cpg_confchg_callback *res_cpg_confchg_callback;
 	struct res_lib_cpg_deliver_callback *res_cpg_deliver_callback;
+	struct res_lib_cpg_deliver_batch_callback *res_cpg_deliver_batch_callback;
 	struct res_lib_cpg_partial_deliver_callback *res_cpg_partial_deliver_callback;
 	struct res_lib_cpg_totem_confchg_callback *res_cpg_totem_confchg_callback;
 	struct cpg_inst cpg_inst_copy;
@@ -393,6 +403,7 @@ cs_error_t cpg_dispatch (
 	struct cpg_ring_id ring_id;
 	uint32_t totem_member_list[CPG_MEMBERS_MAX];
 	int32_t errno_res;
+	size_t batch_pos;
 	char dispatch_buf[IPC_DISPATCH_SIZE];
 
 	error = hdb_error_to_cs (hdb_handle_get (&cpg_handle_t_db, handle, (void *)&cpg_inst));
@@ -469,6 +480,46 @@ cs_error_t cpg_dispatch (
 					res_cpg_deliver_callback->msglen);
 				break;
 
+			case MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK:
+				res_cpg_deliver_batch_callback = (struct res_lib_cpg_deliver_batch_callback *)dispatch_data;
+				batch_pos = sizeof (struct res_lib_cpg_deliver_batch_callback);
+
+				for (i = 0; i < res_cpg_deliver_batch_callback->items; i++) {
+					res_cpg_deliver_callback = (struct res_lib_cpg_deliver_callback *)
+						(dispatch_buf + batch_pos);
+
+					if (batch_pos + sizeof (struct res_lib_cpg_deliver_callback) > dispatch_data->size ||
+					    res_cpg_deliver_callback->header.size < sizeof (struct res_lib_cpg_deliver_callback) ||
+					    batch_pos + res_cpg_deliver_callback->header.size > dispatch_data->size) {
+						error = CS_ERR_LIBRARY;
+						goto error_put;
+					}
+					batch_pos += CPG_DELIVER_BATCH_ALIGN (res_cpg_deliver_callback->header.size);
+
+					if (cpg_inst_copy.model_v1_data.cpg_deliver_fn == NULL) {
+						continue;
+					}
+
+					marshall_from_mar_cpg_name_t (
+						&group_name,
+						&res_cpg_deliver_callback->group_name);
+
+					cpg_inst_copy.model_v1_data.cpg_deliver_fn (handle,
+						&group_name,
+						res_cpg_deliver_callback->nodeid,
+						res_cpg_deliver_callback->pid,
+						&res_cpg_deliver_callback->message,
+						res_cpg_deliver_callback->msglen);
+
+					/*
+					 * Rest of the batch is dropped if the callback finalized the handle
+					 */
+					if (cpg_inst->finalize) {
+						break;
+					}
+				}
+				break;
+
 			case MESSAGE_RES_CPG_PARTIAL_DELIVER_CALLBACK:
 				res_cpg_partial_deliver_callback = (struct res_lib_cpg_partial_deliver_callback *)dispatch_data;
 
@@ -1119,6 +1170,210 @@ error_exit:
 	return (error);
 }
 
+/*
+ * Locate the fragment starting at byte offset of the message. Fragment
+ * boundaries only depend on the offset, so a resent fragment is the same
+ * as the one sent before.
+ */
+static void pipeline_fragment_get (
+	const struct iovec *iovec,
+	unsigned int iov_len,
+	size_t offset,
+	size_t frag_max,
+	struct iovec *frag)
+{
+	unsigned int i;
+
+	for (i = 0; i < iov_len; i++) {
+		if (offset < iovec[i].iov_len) {
+			break;
+		}
+		offset -= iovec[i].iov_len;
+	}
+	assert (i < iov_len);
+
+	frag->iov_base = (char *)iovec[i].iov_base + offset;
+	frag->iov_len = iovec[i].iov_len - offset;
+	if (frag->iov_len > frag_max) {
+		frag->iov_len = frag_max;
+	}
+}
+
+/*
+ * Stream the fragments without waiting for each one to be sent. At most
+ * CPG_PIPELINE_WINDOW fragments are outstanding, which fits the request
+ * ring, and the executive acks every CPG_PIPELINE_WINDOW / 2 of them and
+ * the last one. When a fragment could not be sent the executive drops it
+ * and everything behind it and answers with CS_ERR_TRY_AGAIN once totem
+ * made progress, so after reading all outstanding acks we resend from
+ * the acked offset. Blocking is done in qb_ipcc_recv, no polling.
+ *
+ * Returns CS_ERR_NOT_SUPPORTED if the executive doesn't know the request,
+ * in which case nothing was sent.
+ */
+static cs_error_t send_fragments_pipelined (
+	struct cpg_inst *cpg_inst,
+	cpg_guarantee_t guarantee,
+	size_t msg_len,
+	const struct iovec *iovec,
+	unsigned int iov_len)
+{
+	cs_error_t error = CS_OK;
+	cs_error_t stop_error = CS_OK;
+	struct iovec iov[2];
+	struct req_lib_cpg_partial_mcast_pipelined req_lib_cpg_mcast;
+	struct res_lib_cpg_partial_send_ack res_lib_cpg_partial_send_ack;
+	size_t frag_end[CPG_PIPELINE_WINDOW];
+	unsigned int frag_head = 0;
+	unsigned int frag_count = 0;
+	unsigned int window;
+	unsigned int since_ack = 0;
+	unsigned int acks_outstanding = 0;
+	size_t frag_max = cpg_inst->max_msg_size / CPG_PIPELINE_WINDOW;
+	size_t sent = 0;
+	size_t acked = 0;
+	int retry_count = 0;
+	int32_t res;
+
+	/*
+	 * The executive does flow control of pipelined fragments itself,
+	 * the libqb one would only stall the window
+	 */
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  0);
+
+	req_lib_cpg_mcast.header.id = MESSAGE_REQ_CPG_PARTIAL_MCAST_PIPELINED;
+	req_lib_cpg_mcast.guarantee = guarantee;
+	req_lib_cpg_mcast.msglen = msg_len;
+
+	iov[0].iov_base = (void *)&req_lib_cpg_mcast;
+	iov[0].iov_len = sizeof (struct req_lib_cpg_partial_mcast_pipelined);
+
+	while (acked < msg_len) {
+		/*
+		 * Until the executive acked the first fragment it is not known
+		 * to support pipelining, so only one fragment is sent
+		 */
+		window = (cpg_inst->partial_pipeline == 1) ? CPG_PIPELINE_WINDOW : 1;
+
+		if (stop_error == CS_OK && sent < msg_len && frag_count < window) {
+			pipeline_fragment_get (iovec, iov_len, sent, frag_max, &iov[1]);
+
+			if (sent == 0) {
+				req_lib_cpg_mcast.type = LIBCPG_PARTIAL_FIRST;
+			} else if (sent + iov[1].iov_len == msg_len) {
+				req_lib_cpg_mcast.type = LIBCPG_PARTIAL_LAST;
+			} else {
+				req_lib_cpg_mcast.type = LIBCPG_PARTIAL_CONTINUED;
+			}
+			req_lib_cpg_mcast.ack_request =
+				(req_lib_cpg_mcast.type == LIBCPG_PARTIAL_LAST ||
+				 since_ack + 1 >= window / 2 ||
+				 frag_count + 1 >= window);
+			req_lib_cpg_mcast.offset = sent;
+			req_lib_cpg_mcast.fraglen = iov[1].iov_len;
+			req_lib_cpg_mcast.header.size = sizeof (struct req_lib_cpg_partial_mcast_pipelined) +
+				iov[1].iov_len;
+
+			res = qb_ipcc_sendv (cpg_inst->c, iov, 2);
+			if (res >= 0) {
+				frag_end[(frag_head + frag_count) % CPG_PIPELINE_WINDOW] = sent + iov[1].iov_len;
+				frag_count++;
+				sent += iov[1].iov_len;
+				if (req_lib_cpg_mcast.ack_request) {
+					acks_outstanding++;
+					since_ack = 0;
+				} else {
+					since_ack++;
+				}
+				continue;
+			}
+			if (res != -EAGAIN || acks_outstanding == 0) {
+				error = qb_to_cs_error (res);
+				goto error_exit;
+			}
+			/*
+			 * Request ring is full, wait for the executive to catch up
+			 */
+		}
+
+		if (acks_outstanding == 0) {
+			/*
+			 * Everything sent since the error was seen has been
+			 * processed, so the executive expects the acked offset next
+			 */
+			if (stop_error != CS_ERR_TRY_AGAIN || ++retry_count > MAX_RETRIES) {
+				error = (stop_error != CS_OK) ? stop_error : CS_ERR_LIBRARY;
+				goto error_exit;
+			}
+			stop_error = CS_OK;
+			sent = acked;
+			frag_count = 0;
+			since_ack = 0;
+			continue;
+		}
+
+		res = qb_ipcc_recv (cpg_inst->c, &res_lib_cpg_partial_send_ack,
+			sizeof (res_lib_cpg_partial_send_ack), CS_IPC_TIMEOUT_MS);
+		if (res < 0) {
+			error = qb_to_cs_error (res);
+			acks_outstanding = 0;
+			goto error_exit;
+		}
+		acks_outstanding--;
+
+		if (res_lib_cpg_partial_send_ack.header.id != MESSAGE_RES_CPG_PARTIAL_SEND_ACK) {
+			/*
+			 * Generic error response from an executive which doesn't
+			 * know the request. It was the only fragment sent.
+			 */
+			if (cpg_inst->partial_pipeline == 0 &&
+			    res_lib_cpg_partial_send_ack.header.error == CS_ERR_INVALID_PARAM) {
+				cpg_inst->partial_pipeline = -1;
+				error = CS_ERR_NOT_SUPPORTED;
+				goto error_exit;
+			}
+			if (stop_error == CS_OK) {
+				stop_error = res_lib_cpg_partial_send_ack.header.error;
+			}
+			continue;
+		}
+		cpg_inst->partial_pipeline = 1;
+
+		/*
+		 * Like the unpipelined path, MAX_RETRIES applies per fragment,
+		 * so every step forward starts counting again
+		 */
+		if (res_lib_cpg_partial_send_ack.acked > acked) {
+			retry_count = 0;
+		}
+		acked = res_lib_cpg_partial_send_ack.acked;
+		while (frag_count > 0 && frag_end[frag_head] <= acked) {
+			frag_head = (frag_head + 1) % CPG_PIPELINE_WINDOW;
+			frag_count--;
+		}
+
+		if (res_lib_cpg_partial_send_ack.header.error != CS_OK && stop_error == CS_OK) {
+			stop_error = res_lib_cpg_partial_send_ack.header.error;
+		}
+	}
+
+error_exit:
+	/*
+	 * Read acks still outstanding, so they are not taken as the
+	 * response to the next request
+	 */
+	while (acks_outstanding > 0) {
+		if (qb_ipcc_recv (cpg_inst->c, &res_lib_cpg_partial_send_ack,
+		    sizeof (res_lib_cpg_partial_send_ack), CS_IPC_TIMEOUT_MS) < 0) {
+			break;
+		}
+		acks_outstanding--;
+	}
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  1);
+
+	return error;
+}
+
 static cs_error_t send_fragments (
 	struct cpg_inst *cpg_inst,
 	cpg_guarantee_t guarantee,
@@ -1135,6 +1390,14 @@ static cs_error_t send_fragments (
 	size_t iov_sent = 0;
 	int retry_count;
 
+	if (cpg_inst->partial_pipeline >= 0) {
+		error = send_fragments_pipelined (cpg_inst, guarantee, msg_len, iovec, iov_len);
+		if (error != CS_ERR_NOT_SUPPORTED) {
+			return error;
+		}
+		error = CS_OK;
+	}
+
 	req_lib_cpg_mcast.header.id = MESSAGE_REQ_CPG_PARTIAL_MCAST;
 	req_lib_cpg_mcast.guarantee = guarantee;
 	req_lib_cpg_mcast.msglen = msg_len;
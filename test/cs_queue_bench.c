@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the Red Hat, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark of cs_queue. Multiple producer threads add items and main
+ * thread (consumer) removes them. Mutex protected queue (producers are also
+ * serialized by mutex, same as totempg does) is compared with lock-free
+ * mpsc queue.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "../exec/cs_queue.h"
+
+#ifndef timersub
+#define timersub(a, b, result)						\
+	do {								\
+		(result)->tv_sec = (a)->tv_sec - (b)->tv_sec;		\
+		(result)->tv_usec = (a)->tv_usec - (b)->tv_usec;	\
+		if ((result)->tv_usec < 0) {				\
+			--(result)->tv_sec;				\
+			(result)->tv_usec += 1000000;			\
+		}							\
+	} while (0)
+#endif /* timersub */
+
+#define MAX_PRODUCERS	64
+
+struct bench_item {
+	unsigned int producer;
+	unsigned int seq;
+};
+
+static struct cs_queue queue;
+
+static pthread_mutex_t producer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int items_per_producer = 1000000;
+
+static int use_mpsc;
+
+static void *producer_thread (void *arg)
+{
+	struct bench_item item;
+	unsigned int i;
+	int added;
+
+	memset (&item, 0, sizeof (item));
+	item.producer = (unsigned int)(uintptr_t)arg;
+
+	for (i = 0; i < items_per_producer; i++) {
+		item.seq = i;
+
+		do {
+			if (use_mpsc) {
+				added = (!cs_queue_is_full (&queue) &&
+				    cs_queue_item_add (&queue, &item) == 0);
+			} else {
+				pthread_mutex_lock (&producer_mutex);
+				added = !cs_queue_is_full (&queue);
+				if (added) {
+					cs_queue_item_add (&queue, &item);
+				}
+				pthread_mutex_unlock (&producer_mutex);
+			}
+
+			if (!added) {
+				sched_yield ();
+			}
+		} while (!added);
+	}
+
+	return (NULL);
+}
+
+static void cs_queue_benchmark (int mpsc, unsigned int producers, size_t queue_size)
+{
+	pthread_t threads[MAX_PRODUCERS];
+	unsigned int next_seq[MAX_PRODUCERS];
+	struct timeval tv1, tv2, tv_elapsed;
+	struct bench_item *item;
+	unsigned long long total;
+	unsigned long long received;
+	unsigned long long empty_polls;
+	double runtime;
+	unsigned int i;
+	int res;
+
+	use_mpsc = mpsc;
+	if (mpsc) {
+		res = cs_queue_init_mpsc (&queue, queue_size, sizeof (struct bench_item));
+	} else {
+		res = cs_queue_init (&queue, queue_size, sizeof (struct bench_item), 1);
+	}
+	if (res != 0) {
+		fprintf (stderr, "Can't initialize queue\n");
+		exit (EXIT_FAILURE);
+	}
+
+	memset (next_seq, 0, sizeof (next_seq));
+	total = (unsigned long long)producers * items_per_producer;
+	received = 0;
+	empty_polls = 0;
+
+	gettimeofday (&tv1, NULL);
+
+	for (i = 0; i < producers; i++) {
+		if (pthread_create (&threads[i], NULL, producer_thread, (void *)(uintptr_t)i) != 0) {
+			fprintf (stderr, "Can't create producer thread\n");
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	while (received < total) {
+		if (cs_queue_is_empty (&queue)) {
+			empty_polls++;
+			sched_yield ();
+			continue;
+		}
+
+		item = (struct bench_item *)cs_queue_item_get (&queue);
+
+		/*
+		 * Items from one producer must stay in order
+		 */
+		if (item->producer >= producers || item->seq != next_seq[item->producer]) {
+			fprintf (stderr, "Queue corrupted: producer %u seq %u (expected %u)\n",
+				item->producer, item->seq, next_seq[item->producer % producers]);
+			exit (EXIT_FAILURE);
+		}
+		next_seq[item->producer]++;
+
+		cs_queue_item_remove (&queue);
+		received++;
+	}
+
+	for (i = 0; i < producers; i++) {
+		pthread_join (threads[i], NULL);
+	}
+
+	gettimeofday (&tv2, NULL);
+	timersub (&tv2, &tv1, &tv_elapsed);
+	runtime = tv_elapsed.tv_sec + (tv_elapsed.tv_usec / 1000000.0);
+
+	printf ("%-6s %2u producers %10llu items %7.3f Seconds runtime %12.0f items/s "
+		"%5d usedhw %12llu empty polls\n",
+		(mpsc ? "mpsc" : "mutex"), producers, received, runtime,
+		received / runtime, cs_queue_usedhw (&queue), empty_polls);
+
+	cs_queue_free (&queue);
+}
+
+static void usage (const char *name)
+{
+	printf ("usage: %s [-p producers] [-n items per producer] [-q queue size] [-r repeats]\n", name);
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int producers = 4;
+	size_t queue_size = 512;
+	int repeats = 3;
+	int i;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "p:n:q:r:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			producers = atoi (optarg);
+			break;
+		case 'n':
+			items_per_producer = atoi (optarg);
+			break;
+		case 'q':
+			queue_size = atoi (optarg);
+			break;
+		case 'r':
+			repeats = atoi (optarg);
+			break;
+		case 'h':
+		default:
+			usage (argv[0]);
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	if (producers < 1 || producers > MAX_PRODUCERS || queue_size < 2) {
+		usage (argv[0]);
+		exit (EXIT_FAILURE);
+	}
+
+	for (i = 0; i < repeats; i++) {
+		cs_queue_benchmark (0, producers, queue_size);
+		cs_queue_benchmark (1, producers, queue_size);
+	}
+
+	return (0);
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the Red Hat, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Benchmark of sort queue scans used by totemsrp update_aru and messages_free.
+ * Slot by slot loops (sq_item_get/sq_items_release per item) are compared with
+ * word at a time bitmap scans (sq_items_inuse_run/sq_items_hole_run and one
+ * sq_items_release). Results of both are checked to be equal.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <corosync/sq.h>
+
+#define SQ_SIZE		16384
+
+struct sqbench_item {
+	unsigned int seq;
+};
+
+static unsigned long long time_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Fill window of count items starting with head_seqid. Every item is
+ * lost with probability loss_pct and losses come in bursts of burst items.
+ */
+static void sq_fill (struct sq *sq, unsigned int head_seqid, unsigned int count,
+	int loss_pct, unsigned int burst)
+{
+	struct sqbench_item item;
+	unsigned int i;
+	unsigned int lost;
+
+	sq_reinit (sq, head_seqid);
+
+	lost = 0;
+	for (i = 0; i < count; i++) {
+		if (lost == 0 && (rand () % 100) < loss_pct) {
+			lost = burst;
+		}
+		if (lost > 0) {
+			lost--;
+			continue;
+		}
+
+		item.seq = head_seqid + i;
+		sq_item_add (sq, &item, head_seqid + i);
+	}
+}
+
+static unsigned int aru_loop (const struct sq *sq, unsigned int aru, unsigned int range)
+{
+	unsigned int i;
+	void *ptr;
+
+	for (i = 1; i <= range; i++) {
+		if (sq_item_get (sq, aru + i, &ptr) != 0) {
+			break;
+		}
+	}
+
+	return (i - 1);
+}
+
+static unsigned int free_loop (struct sq *sq, unsigned int last_released, unsigned int range)
+{
+	unsigned int i;
+	unsigned int released = 0;
+	void *ptr;
+
+	for (i = 1; i <= range; i++) {
+		if (sq_item_get (sq, last_released + i, &ptr) == 0) {
+			released += ((struct sqbench_item *)ptr)->seq == last_released + i;
+		}
+		sq_items_release (sq, last_released + i);
+	}
+
+	return (released);
+}
+
+static unsigned int free_bitmap (struct sq *sq, unsigned int last_released, unsigned int range)
+{
+	unsigned int i;
+	unsigned int run;
+	unsigned int released = 0;
+	void *ptr;
+
+	i = 1;
+	while (i <= range) {
+		i += sq_items_hole_run (sq, last_released + i, range - i + 1);
+		run = sq_items_inuse_run (sq, last_released + i, range - i + 1);
+
+		for (; run > 0; run--, i++) {
+			if (sq_item_get (sq, last_released + i, &ptr) == 0) {
+				released += ((struct sqbench_item *)ptr)->seq == last_released + i;
+			}
+		}
+	}
+
+	if (range > 0) {
+		sq_items_release (sq, last_released + range);
+	}
+
+	return (released);
+}
+
+static void sqbench (struct sq *sq, unsigned int rounds, int loss_pct, unsigned int burst)
+{
+	unsigned long long aru_loop_ns = 0, aru_bitmap_ns = 0;
+	unsigned long long free_loop_ns = 0, free_bitmap_ns = 0;
+	unsigned long long t;
+	unsigned int head_seqid;
+	unsigned int range;
+	unsigned int r;
+	unsigned int res_loop, res_bitmap;
+	unsigned int round_seed;
+
+	head_seqid = 1;
+	for (r = 0; r < rounds; r++) {
+		/*
+		 * Use sequence numbers around rollover point too
+		 */
+		head_seqid = (r % 2) ? (unsigned int)rand () : head_seqid + SQ_SIZE;
+		range = 1 + rand () % (SQ_SIZE - 1);
+		round_seed = rand ();
+
+		srand (round_seed);
+		sq_fill (sq, head_seqid, range, loss_pct, burst);
+
+		t = time_ns ();
+		res_loop = aru_loop (sq, head_seqid - 1, range);
+		aru_loop_ns += time_ns () - t;
+
+		t = time_ns ();
+		res_bitmap = sq_items_inuse_run (sq, head_seqid, range);
+		aru_bitmap_ns += time_ns () - t;
+
+		if (res_loop != res_bitmap) {
+			fprintf (stderr, "aru mismatch %u != %u\n", res_loop, res_bitmap);
+			exit (EXIT_FAILURE);
+		}
+
+		t = time_ns ();
+		res_loop = free_loop (sq, head_seqid - 1, range);
+		free_loop_ns += time_ns () - t;
+		sq_assert (sq, 0);
+
+		srand (round_seed);
+		sq_fill (sq, head_seqid, range, loss_pct, burst);
+
+		t = time_ns ();
+		res_bitmap = free_bitmap (sq, head_seqid - 1, range);
+		free_bitmap_ns += time_ns () - t;
+
+		if (res_loop != res_bitmap || sq->head_seqid != head_seqid + range) {
+			fprintf (stderr, "release mismatch %u != %u\n", res_loop, res_bitmap);
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	printf ("loss %3d%% burst %4u: update_aru loop %8.1f ns bitmap %8.1f ns, "
+		"messages_free loop %8.1f ns bitmap %8.1f ns\n",
+		loss_pct, burst,
+		(double)aru_loop_ns / rounds, (double)aru_bitmap_ns / rounds,
+		(double)free_loop_ns / rounds, (double)free_bitmap_ns / rounds);
+}
+
+int main (int argc, char *argv[])
+{
+	struct sq sq;
+	unsigned int rounds = 2000;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "r:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			rounds = atoi (optarg);
+			break;
+		case 'h':
+		default:
+			printf ("usage: %s [-r rounds]\n", argv[0]);
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	if (sq_init (&sq, SQ_SIZE, sizeof (struct sqbench_item), 0) != 0) {
+		fprintf (stderr, "Can't initialize sort queue\n");
+		exit (EXIT_FAILURE);
+	}
+
+	srand (time (NULL));
+
+	sqbench (&sq, rounds, 0, 1);
+	sqbench (&sq, rounds, 1, 1);
+	sqbench (&sq, rounds, 1, 64);
+	sqbench (&sq, rounds, 5, 512);
+	sqbench (&sq, rounds, 50, 16);
+
+	sq_free (&sq);
+
+	return (0);
+}
@@ -421,6 +421,7 @@ static int print_iter(cmap_handle_t handle, const char *prefix)
 {
 	cmap_iter_handle_t iter_handle;
 	char key_name[CMAP_KEYNAME_MAXLEN + 1];
+	const void *value;
 	size_t value_len;
 	cmap_value_types_t type;
 	cs_error_t err;
@@ -432,9 +433,10 @@ static int print_iter(cmap_handle_t handle, const char *prefix)
 		exit (EXIT_FAILURE);
 	}
 
-	while ((err = cmap_iter_next(handle, iter_handle, key_name, &value_len, &type)) == CS_OK) {
+	while ((err = cmap_iter_next_value(handle, iter_handle, key_name, &value, &value_len,
+	    &type)) == CS_OK) {
 		no_result = 0;
-		print_key(handle, key_name, value_len, NULL, type);
+		print_key(handle, key_name, value_len, value, type);
 	}
 
 	cmap_iter_finalize(handle, iter_handle);
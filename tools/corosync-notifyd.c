@@ -1182,7 +1182,7 @@ _cs_cmap_init(void)
 
 
 	rc = cmap_track_add(cmap_handle, "runtime.members.",
-			CMAP_TRACK_ADD | CMAP_TRACK_MODIFY | CMAP_TRACK_PREFIX,
+			CMAP_TRACK_ADD | CMAP_TRACK_MODIFY | CMAP_TRACK_PREFIX | CMAP_TRACK_COALESCE,
 			_cs_cmap_members_key_changed,
 			NULL,
 			&cmap_track_handle_runtime_members_key_changed);